@@ -70,11 +70,22 @@ GRANT TRUNCATE ON TABLE compound_stats TO PUBLIC;
 GRANT SELECT ON TABLE sachem_molecule_errors TO PUBLIC;
 
 
-CREATE FUNCTION "sachem_substructure_search"(varchar, int, int = 0, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000) RETURNS SETOF int AS 'MODULE_PATHNAME','lucene_substructure_search' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
-CREATE FUNCTION "sachem_similarity_search"(varchar, int, float4, int = 0) RETURNS TABLE (compound int, score float4) AS 'MODULE_PATHNAME','lucene_similarity_search' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
-CREATE FUNCTION "sachem_sync_data"(boolean = false, boolean = true) RETURNS void AS 'MODULE_PATHNAME','lucene_sync_data' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_search"(varchar, int, int = 0, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int[] = NULL, int = NULL, int = NULL) RETURNS SETOF int AS 'MODULE_PATHNAME','lucene_substructure_search' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_search_batch"(varchar[], int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int[] = NULL, int = NULL, int = NULL) RETURNS TABLE (query_idx int, compound int) AS 'MODULE_PATHNAME','lucene_substructure_search_batch' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_structure_query"(varchar[], varchar[], int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int[] = NULL, int = NULL, int = NULL) RETURNS SETOF int AS 'MODULE_PATHNAME','lucene_structure_query' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_count"(varchar, int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int[] = NULL, int = NULL, int = NULL) RETURNS bigint AS 'MODULE_PATHNAME','lucene_substructure_count' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_estimate"(varchar, int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int = 1000, int[] = NULL, int = NULL, int = NULL, OUT candidates bigint, OUT sampled bigint, OUT estimate float8, OUT lower_bound float8, OUT upper_bound float8) RETURNS record AS 'MODULE_PATHNAME','lucene_substructure_estimate' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_similarity_search"(varchar, int, float4, int = 0, int[] = NULL, int = NULL, int = NULL) RETURNS TABLE (compound int, score float4) AS 'MODULE_PATHNAME','lucene_similarity_search' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_count_similarity_search"(varchar, int, float4, int = 0, int[] = NULL, int = NULL, int = NULL) RETURNS TABLE (compound int, score float4) AS 'MODULE_PATHNAME','lucene_count_similarity_search' LANGUAGE C IMMUTABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_search_range"(varchar, int, int, int, int = 0, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000) RETURNS SETOF int AS 'SELECT sachem_substructure_search($1, $2, $5, $6, $7, $8, $9, $10, $11, NULL, $3, $4)' LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION "sachem_structure_query_range"(varchar[], varchar[], int, int, int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000) RETURNS SETOF int AS 'SELECT sachem_structure_query($1, $2, $3, $6, $7, $8, $9, $10, $11, NULL, $4, $5)' LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION "sachem_substructure_count_range"(varchar, int, int, int, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000) RETURNS bigint AS 'SELECT sachem_substructure_count($1, $2, $5, $6, $7, $8, $9, $10, NULL, $3, $4)' LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION "sachem_similarity_search_range"(varchar, int, float4, int, int, int = 0) RETURNS TABLE (compound int, score float4) AS 'SELECT * FROM sachem_similarity_search($1, $2, $3, $6, NULL, $4, $5)' LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION "sachem_id_ranges"(int) RETURNS TABLE (id_from int, id_to int) AS 'SELECT (n * step)::int, least((n + 1) * step, size)::int FROM (SELECT coalesce(max(id) + 1, 0)::bigint AS size, (coalesce(max(id) + 1, 0)::bigint + $1 - 1) / greatest($1, 1) AS step FROM sachem_molecules) AS molecules, generate_series(0, $1 - 1) AS n WHERE n * step < size' LANGUAGE SQL STABLE PARALLEL SAFE SECURITY DEFINER;
+CREATE FUNCTION "sachem_sync_data"(boolean = false, boolean = true, varchar = '') RETURNS void AS 'MODULE_PATHNAME','lucene_sync_data' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
 CREATE FUNCTION "sachem_cleanup"() RETURNS void AS 'MODULE_PATHNAME','lucene_cleanup' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
-CREATE FUNCTION "sachem_generate_fporder"(int = 1000, boolean = false) RETURNS void AS 'MODULE_PATHNAME','sachem_generate_fporder' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_lucene_benchmark"(int = 100) RETURNS TABLE (layout varchar, index_size bigint, build_time float8, subsearch_time float8, simsearch_time float8) AS 'MODULE_PATHNAME','lucene_benchmark' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_generate_fporder"(int = 1000, boolean = false, float4 = 1.0, int = 0) RETURNS void AS 'MODULE_PATHNAME','sachem_generate_fporder' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
 
 
 CREATE FUNCTION sachem_compound_audit() RETURNS TRIGGER AS
@@ -70,10 +70,11 @@ GRANT TRUNCATE ON TABLE compound_stats TO PUBLIC;
 GRANT SELECT ON TABLE sachem_molecule_errors TO PUBLIC;
 
 
-CREATE FUNCTION "sachem_substructure_search"(varchar, int, int = 0, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000) RETURNS SETOF int AS 'MODULE_PATHNAME','lucy_substructure_search' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
-CREATE FUNCTION "sachem_sync_data"(boolean = false, boolean = true) RETURNS void AS 'MODULE_PATHNAME','lucy_sync_data' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_substructure_search"(varchar, int, int = 0, int = 0, int = 2, int = 0, int = 0, int = 0, int = 5000, int = 0) RETURNS SETOF int AS 'MODULE_PATHNAME','lucy_substructure_search' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_sync_data"(boolean = false, boolean = true, boolean = false) RETURNS void AS 'MODULE_PATHNAME','lucy_sync_data' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
 CREATE FUNCTION "sachem_cleanup"() RETURNS void AS 'MODULE_PATHNAME','lucy_cleanup' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
-CREATE FUNCTION "sachem_generate_fporder"(int = 1000, boolean = false) RETURNS void AS 'MODULE_PATHNAME','sachem_generate_fporder' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_generate_fporder"(int = 1000, boolean = false, float4 = 1.0, int = 0) RETURNS void AS 'MODULE_PATHNAME','sachem_generate_fporder' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
+CREATE FUNCTION "sachem_lucy_benchmark"(int = 100) RETURNS TABLE (screen varchar, index_size bigint, build_time float8, screen_time float8, candidates bigint) AS 'MODULE_PATHNAME','lucy_benchmark' LANGUAGE C IMMUTABLE STRICT SECURITY DEFINER;
 
 
 CREATE FUNCTION sachem_compound_audit() RETURNS TRIGGER AS
@@ -1,8 +1,11 @@
 package cz.iocb.sachem.lucene;
 
 import java.io.IOException;
-import java.util.BitSet;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.LongBuffer;
 import org.apache.lucene.index.LeafReaderContext;
+import org.apache.lucene.index.NumericDocValues;
 import org.apache.lucene.search.SimpleCollector;
 
 
@@ -10,14 +13,18 @@ import org.apache.lucene.search.SimpleCollector;
 public class BitSetCollector extends SimpleCollector
 {
     private final Lucene lucene;
-    private final BitSet bitset;
+    private final LongBuffer words;
     private int docBase;
+    private NumericDocValues ids;
+    private int firstWord;
+    private int lastWord;
 
 
-    BitSetCollector(Lucene lucene, int maxMoleculeId)
+    BitSetCollector(Lucene lucene, ByteBuffer buffer)
     {
         this.lucene = lucene;
-        this.bitset = new BitSet(maxMoleculeId);
+        this.words = buffer.order(ByteOrder.nativeOrder()).asLongBuffer();
+        reset();
     }
 
 
@@ -25,13 +32,31 @@ public class BitSetCollector extends SimpleCollector
     protected void doSetNextReader(LeafReaderContext context) throws IOException
     {
         docBase = context.docBase;
+        ids = lucene.getMoleculeIdValues(context);
     }
 
 
     @Override
     public void collect(int docId) throws IOException
     {
-        bitset.set(lucene.getMoleculeId(docBase + docId));
+        add(ids != null ? Lucene.getValue(ids, docId) : lucene.getMoleculeId(docBase + docId));
+    }
+
+
+    public void add(int id)
+    {
+        int word = id >>> 6;
+
+        if(word >= words.limit())
+            return;
+
+        words.put(word, words.get(word) | 1L << id);
+
+        if(word < firstWord)
+            firstWord = word;
+
+        if(word > lastWord)
+            lastWord = word;
     }
 
 
@@ -42,8 +67,18 @@ public class BitSetCollector extends SimpleCollector
     }
 
 
-    public BitSet getBitSet()
+    public void reset()
+    {
+        firstWord = Integer.MAX_VALUE;
+        lastWord = -1;
+    }
+
+
+    public long getWordRange()
     {
-        return bitset;
+        if(lastWord < 0)
+            return 0;
+
+        return (long) firstWord << 32 | lastWord + 1;
     }
 }
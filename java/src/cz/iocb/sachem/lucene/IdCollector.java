@@ -0,0 +1,57 @@
+package cz.iocb.sachem.lucene;
+
+import java.io.IOException;
+import java.util.Arrays;
+import org.apache.lucene.index.LeafReaderContext;
+import org.apache.lucene.index.NumericDocValues;
+import org.apache.lucene.search.SimpleCollector;
+
+
+
+public class IdCollector extends SimpleCollector
+{
+    private static final int initialCapacity = 1024;
+
+    private final Lucene lucene;
+    private int[] ids = new int[initialCapacity];
+    private int size = 0;
+    private int docBase;
+    private NumericDocValues values;
+
+
+    IdCollector(Lucene lucene)
+    {
+        this.lucene = lucene;
+    }
+
+
+    @Override
+    protected void doSetNextReader(LeafReaderContext context) throws IOException
+    {
+        docBase = context.docBase;
+        values = lucene.getMoleculeIdValues(context);
+    }
+
+
+    @Override
+    public void collect(int docId) throws IOException
+    {
+        if(size == ids.length)
+            ids = Arrays.copyOf(ids, 2 * size);
+
+        ids[size++] = values != null ? Lucene.getValue(values, docId) : lucene.getMoleculeId(docBase + docId);
+    }
+
+
+    @Override
+    public boolean needsScores()
+    {
+        return false;
+    }
+
+
+    public int[] getIds()
+    {
+        return Arrays.copyOf(ids, size);
+    }
+}
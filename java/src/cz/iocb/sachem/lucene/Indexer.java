@@ -1,7 +1,6 @@
 package cz.iocb.sachem.lucene;
 
 import static cz.iocb.sachem.lucene.Settings.idFieldName;
-import static cz.iocb.sachem.lucene.Settings.indexType;
 import static cz.iocb.sachem.lucene.Settings.simSizeFieldName;
 import static cz.iocb.sachem.lucene.Settings.simfpFieldName;
 import static cz.iocb.sachem.lucene.Settings.subfpFieldName;
@@ -9,10 +8,13 @@ import java.io.IOException;
 import java.nio.file.Paths;
 import org.apache.lucene.document.Document;
 import org.apache.lucene.document.IntPoint;
+import org.apache.lucene.document.NumericDocValuesField;
 import org.apache.lucene.document.StoredField;
 import org.apache.lucene.document.TextField;
+import org.apache.lucene.index.DirectoryReader;
 import org.apache.lucene.index.IndexWriter;
 import org.apache.lucene.index.IndexWriterConfig;
+import org.apache.lucene.index.SegmentInfos;
 import org.apache.lucene.index.SerialMergeScheduler;
 import org.apache.lucene.index.TieredMergePolicy;
 import org.apache.lucene.search.similarities.BooleanSimilarity;
@@ -25,14 +27,25 @@ public class Indexer
 {
     private FSDirectory folder;
     private IndexWriter indexer;
+    private Settings settings;
 
 
-    public void begin(String path) throws IOException
+    /*
+     * Opens the index for changes. The options change the settings stored in the index, or they define the settings
+     * of a new index; null keeps the stored settings. The index type of an existing index cannot be changed.
+     */
+    public void begin(String path, String options) throws IOException
     {
         folder = FSDirectory.open(Paths.get(path));
 
         try
         {
+            Settings stored = readSettings(folder);
+            settings = options == null ? stored : stored.with(options);
+
+            if(DirectoryReader.indexExists(folder) && settings.indexType != stored.indexType)
+                throw new IllegalArgumentException("index type of an existing index cannot be changed");
+
             TieredMergePolicy policy = new TieredMergePolicy();
             policy.setMaxMergeAtOnceExplicit(Integer.MAX_VALUE);
             policy.setMaxMergedSegmentMB(1024 * 1024);
@@ -44,6 +57,7 @@ public class Indexer
             config.setMergeScheduler(new SerialMergeScheduler());
 
             indexer = new IndexWriter(folder, config);
+            indexer.setLiveCommitData(settings.toMap().entrySet());
         }
         catch(Throwable e)
         {
@@ -58,9 +72,12 @@ public class Indexer
         Document document = new Document();
         document.add(new IntPoint(idFieldName, id));
         document.add(new StoredField(idFieldName, id));
+        document.add(new NumericDocValuesField(idFieldName, id));
+        document.add(new IntPoint(simSizeFieldName, simfp.length));
         document.add(new StoredField(simSizeFieldName, simfp.length));
+        document.add(new NumericDocValuesField(simSizeFieldName, simfp.length));
 
-        if(indexType == IndexType.TEXT)
+        if(settings.indexType == IndexType.TEXT)
         {
             document.add(new TextField(subfpFieldName, new FingerprintReader(subfp)));
             document.add(new TextField(simfpFieldName, new FingerprintReader(simfp)));
@@ -78,6 +95,37 @@ public class Indexer
     }
 
 
+    public String getSettings()
+    {
+        return settings.toString();
+    }
+
+
+    /*
+     * Tells whether the options require to build the index at the given path from scratch.
+     */
+    public static boolean requiresRebuild(String path, String options) throws IOException
+    {
+        try(Directory directory = FSDirectory.open(Paths.get(path)))
+        {
+            if(!DirectoryReader.indexExists(directory))
+                return false;
+
+            Settings stored = readSettings(directory);
+            return stored.with(options).indexType != stored.indexType;
+        }
+    }
+
+
+    static Settings readSettings(Directory directory) throws IOException
+    {
+        if(!DirectoryReader.indexExists(directory))
+            return new Settings();
+
+        return new Settings(SegmentInfos.readLatestCommit(directory).getUserData());
+    }
+
+
     public void addIndex(String path) throws IOException
     {
         Directory subFolder = FSDirectory.open(Paths.get(path));
@@ -1,38 +1,52 @@
 package cz.iocb.sachem.lucene;
 
 import static cz.iocb.sachem.lucene.Settings.idFieldName;
-import static cz.iocb.sachem.lucene.Settings.indexType;
-import static cz.iocb.sachem.lucene.Settings.lazyInitialization;
 import static cz.iocb.sachem.lucene.Settings.simSizeFieldName;
 import static cz.iocb.sachem.lucene.Settings.simfpFieldName;
 import static cz.iocb.sachem.lucene.Settings.subfpFieldName;
-import static cz.iocb.sachem.lucene.Settings.useIdTable;
-import static cz.iocb.sachem.lucene.Settings.useSizeTable;
 import static java.nio.file.StandardWatchEventKinds.ENTRY_DELETE;
 import static java.nio.file.StandardWatchEventKinds.OVERFLOW;
 import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.LongBuffer;
 import java.nio.file.FileSystems;
 import java.nio.file.Path;
 import java.nio.file.Paths;
 import java.nio.file.WatchEvent;
 import java.nio.file.WatchKey;
 import java.nio.file.WatchService;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.concurrent.ThreadFactory;
 import org.apache.lucene.document.Document;
 import org.apache.lucene.document.IntPoint;
 import org.apache.lucene.document.StoredField;
 import org.apache.lucene.index.DirectoryReader;
-import org.apache.lucene.index.IndexReader;
+import org.apache.lucene.index.DocValues;
+import org.apache.lucene.index.DocValuesType;
+import org.apache.lucene.index.FieldInfo;
 import org.apache.lucene.index.IndexableField;
 import org.apache.lucene.index.LeafReaderContext;
+import org.apache.lucene.index.NumericDocValues;
 import org.apache.lucene.index.Term;
 import org.apache.lucene.search.BooleanClause;
 import org.apache.lucene.search.BooleanQuery;
 import org.apache.lucene.search.BooleanQuery.Builder;
+import org.apache.lucene.search.BulkScorer;
+import org.apache.lucene.search.Collector;
 import org.apache.lucene.search.ConstantScoreQuery;
 import org.apache.lucene.search.IndexSearcher;
 import org.apache.lucene.search.MatchAllDocsQuery;
+import org.apache.lucene.search.Query;
 import org.apache.lucene.search.SimpleCollector;
 import org.apache.lucene.search.TermQuery;
+import org.apache.lucene.search.Weight;
 import org.apache.lucene.search.similarities.BooleanSimilarity;
 import org.apache.lucene.store.Directory;
 import org.apache.lucene.store.FSDirectory;
@@ -46,6 +60,13 @@ public class Lucene
     private Thread watcher;
     private int[] idTable;
     private int[] sizeTable;
+    private Settings settings = new Settings();
+    private List<LeafReaderContext> subsearchLeaves;
+    private Weight subsearchWeight;
+    private BitSetCollector subsearchCollector;
+    private int subsearchLeaf;
+    private ExecutorService executor;
+    private int threads = 1;
     private final FingerprintTokenizer tokenizer = new FingerprintTokenizer();
 
 
@@ -55,12 +76,22 @@ public class Lucene
 
         Path path = Paths.get(pathName);
         folder = FSDirectory.open(path);
-        IndexReader reader = DirectoryReader.open(folder);
+        DirectoryReader reader = DirectoryReader.open(folder);
         searcher = new IndexSearcher(reader);
         searcher.setSimilarity(new BooleanSimilarity());
 
-        @SuppressWarnings("unused")
-        boolean useCache = useIdTable || useSizeTable;
+        settings = new Settings(reader.getIndexCommit().getUserData());
+        boolean useIdTable = settings.useIdTable;
+        boolean useSizeTable = settings.useSizeTable;
+        boolean lazyInitialization = settings.lazyInitialization;
+
+        /* the id and size tables are needed only if some segments have been written before the doc values were */
+        boolean useDocValues = true;
+
+        for(LeafReaderContext context : reader.leaves())
+            useDocValues &= hasNumericValues(context, idFieldName) && hasNumericValues(context, simSizeFieldName);
+
+        boolean useCache = !useDocValues && (useIdTable || useSizeTable);
 
         if(useCache)
         {
@@ -177,42 +208,232 @@ public class Lucene
     }
 
 
-    public synchronized long[] subsearch(int fp[], int maxMoleculeId) throws IOException
+    /*
+     * Sets the number of threads used to search the index segments concurrently. The pool is kept across the index
+     * changes; one thread means that the segments are searched by the calling thread without any pool.
+     */
+    public synchronized void setThreads(int threads)
     {
+        threads = Math.max(threads, 1);
+
+        if(threads == this.threads)
+            return;
+
+        if(executor != null)
+            executor.shutdown();
+
+        executor = threads == 1 ? null : Executors.newFixedThreadPool(threads, new ThreadFactory()
+        {
+            @Override
+            public Thread newThread(Runnable runnable)
+            {
+                Thread thread = new Thread(runnable);
+                thread.setDaemon(true);
+                return thread;
+            }
+        });
+
+        this.threads = threads;
+    }
+
+
+    public synchronized void subsearch(int fp[], ByteBuffer buffer) throws IOException
+    {
+        Query query;
+
         if(fp.length == 0)
         {
-            BitSetCollector collector = new BitSetCollector(this, maxMoleculeId);
-            searcher.search(new ConstantScoreQuery(new MatchAllDocsQuery()), collector);
-            return collector.getBitSet().toLongArray();
+            query = new ConstantScoreQuery(new MatchAllDocsQuery());
         }
+        else
+        {
+            Builder builder = new BooleanQuery.Builder();
 
+            if(settings.indexType == IndexType.TEXT)
+            {
+                for(int bit : fp)
+                    builder.add(new TermQuery(new Term(subfpFieldName, tokenizer.bitAsString(bit))),
+                            BooleanClause.Occur.MUST);
+            }
+            else
+            {
+                for(int bit : fp)
+                    builder.add(IntPoint.newExactQuery(subfpFieldName, bit), BooleanClause.Occur.MUST);
+            }
 
-        Builder builder = new BooleanQuery.Builder();
+            query = new ConstantScoreQuery(builder.build());
+        }
+
+        subsearchLeaves = searcher.getIndexReader().leaves();
+        subsearchWeight = searcher.createNormalizedWeight(query, false);
+        subsearchCollector = new BitSetCollector(this, buffer);
+        subsearchLeaf = 0;
+    }
 
-        if(indexType == IndexType.TEXT)
+
+    /*
+     * Searches the next index segments (one per thread), so that the caller can verify their hits before the next
+     * ones are searched. It returns the range of the touched words of the bitset packed as (first << 32 | last + 1),
+     * or -1 if all segments have been searched already.
+     */
+    public synchronized long subsearchNext() throws IOException
+    {
+        if(subsearchWeight == null || subsearchLeaf == subsearchLeaves.size())
         {
-            for(int bit : fp)
-                builder.add(new TermQuery(new Term(subfpFieldName, tokenizer.bitAsString(bit))),
-                        BooleanClause.Occur.MUST);
+            subsearchLeaves = null;
+            subsearchWeight = null;
+            subsearchCollector = null;
+            return -1;
+        }
+
+        subsearchCollector.reset();
+
+        if(executor == null)
+        {
+            searchLeaf(subsearchWeight, subsearchLeaves.get(subsearchLeaf++), subsearchCollector);
         }
         else
         {
-            for(int bit : fp)
-                builder.add(IntPoint.newExactQuery(subfpFieldName, bit), BooleanClause.Occur.MUST);
+            /* the threads cannot share the bitset words, so their ids are merged by the calling thread */
+            List<Callable<IdCollector>> tasks = new ArrayList<Callable<IdCollector>>();
+            Weight weight = subsearchWeight;
+
+            while(tasks.size() < threads && subsearchLeaf < subsearchLeaves.size())
+            {
+                LeafReaderContext context = subsearchLeaves.get(subsearchLeaf++);
+                tasks.add(() -> searchLeaf(weight, context, new IdCollector(this)));
+            }
+
+            for(IdCollector collector : invokeAll(tasks))
+                for(int id : collector.getIds())
+                    subsearchCollector.add(id);
         }
 
-        BitSetCollector collector = new BitSetCollector(this, maxMoleculeId);
-        searcher.search(new ConstantScoreQuery(builder.build()), collector);
+        return subsearchCollector.getWordRange();
+    }
+
+
+    /*
+     * The optional restriction is a bitset of the allowed molecule ids in the native byte order, the ids beyond its
+     * end are not allowed.
+     */
+    public synchronized long[] simsearch(int fp[], int top, float cutoff, ByteBuffer restriction) throws IOException
+    {
+        LongBuffer mask = restriction != null ? restriction.order(ByteOrder.nativeOrder()).asLongBuffer() : null;
+        SimilarDocCollector collector = new SimilarDocCollector(this, fp.length, top, cutoff, mask);
+        List<LeafReaderContext> leaves = searcher.getIndexReader().leaves();
+        int minShared = -1;
+        Weight[] weights = null;
+
+        /*
+         * The segments are searched in rounds of one segment per thread, so that the query of the next round can use
+         * the cutoff raised by the top-N hits that have already been collected.
+         */
+        for(int i = 0; i < leaves.size(); i += threads)
+        {
+            float threshold = collector.getThreshold();
+
+            if(getMinShared(fp.length, threshold) > minShared)
+            {
+                minShared = getMinShared(fp.length, threshold);
+                weights = new Weight[2];
+            }
 
-        return collector.getBitSet().toLongArray();
+            if(executor == null)
+            {
+                LeafReaderContext context = leaves.get(i);
+                searchLeaf(getSimilarityWeight(weights, fp, threshold, context), context, collector);
+                continue;
+            }
+
+            List<Callable<SimilarDocCollector>> tasks = new ArrayList<Callable<SimilarDocCollector>>();
+
+            for(int j = i; j < i + threads && j < leaves.size(); j++)
+            {
+                LeafReaderContext context = leaves.get(j);
+                Weight weight = getSimilarityWeight(weights, fp, threshold, context);
+                tasks.add(() -> searchLeaf(weight, context, new SimilarDocCollector(this, fp.length, top, cutoff,
+                        mask)));
+            }
+
+            for(SimilarDocCollector partial : invokeAll(tasks))
+                collector.merge(partial);
+        }
+
+        return collector.getHits();
+    }
+
+
+    private static <T extends Collector> T searchLeaf(Weight weight, LeafReaderContext context, T collector)
+            throws IOException
+    {
+        BulkScorer scorer = weight.bulkScorer(context);
+
+        if(scorer != null)
+            scorer.score(collector.getLeafCollector(context), context.reader().getLiveDocs());
+
+        return collector;
+    }
+
+
+    private <T> List<T> invokeAll(List<Callable<T>> tasks) throws IOException
+    {
+        try
+        {
+            List<T> results = new ArrayList<T>(tasks.size());
+
+            for(Future<T> future : executor.invokeAll(tasks))
+                results.add(future.get());
+
+            return results;
+        }
+        catch(InterruptedException e)
+        {
+            throw new IOException(e);
+        }
+        catch(ExecutionException e)
+        {
+            if(e.getCause() instanceof IOException)
+                throw (IOException) e.getCause();
+
+            throw new IOException(e.getCause());
+        }
+    }
+
+
+    /*
+     * A target sharing s of the q query bits has the Tanimoto score s / (q + t - s) <= s / q, and since s <= t, also
+     * at most q / t. So the target can reach the cutoff only if s >= cutoff * q and t is in [cutoff * q, q / cutoff].
+     */
+    private static int getMinShared(int querySize, float cutoff)
+    {
+        return Math.max(1, (int) Math.ceil((double) cutoff * querySize - 1e-4));
+    }
+
+
+    /*
+     * Segments written before the fingerprint size was indexed as a point cannot be filtered by it, so they are
+     * searched by a weight without the size filter. The weights are created only for the kinds of segments searched.
+     */
+    private Weight getSimilarityWeight(Weight[] weights, int fp[], float cutoff, LeafReaderContext context)
+            throws IOException
+    {
+        FieldInfo sizeInfo = context.reader().getFieldInfos().fieldInfo(simSizeFieldName);
+        boolean sizeFilter = sizeInfo != null && sizeInfo.getPointDimensionCount() > 0;
+        int kind = sizeFilter ? 1 : 0;
+
+        if(weights[kind] == null)
+            weights[kind] = searcher.createNormalizedWeight(getSimilarityQuery(fp, cutoff, sizeFilter), true);
+
+        return weights[kind];
     }
 
 
-    public synchronized ScoreHit[] simsearch(int fp[], int top, float cutoff) throws IOException
+    private Query getSimilarityQuery(int fp[], float cutoff, boolean sizeFilter)
     {
         Builder builder = new BooleanQuery.Builder();
 
-        if(indexType == IndexType.TEXT)
+        if(settings.indexType == IndexType.TEXT)
         {
             for(int bit : fp)
                 builder.add(new TermQuery(new Term(simfpFieldName, tokenizer.bitAsString(bit))),
@@ -224,11 +445,16 @@ public class Lucene
                 builder.add(IntPoint.newExactQuery(simfpFieldName, bit), BooleanClause.Occur.SHOULD);
         }
 
+        int minShared = getMinShared(fp.length, cutoff);
+        builder.setMinimumNumberShouldMatch(minShared);
 
-        SimilarDocCollector collector = new SimilarDocCollector(this, fp.length, top, cutoff);
-        searcher.search(builder.build(), collector);
+        if(sizeFilter && cutoff > 0)
+        {
+            int maxSize = (int) Math.min(Integer.MAX_VALUE, Math.floor(fp.length / (double) cutoff + 1e-4));
+            builder.add(IntPoint.newRangeQuery(simSizeFieldName, minShared, maxSize), BooleanClause.Occur.FILTER);
+        }
 
-        return collector.getDocs();
+        return builder.build();
     }
 
 
@@ -252,15 +478,51 @@ public class Lucene
             folder = null;
             idTable = null;
             sizeTable = null;
+            subsearchLeaves = null;
+            subsearchWeight = null;
+            subsearchCollector = null;
         }
     }
 
 
+    private static boolean hasNumericValues(LeafReaderContext context, String field)
+    {
+        FieldInfo info = context.reader().getFieldInfos().fieldInfo(field);
+        return info != null && info.getDocValuesType() == DocValuesType.NUMERIC;
+    }
+
+
+    /*
+     * Returns null for the segments written before the doc values were added, their values are read from the stored
+     * fields or from the tables.
+     */
+    protected final NumericDocValues getMoleculeIdValues(LeafReaderContext context) throws IOException
+    {
+        return hasNumericValues(context, idFieldName) ? DocValues.getNumeric(context.reader(), idFieldName) : null;
+    }
+
+
+    protected final NumericDocValues getMoleculeSimFpSizeValues(LeafReaderContext context) throws IOException
+    {
+        return hasNumericValues(context, simSizeFieldName) ?
+                DocValues.getNumeric(context.reader(), simSizeFieldName) : null;
+    }
+
+
+    protected static final int getValue(NumericDocValues values, int docId) throws IOException
+    {
+        if(!values.advanceExact(docId))
+            throw new IOException("missing doc value");
+
+        return (int) values.longValue();
+    }
+
+
     protected final int getMoleculeId(int id) throws IOException
     {
-        if(useIdTable)
+        if(settings.useIdTable)
         {
-            if(lazyInitialization && idTable[id] == Integer.MIN_VALUE)
+            if(settings.lazyInitialization && idTable[id] == Integer.MIN_VALUE)
             {
                 Document doc = searcher.doc(id);
                 IndexableField field = doc.getField(idFieldName);
@@ -282,9 +544,9 @@ public class Lucene
 
     protected final int getMoleculeSimFpSize(int id) throws IOException
     {
-        if(useSizeTable)
+        if(settings.useSizeTable)
         {
-            if(lazyInitialization && sizeTable[id] == Integer.MIN_VALUE)
+            if(settings.lazyInitialization && sizeTable[id] == Integer.MIN_VALUE)
             {
                 Document document = searcher.doc(id);
                 StoredField field = (StoredField) document.getField(simSizeFieldName);
@@ -1,5 +1,8 @@
 package cz.iocb.sachem.lucene;
 
+import java.util.HashMap;
+import java.util.Map;
+
 
 enum IndexType
 {
@@ -7,15 +10,106 @@ enum IndexType
 }
 
 
+/*
+ * The layout of an index is chosen when the index is synchronized and it is stored in the commit data of the index,
+ * so that the searchers can read it when they open the index. Indexes without the commit data use the defaults.
+ */
 class Settings
 {
-    static final IndexType indexType = IndexType.TEXT;
-    static final boolean useIdTable = true;
-    static final boolean useSizeTable = true;
-    static final boolean lazyInitialization = true;
-
     static final String idFieldName = "id";
     static final String subfpFieldName = "subfp";
     static final String simfpFieldName = "simfp";
     static final String simSizeFieldName = "simsz";
+
+    static final String indexTypeKey = "indexType";
+    static final String useIdTableKey = "useIdTable";
+    static final String useSizeTableKey = "useSizeTable";
+    static final String lazyInitializationKey = "lazyInitialization";
+
+    IndexType indexType = IndexType.TEXT;
+    boolean useIdTable = true;
+    boolean useSizeTable = true;
+    boolean lazyInitialization = true;
+
+
+    Settings()
+    {
+    }
+
+
+    Settings(Map<String, String> data)
+    {
+        for(Map.Entry<String, String> entry : data.entrySet())
+            set(entry.getKey(), entry.getValue());
+    }
+
+
+    /*
+     * Returns a copy of the settings changed by options in the form "key=value, key=value".
+     */
+    Settings with(String options)
+    {
+        Settings settings = new Settings(toMap());
+
+        for(String option : options.split(","))
+        {
+            if(option.trim().isEmpty())
+                continue;
+
+            String[] pair = option.split("=", 2);
+
+            if(pair.length != 2)
+                throw new IllegalArgumentException("malformed index option '" + option.trim() + "'");
+
+            if(!settings.set(pair[0].trim(), pair[1].trim()))
+                throw new IllegalArgumentException("unknown index option '" + pair[0].trim() + "'");
+        }
+
+        return settings;
+    }
+
+
+    Map<String, String> toMap()
+    {
+        Map<String, String> data = new HashMap<String, String>();
+        data.put(indexTypeKey, indexType.name());
+        data.put(useIdTableKey, Boolean.toString(useIdTable));
+        data.put(useSizeTableKey, Boolean.toString(useSizeTable));
+        data.put(lazyInitializationKey, Boolean.toString(lazyInitialization));
+        return data;
+    }
+
+
+    @Override
+    public String toString()
+    {
+        return indexTypeKey + "=" + indexType.name() + "," + useIdTableKey + "=" + useIdTable + ","
+                + useSizeTableKey + "=" + useSizeTable + "," + lazyInitializationKey + "=" + lazyInitialization;
+    }
+
+
+    private boolean set(String key, String value)
+    {
+        switch(key)
+        {
+            case indexTypeKey:
+                indexType = IndexType.valueOf(value.toUpperCase());
+                return true;
+
+            case useIdTableKey:
+                useIdTable = Boolean.parseBoolean(value);
+                return true;
+
+            case useSizeTableKey:
+                useSizeTable = Boolean.parseBoolean(value);
+                return true;
+
+            case lazyInitializationKey:
+                lazyInitialization = Boolean.parseBoolean(value);
+                return true;
+
+            default:
+                return false;
+        }
+    }
 }
@@ -1,52 +1,46 @@
 package cz.iocb.sachem.lucene;
 
 import java.io.IOException;
-import java.util.ArrayList;
-import java.util.Collections;
-import java.util.Comparator;
+import java.nio.LongBuffer;
+import java.util.Arrays;
 import org.apache.lucene.index.LeafReaderContext;
+import org.apache.lucene.index.NumericDocValues;
 import org.apache.lucene.search.Scorer;
 import org.apache.lucene.search.SimpleCollector;
-import org.apache.lucene.util.PriorityQueue;
 
 
 
+/*
+ * The hits are packed into longs as (score bits << 32 | id). The scores are not negative, so the order of the packed
+ * values follows the order of the scores, and the hits can be kept in a primitive heap or array list and passed to
+ * the native side as one primitive array.
+ */
 public class SimilarDocCollector extends SimpleCollector
 {
+    private static final int initialCapacity = 1024;
+
     private final Lucene lucene;
-    private final PriorityQueue<ScoreHit> queue;
-    private final ArrayList<ScoreHit> list;
     private final int querySize;
     private final int top;
     private final float cutoff;
+    private final LongBuffer mask;
+    private long[] hits;
+    private int size;
     private Scorer scorer;
     private int docBase;
+    private NumericDocValues ids;
+    private NumericDocValues sizes;
 
 
-    SimilarDocCollector(Lucene lucene, int querySize, int top, float cutoff)
+    SimilarDocCollector(Lucene lucene, int querySize, int top, float cutoff, LongBuffer mask)
     {
         this.lucene = lucene;
         this.querySize = querySize;
         this.top = top;
         this.cutoff = cutoff;
-
-        if(top <= 0)
-        {
-            list = new ArrayList<ScoreHit>();
-            queue = null;
-        }
-        else
-        {
-            list = null;
-            queue = new PriorityQueue<ScoreHit>(top)
-            {
-                @Override
-                protected boolean lessThan(ScoreHit a, ScoreHit b)
-                {
-                    return a.score < b.score;
-                }
-            };
-        }
+        this.mask = mask;
+        this.hits = new long[top <= 0 ? initialCapacity : top];
+        this.size = 0;
     }
 
 
@@ -54,6 +48,8 @@ public class SimilarDocCollector extends SimpleCollector
     protected void doSetNextReader(LeafReaderContext context) throws IOException
     {
         docBase = context.docBase;
+        ids = lucene.getMoleculeIdValues(context);
+        sizes = lucene.getMoleculeSimFpSizeValues(context);
     }
 
 
@@ -61,28 +57,76 @@ public class SimilarDocCollector extends SimpleCollector
     public void collect(int docId) throws IOException
     {
         float sharedSize = scorer.score();
-        int targetSize = lucene.getMoleculeSimFpSize(docBase + docId);
+
+        /* the score cannot exceed sharedSize / querySize, so a full queue can reject the hit without its size */
+        if(top > 0 && size == top && sharedSize / querySize <= getScore(hits[0]))
+            return;
+
+        /* the id of a restricted search is read ahead, so that the molecules outside the mask are not scored */
+        int id = 0;
+
+        if(mask != null)
+        {
+            id = ids != null ? Lucene.getValue(ids, docId) : lucene.getMoleculeId(docBase + docId);
+
+            if(id < 0 || id >>> 6 >= mask.limit() || (mask.get(id >>> 6) & 1L << id) == 0)
+                return;
+        }
+
+        int targetSize = sizes != null ? Lucene.getValue(sizes, docId) : lucene.getMoleculeSimFpSize(docBase + docId);
         float score = sharedSize / (querySize + targetSize - sharedSize);
 
         if(score < cutoff)
             return;
 
 
-        int id = lucene.getMoleculeId(docBase + docId);
+        if(mask == null)
+            id = ids != null ? Lucene.getValue(ids, docId) : lucene.getMoleculeId(docBase + docId);
+
+        add((long) Float.floatToIntBits(score) << 32 | id & 0xFFFFFFFFL);
+    }
+
 
-        if(list != null)
+    private void add(long hit)
+    {
+        if(top <= 0)
         {
-            list.add(new ScoreHit(id, score));
+            if(size == hits.length)
+                hits = Arrays.copyOf(hits, 2 * size);
+
+            hits[size++] = hit;
         }
-        else if(queue.size() < top)
+        else if(size < top)
         {
-            queue.add(new ScoreHit(id, score));
+            int i = size++;
+
+            while(i > 0 && hits[(i - 1) / 2] > hit)
+            {
+                hits[i] = hits[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+
+            hits[i] = hit;
         }
-        else if(queue.top().score < score)
+        else if(hits[0] < hit)
         {
-            queue.top().id = id;
-            queue.top().score = score;
-            queue.updateTop();
+            int i = 0;
+
+            while(2 * i + 1 < size)
+            {
+                int child = 2 * i + 1;
+
+                if(child + 1 < size && hits[child + 1] < hits[child])
+                    child++;
+
+                if(hits[child] >= hit)
+                    break;
+
+                hits[i] = hits[child];
+                i = child;
+            }
+
+            hits[i] = hit;
         }
     }
 
@@ -101,30 +145,44 @@ public class SimilarDocCollector extends SimpleCollector
     }
 
 
-    public ScoreHit[] getDocs()
+    /*
+     * Returns the lowest score that a hit can have to be collected. Once the top-N queue is full, it is raised to the
+     * score of its weakest hit.
+     */
+    public float getThreshold()
     {
-        if(list != null)
-        {
-            Collections.sort(list, new Comparator<ScoreHit>()
-            {
-                @Override
-                public int compare(ScoreHit a, ScoreHit b)
-                {
-                    return Float.compare(b.score, a.score);
-                }
-            });
-
-            return list.toArray(new ScoreHit[0]);
-        }
-        else
-        {
-            int size = queue.size();
-            ScoreHit[] array = new ScoreHit[size];
+        if(top > 0 && size == top)
+            return Math.max(cutoff, getScore(hits[0]));
+
+        return cutoff;
+    }
 
-            for(int i = size - 1; i >= 0; i--)
-                array[i] = queue.pop();
 
-            return array;
+    private static float getScore(long hit)
+    {
+        return Float.intBitsToFloat((int) (hit >>> 32));
+    }
+
+
+    public void merge(SimilarDocCollector other)
+    {
+        for(int i = 0; i < other.size; i++)
+            add(other.hits[i]);
+    }
+
+
+    public long[] getHits()
+    {
+        long[] array = Arrays.copyOf(hits, size);
+        Arrays.sort(array);
+
+        for(int i = 0, j = size - 1; i < j; i++, j--)
+        {
+            long hit = array[i];
+            array[i] = array[j];
+            array[j] = hit;
         }
+
+        return array;
     }
 }
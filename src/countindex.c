@@ -0,0 +1,515 @@
+#include <postgres.h>
+#include <executor/spi.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bitset.h"
+#include "countindex.h"
+#include "molecule.h"
+#include "sachem.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define FETCH_SIZE              100000
+#define MOLECULES_TABLE         "sachem_molecules"
+#define AUDIT_TABLE             "sachem_compound_audit"
+
+
+typedef struct
+{
+    CountIndexMolecule molecule;
+    uint64_t offset;
+    uint64_t size;
+} MoleculeRecord;
+
+
+typedef struct
+{
+    MoleculeRecord *records;
+    uint64_t moleculeCount;
+    uint64_t moleculeCapacity;
+    CountIndexItem *items;
+    uint64_t itemCount;
+    uint64_t itemCapacity;
+} MoleculeCollection;
+
+
+static inline int molecule_compare(const CountIndexMolecule *x, const CountIndexMolecule *y)
+{
+    if(x->total != y->total)
+        return x->total < y->total ? -1 : 1;
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+
+static int molecule_record_compare(const void *a, const void *b)
+{
+    return molecule_compare(&((const MoleculeRecord *) a)->molecule, &((const MoleculeRecord *) b)->molecule);
+}
+
+
+static inline bool is_changed(BitSet *changed, int32_t id)
+{
+    return changed != NULL && id < changed->length * BITS_PER_WORD && bitset_get(changed, id);
+}
+
+
+static void collect_molecules(const char *query, MoleculeCollection *collection)
+{
+    collection->moleculeCount = 0;
+    collection->moleculeCapacity = FETCH_SIZE;
+    collection->records = palloc_extended(collection->moleculeCapacity * sizeof(MoleculeRecord), MCXT_ALLOC_HUGE);
+
+    collection->itemCount = 0;
+    collection->itemCapacity = 32 * FETCH_SIZE;
+    collection->items = palloc_extended(collection->itemCapacity * sizeof(CountIndexItem), MCXT_ALLOC_HUGE);
+
+
+    Portal moleculeCursor = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, false,
+            CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+    while(true)
+    {
+        SPI_cursor_fetch(moleculeCursor, true, FETCH_SIZE);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+            elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+        if(SPI_processed == 0)
+            break;
+
+
+        for(size_t i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            char isNullFlag;
+
+            int32_t id = DatumGetInt32(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            Datum moleculeDatum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *moleculeData = DatumGetByteaP(moleculeDatum);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, (uint8_t *) VARDATA(moleculeData));
+
+            CountFingerprint fp = count_similarity_fingerprint_get(&molecule);
+
+
+            if(collection->moleculeCount == collection->moleculeCapacity)
+            {
+                collection->moleculeCapacity *= 2;
+                collection->records = repalloc_huge(collection->records,
+                        collection->moleculeCapacity * sizeof(MoleculeRecord));
+            }
+
+            while(collection->itemCount + fp.size > collection->itemCapacity)
+            {
+                collection->itemCapacity *= 2;
+                collection->items = repalloc_huge(collection->items, collection->itemCapacity * sizeof(CountIndexItem));
+            }
+
+            MoleculeRecord *record = collection->records + collection->moleculeCount++;
+            record->molecule.id = id;
+            record->molecule.total = count_fingerprint_total(fp);
+            record->offset = collection->itemCount;
+            record->size = fp.size;
+
+            for(size_t j = 0; j < fp.size; j++)
+                collection->items[collection->itemCount++] = (CountIndexItem) { .feature = fp.data[j], .count = fp.counts[j] };
+
+            count_fingerprint_free(fp);
+            molecule_simple_free(&molecule);
+
+            if((void *) moleculeData != DatumGetPointer(moleculeDatum))
+                pfree(moleculeData);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(moleculeCursor);
+
+
+    qsort(collection->records, collection->moleculeCount, sizeof(MoleculeRecord), molecule_record_compare);
+}
+
+
+/*
+ * Reads the ids changed by the sync from the audit table and returns their count.
+ */
+static uint64_t collect_changed(BitSet *changed)
+{
+    char isNullFlag;
+
+    if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0), count(*) from " AUDIT_TABLE, false, FETCH_ALL) != SPI_OK_SELECT))
+        elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+    if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2)
+        elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+    int32_t size = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+    uint64_t count = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isNullFlag));
+
+    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+    SPI_freetuptable(SPI_tuptable);
+
+    bitset_init_empty(changed, size);
+
+    if(count == 0)
+        return 0;
+
+
+    Portal auditCursor = SPI_cursor_open_with_args(NULL, "select id from " AUDIT_TABLE, 0, NULL, NULL, NULL, false,
+            CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+    while(true)
+    {
+        SPI_cursor_fetch(auditCursor, true, FETCH_SIZE);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+            elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+        if(SPI_processed == 0)
+            break;
+
+        for(size_t i = 0; i < SPI_processed; i++)
+        {
+            int32_t id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            if(id >= 0)
+                bitset_set(changed, id);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(auditCursor);
+
+    return count;
+}
+
+
+/*
+ * The index consists of the molecule count, the item count, the molecule table sorted by the total feature count,
+ * the item offsets of the molecules, and the sorted (feature, count) items of all molecules. If the index of the
+ * previous version is given, its molecules that were not changed by the sync are merged with the added molecules,
+ * so only the added molecules have to be loaded and fingerprinted.
+ */
+static void count_index_write(const char *indexFilePath, const CountIndex *previous, BitSet *changed)
+{
+    int indexFd = open(indexFilePath, O_EXCL | O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    if(indexFd == -1)
+        elog(ERROR, "%s: open() failed", __func__);
+
+    void *address = MAP_FAILED;
+    uint64_t size = 0;
+
+    PG_TRY();
+    {
+        MoleculeCollection added;
+
+        if(previous == NULL)
+            collect_molecules("select id, molecule from " MOLECULES_TABLE, &added);
+        else
+            collect_molecules("select mol.id, mol.molecule from " MOLECULES_TABLE " mol, " AUDIT_TABLE " aud "
+                    "where mol.id = aud.id", &added);
+
+
+        uint64_t previousCount = previous != NULL ? previous->moleculeCount : 0;
+        uint64_t moleculeCount = added.moleculeCount;
+        uint64_t itemCount = added.itemCount;
+
+        for(uint64_t i = 0; i < previousCount; i++)
+        {
+            if(!is_changed(changed, previous->molecules[i].id))
+            {
+                moleculeCount++;
+                itemCount += previous->offsets[i + 1] - previous->offsets[i];
+            }
+        }
+
+        size = 2 * sizeof(uint64_t) + moleculeCount * sizeof(CountIndexMolecule) +
+                (moleculeCount + 1) * sizeof(uint64_t) + itemCount * sizeof(CountIndexItem);
+
+        if(ftruncate(indexFd, size) != 0)
+            elog(ERROR, "%s: ftruncate() failed", __func__);
+
+        if(unlikely((address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0)) == MAP_FAILED))
+            elog(ERROR, "%s: mmap() failed", __func__);
+
+
+        uint64_t *header = (uint64_t *) address;
+        header[0] = moleculeCount;
+        header[1] = itemCount;
+
+        CountIndexMolecule *molecules = (CountIndexMolecule *) (header + 2);
+        uint64_t *offsets = (uint64_t *) (molecules + moleculeCount);
+        CountIndexItem *items = (CountIndexItem *) (offsets + moleculeCount + 1);
+
+        uint64_t position = 0;
+        uint64_t offset = 0;
+        uint64_t p = 0;
+        uint64_t a = 0;
+
+        while(true)
+        {
+            while(p < previousCount && is_changed(changed, previous->molecules[p].id))
+                p++;
+
+            if(p == previousCount && a == added.moleculeCount)
+                break;
+
+            if(a == added.moleculeCount || (p < previousCount &&
+                    molecule_compare(&previous->molecules[p], &added.records[a].molecule) < 0))
+            {
+                uint64_t count = previous->offsets[p + 1] - previous->offsets[p];
+
+                molecules[position] = previous->molecules[p];
+                memcpy(items + offset, previous->items + previous->offsets[p], count * sizeof(CountIndexItem));
+                offsets[position++] = offset;
+                offset += count;
+                p++;
+            }
+            else
+            {
+                MoleculeRecord *record = &added.records[a++];
+
+                molecules[position] = record->molecule;
+                memcpy(items + offset, added.items + record->offset, record->size * sizeof(CountIndexItem));
+                offsets[position++] = offset;
+                offset += record->size;
+            }
+        }
+
+        offsets[position] = offset;
+
+        pfree(added.records);
+        pfree(added.items);
+
+
+        if(unlikely(munmap(address, size) < 0))
+            elog(ERROR, "%s: munmap() failed", __func__);
+
+        address = MAP_FAILED;
+
+        int fd = indexFd;
+        indexFd = -1;
+
+        if(close(fd) != 0)
+            elog(ERROR, "%s: close() failed", __func__);
+    }
+    PG_CATCH();
+    {
+        if(address != MAP_FAILED)
+            munmap(address, size);
+
+        if(indexFd != -1)
+            close(indexFd);
+
+        unlink(indexFilePath);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+}
+
+
+/*
+ * The index is updated from the index of the previous version (if it exists) by the changes recorded in the audit
+ * table, so it has to be generated before the audit table is cleared. If nothing has changed, the file of the
+ * previous version is shared by a hard link.
+ */
+void sachem_generate_count_index(int indexNumber, int previousNumber)
+{
+    char *indexFilePath = get_index_path(COUNT_INDEX_PREFIX, COUNT_INDEX_SUFFIX, indexNumber);
+    char *previousFilePath = previousNumber >= 0 ?
+            get_index_path(COUNT_INDEX_PREFIX, COUNT_INDEX_SUFFIX, previousNumber) : NULL;
+    struct stat st;
+
+    if(previousFilePath == NULL || stat(previousFilePath, &st) != 0)
+    {
+        count_index_write(indexFilePath, NULL, NULL);
+        return;
+    }
+
+
+    BitSet changed;
+
+    if(collect_changed(&changed) == 0)
+    {
+        if(link(previousFilePath, indexFilePath) != 0)
+            elog(ERROR, "%s: link() failed", __func__);
+
+        pfree(changed.words);
+        return;
+    }
+
+
+    CountIndex previous;
+    count_index_init(&previous);
+    count_index_open(&previous, previousNumber);
+
+    PG_TRY();
+    {
+        count_index_write(indexFilePath, &previous, &changed);
+    }
+    PG_CATCH();
+    {
+        count_index_close(&previous);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    count_index_close(&previous);
+
+    pfree(changed.words);
+}
+
+
+void count_index_init(CountIndex *index)
+{
+    index->address = MAP_FAILED;
+    index->size = 0;
+    index->moleculeCount = 0;
+}
+
+
+void count_index_open(CountIndex *index, int indexNumber)
+{
+    count_index_close(index);
+
+    char *indexFilePath = get_index_path(COUNT_INDEX_PREFIX, COUNT_INDEX_SUFFIX, indexNumber);
+    int fd = -1;
+
+    PG_TRY();
+    {
+        if(unlikely((fd = open(indexFilePath, O_RDONLY, 0)) < 0))
+        {
+            if(errno == ENOENT)
+                elog(ERROR, "the count index of the index version %i is not available, run sachem_sync_data to "
+                        "generate it", indexNumber);
+
+            elog(ERROR, "%s: open() failed", __func__);
+        }
+
+        struct stat st;
+
+        if(fstat(fd, &st) < 0)
+            elog(ERROR, "%s: fstat() failed", __func__);
+
+        index->size = st.st_size;
+
+        if(unlikely((index->address = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+            elog(ERROR, "%s: mmap() failed", __func__);
+
+        if(unlikely(close(fd) < 0))
+            elog(ERROR, "%s: close() failed", __func__);
+    }
+    PG_CATCH();
+    {
+        if(index->address != MAP_FAILED)
+            munmap(index->address, index->size);
+
+        index->address = MAP_FAILED;
+
+        if(fd != -1)
+            close(fd);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+
+    index->moleculeCount = index->address[0];
+    index->molecules = (CountIndexMolecule *) (index->address + 2);
+    index->offsets = (uint64_t *) (index->molecules + index->moleculeCount);
+    index->items = (CountIndexItem *) (index->offsets + index->moleculeCount + 1);
+}
+
+
+void count_index_close(CountIndex *index)
+{
+    if(likely(index->address != MAP_FAILED))
+    {
+        if(unlikely(munmap(index->address, index->size) < 0))
+            elog(ERROR, "%s: munmap() failed", __func__);
+
+        index->address = MAP_FAILED;
+    }
+}
+
+
+uint64_t count_index_lower_bound(const CountIndex *index, uint32_t total)
+{
+    uint64_t low = 0;
+    uint64_t high = index->moleculeCount;
+
+    while(low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if(index->molecules[middle].total < total)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+
+float4 count_index_score(const CountIndex *index, uint64_t position, CountFingerprint fp, uint32_t total)
+{
+    const CountIndexItem *item = index->items + index->offsets[position];
+    const CountIndexItem *end = index->items + index->offsets[position + 1];
+    uint32_t targetTotal = index->molecules[position].total;
+
+    if(total == 0 && targetTotal == 0)
+        return 1.0f;
+
+    uint32_t shared = 0;
+    size_t i = 0;
+
+    while(i < fp.size && item < end)
+    {
+        if(fp.data[i] < item->feature)
+        {
+            i++;
+        }
+        else if(fp.data[i] > item->feature)
+        {
+            item++;
+        }
+        else
+        {
+            shared += fp.counts[i] < item->count ? fp.counts[i] : item->count;
+            i++;
+            item++;
+        }
+    }
+
+    return shared / (float4) (total + targetTotal - shared);
+}
@@ -0,0 +1,74 @@
+#ifndef COUNTINDEX_H_
+#define COUNTINDEX_H_
+
+#include <postgres.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "fingerprints/fingerprint.h"
+
+
+#define COUNT_INDEX_PREFIX            "sachem_counts"
+#define COUNT_INDEX_SUFFIX            ".idx"
+
+
+typedef struct
+{
+    uint32_t total;
+    int32_t id;
+} CountIndexMolecule;
+
+
+typedef struct
+{
+    uint32_t feature;
+    uint32_t count;
+} CountIndexItem;
+
+
+typedef struct
+{
+    uint64_t *address;
+    size_t size;
+    uint64_t moleculeCount;
+    CountIndexMolecule *molecules;
+    uint64_t *offsets;
+    CountIndexItem *items;
+} CountIndex;
+
+
+void sachem_generate_count_index(int indexNumber, int previousNumber);
+
+void count_index_init(CountIndex *index);
+void count_index_open(CountIndex *index, int indexNumber);
+void count_index_close(CountIndex *index);
+uint64_t count_index_lower_bound(const CountIndex *index, uint32_t total);
+float4 count_index_score(const CountIndex *index, uint64_t position, CountFingerprint fp, uint32_t total);
+
+
+static inline uint32_t count_fingerprint_total(CountFingerprint fp)
+{
+    uint32_t total = 0;
+
+    for(size_t i = 0; i < fp.size; i++)
+        total += fp.counts[i];
+
+    return total;
+}
+
+
+/*
+ * The upper bound of the count Tanimoto coefficient given only the total counts: sum(min) <= min(query, target) and
+ * sum(max) >= max(query, target).
+ */
+static inline float4 count_index_bound(uint32_t query, uint32_t target)
+{
+    if(query == 0 && target == 0)
+        return 1.0f;
+
+    if(query < target)
+        return query / (float4) target;
+    else
+        return target / (float4) query;
+}
+
+#endif /* COUNTINDEX_H_ */
@@ -0,0 +1,111 @@
+#include "FeatureHash.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USE_SIMD_HASH           1
+#else
+#define USE_SIMD_HASH           0
+#endif
+
+
+typedef void (*Hash3BatchFunction)(uint32_t, const uint32_t *, const uint32_t *, uint32_t *, size_t);
+
+
+static void hash_3_batch_scalar(uint32_t a, const uint32_t *b, const uint32_t *c, uint32_t *out, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+        out[i] = hash_3(a, b[i], c[i]);
+}
+
+
+#if USE_SIMD_HASH
+__attribute__((target("avx2")))
+static inline __m256i update_seed_avx2(__m256i x, __m256i seed)
+{
+    __m256i value = _mm256_add_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(2654435761u)),
+            _mm256_set1_epi32(2654435769u));
+    value = _mm256_add_epi32(value, _mm256_add_epi32(_mm256_slli_epi32(seed, 6), _mm256_srli_epi32(seed, 2)));
+
+    return _mm256_xor_si256(seed, value);
+}
+
+
+__attribute__((target("avx2")))
+static void hash_3_batch_avx2(uint32_t a, const uint32_t *b, const uint32_t *c, uint32_t *out, size_t size)
+{
+    uint32_t seed = 0;
+    update_seed(a, seed);
+
+    __m256i init = _mm256_set1_epi32(seed);
+    size_t i = 0;
+
+    for(; i + 8 <= size; i += 8)
+    {
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i vc = _mm256_loadu_si256((const __m256i *) (c + i));
+
+        __m256i hash = update_seed_avx2(vc, update_seed_avx2(vb, init));
+        _mm256_storeu_si256((__m256i *) (out + i), hash);
+    }
+
+    hash_3_batch_scalar(a, b + i, c + i, out + i, size - i);
+}
+
+
+__attribute__((target("avx512f")))
+static inline __m512i update_seed_avx512(__m512i x, __m512i seed)
+{
+    __m512i value = _mm512_add_epi32(_mm512_mullo_epi32(x, _mm512_set1_epi32(2654435761u)),
+            _mm512_set1_epi32(2654435769u));
+    value = _mm512_add_epi32(value, _mm512_add_epi32(_mm512_maskz_slli_epi32(0xffff, seed, 6),
+            _mm512_maskz_srli_epi32(0xffff, seed, 2)));
+
+    return _mm512_xor_si512(seed, value);
+}
+
+
+__attribute__((target("avx512f")))
+static void hash_3_batch_avx512(uint32_t a, const uint32_t *b, const uint32_t *c, uint32_t *out, size_t size)
+{
+    uint32_t seed = 0;
+    update_seed(a, seed);
+
+    __m512i init = _mm512_set1_epi32(seed);
+    size_t i = 0;
+
+    for(; i + 16 <= size; i += 16)
+    {
+        __m512i vb = _mm512_loadu_si512((const void *) (b + i));
+        __m512i vc = _mm512_loadu_si512((const void *) (c + i));
+
+        __m512i hash = update_seed_avx512(vc, update_seed_avx512(vb, init));
+        _mm512_storeu_si512((void *) (out + i), hash);
+    }
+
+    hash_3_batch_scalar(a, b + i, c + i, out + i, size - i);
+}
+#endif
+
+
+static Hash3BatchFunction hash_3_batch_resolve()
+{
+#if USE_SIMD_HASH
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f"))
+        return hash_3_batch_avx512;
+
+    if(__builtin_cpu_supports("avx2"))
+        return hash_3_batch_avx2;
+#endif
+
+    return hash_3_batch_scalar;
+}
+
+
+void hash_3_batch(uint32_t a, const uint32_t *b, const uint32_t *c, uint32_t *out, size_t size)
+{
+    static const Hash3BatchFunction function = hash_3_batch_resolve();
+
+    function(a, b, c, out, size);
+}
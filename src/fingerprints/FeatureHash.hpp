@@ -0,0 +1,138 @@
+#ifndef FEATURE_HASH_HPP__
+#define FEATURE_HASH_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+
+#define SMALL_LIST_SIZE         8
+
+
+static inline void update_seed(uint32_t x, uint32_t &seed)
+{
+    seed ^= (uint32_t) x * 2654435761 + 2654435769 + (seed << 6) + (seed >> 2);
+}
+
+
+static inline uint32_t hash_2(uint32_t a, uint32_t b)
+{
+    uint32_t seed = 0;
+    update_seed(a, seed);
+    update_seed(b, seed);
+    return seed;
+}
+
+
+static inline uint32_t hash_3(uint32_t a, uint32_t b, uint32_t c)
+{
+    uint32_t seed = 0;
+    update_seed(a, seed);
+    update_seed(b, seed);
+    update_seed(c, seed);
+    return seed;
+}
+
+
+static inline void compare_swap(uint32_t &a, uint32_t &b)
+{
+    uint32_t min = a < b ? a : b;
+    uint32_t max = a < b ? b : a;
+    a = min;
+    b = max;
+}
+
+
+/*
+ * Neighbour lists are almost always shorter than five items, so they are sorted by fixed sorting networks instead of
+ * std::sort; the result is identical.
+ */
+static inline void sort_small(uint32_t *data, size_t size)
+{
+    switch(size)
+    {
+        case 0:
+        case 1:
+            return;
+
+        case 2:
+            compare_swap(data[0], data[1]);
+            return;
+
+        case 3:
+            compare_swap(data[1], data[2]);
+            compare_swap(data[0], data[2]);
+            compare_swap(data[0], data[1]);
+            return;
+
+        case 4:
+            compare_swap(data[0], data[1]);
+            compare_swap(data[2], data[3]);
+            compare_swap(data[0], data[2]);
+            compare_swap(data[1], data[3]);
+            compare_swap(data[1], data[2]);
+            return;
+    }
+
+    if(size <= SMALL_LIST_SIZE)
+    {
+        for(size_t i = 1; i < size; i++)
+        {
+            uint32_t value = data[i];
+            size_t j = i;
+
+            for(; j > 0 && data[j - 1] > value; j--)
+                data[j] = data[j - 1];
+
+            data[j] = value;
+        }
+    }
+    else
+    {
+        std::sort(data, data + size);
+    }
+}
+
+
+static inline uint32_t hashlist_2_sort(uint32_t a, uint32_t b, uint32_t *data, size_t size)
+{
+    uint32_t seed = 0;
+    update_seed(a, seed);
+    update_seed(b, seed);
+
+    sort_small(data, size);
+
+    for(size_t i = 0; i < size; i++)
+        update_seed(data[i], seed);
+
+    return seed;
+}
+
+
+template<class C>
+static inline uint32_t list_hash(uint32_t a, uint32_t b, const C &l)
+{
+    uint32_t buffer[SMALL_LIST_SIZE];
+    std::vector<uint32_t> large;
+    uint32_t *data = buffer;
+    size_t size = l.size();
+
+    if(size > SMALL_LIST_SIZE)
+    {
+        large.resize(size);
+        data = large.data();
+    }
+
+    std::copy(l.begin(), l.end(), data);
+
+    return hashlist_2_sort(a, b, data, size);
+}
+
+
+/*
+ * Computes out[i] = hash_3(a, b[i], c[i]) for a batch of features; vectorised implementations are selected at runtime.
+ */
+void hash_3_batch(uint32_t a, const uint32_t *b, const uint32_t *c, uint32_t *out, size_t size);
+
+#endif /* FEATURE_HASH_HPP__ */
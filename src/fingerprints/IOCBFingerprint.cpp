@@ -1,29 +1,21 @@
+#include <vector>
 #include "IOCBFingerprint.hpp"
+#include "FeatureHash.hpp"
 #include "AtomFingerprint.hpp"
 #include "CRNGFingerprint.hpp"
 #include "SGFingerprint.hpp"
 #include "RCFingerprint.hpp"
 
 
-static inline void update_seed(const uint32_t x, uint32_t &seed)
-{
-    seed ^= (uint32_t) x * 2654435761 + 2654435769 + (seed << 6) + (seed >> 2);
-}
-
-
-static inline uint32_t hash3(uint32_t a, uint32_t b, uint32_t c)
-{
-    uint32_t seed = 0;
-    update_seed(a, seed);
-    update_seed(b, seed);
-    update_seed(c, seed);
-    return seed;
-}
-
-
 static inline void process_elements(std::map<uint32_t, int> &var, BitInfo &vari, int n, std::set<uint32_t> &fp,
         int maxFeatLogCount, bool forQuery, BitInfo *info)
 {
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> hashes;
+
+    counts.reserve(forQuery ? var.size() : maxFeatLogCount * var.size());
+    hashes.reserve(forQuery ? var.size() : maxFeatLogCount * var.size());
+
     for(auto &i : var)
     {
         uint32_t h = i.first;
@@ -36,24 +28,30 @@ static inline void process_elements(std::map<uint32_t, int> &var, BitInfo &vari,
             for(int c = 0; cnt && c < maxFeatLogCount; c++, cnt /= 2)
                 lc=c;
 
-            auto hsh = hash3(n, lc, h);
-            fp.insert(hsh);
-
-            if(info)
-                (*info)[hsh] = vari[h];
+            counts.push_back(lc);
+            hashes.push_back(h);
         }
         else
         {
             for(int c = 0; cnt && c < maxFeatLogCount; c++, cnt /= 2)
             {
-                auto hsh = hash3(n, c, h);
-                fp.insert(hsh);
-
-                if(info)
-                    (*info)[hsh] = vari[h];
+                counts.push_back(c);
+                hashes.push_back(h);
             }
         }
     }
+
+
+    std::vector<uint32_t> result(hashes.size());
+    hash_3_batch(n, counts.data(), hashes.data(), result.data(), hashes.size());
+
+    for(size_t i = 0; i < result.size(); i++)
+    {
+        fp.insert(result[i]);
+
+        if(info)
+            (*info)[result[i]] = vari[hashes[i]];
+    }
 }
 
 
@@ -89,3 +87,9 @@ std::set<uint32_t> iocb_similarity_fingerprint_get(const Molecule *molecule, int
 
     return fp;
 }
+
+
+std::map<uint32_t, int> iocb_similarity_count_fingerprint_get(const Molecule *molecule, int circSize)
+{
+    return rc_fingerprint_get(molecule, 0, circSize);
+}
@@ -13,5 +13,6 @@ std::set<uint32_t> iocb_substructure_fingerprint_get(const Molecule *molecule, i
         bool forQuery = false, BitInfo *info = nullptr);
 std::set<uint32_t> iocb_similarity_fingerprint_get(const Molecule *molecule, int circSize, int maxFeatLogCount,
         BitInfo *info = nullptr);
+std::map<uint32_t, int> iocb_similarity_count_fingerprint_get(const Molecule *molecule, int circSize);
 
 #endif /* IOCB_FINGERPRINT_HPP__ */
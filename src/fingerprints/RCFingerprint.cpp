@@ -3,6 +3,7 @@
 #include <vector>
 #include <algorithm>
 #include "RCFingerprint.hpp"
+#include "FeatureHash.hpp"
 
 extern "C"
 {
@@ -24,46 +25,6 @@ struct AtomDesc
 };
 
 
-static inline void update_seed(uint32_t x, uint32_t &seed)
-{
-    seed ^= (uint32_t) x * 2654435761 + 2654435769 + (seed << 6) + (seed >> 2);
-}
-
-
-static inline uint32_t hash_2(uint32_t a, uint32_t b)
-{
-    uint32_t seed = 0;
-    update_seed(a, seed);
-    update_seed(b, seed);
-    return seed;
-}
-
-
-static inline uint32_t hash_3(uint32_t a, uint32_t b, uint32_t c)
-{
-    uint32_t seed = 0;
-    update_seed(a, seed);
-    update_seed(b, seed);
-    update_seed(c, seed);
-    return seed;
-}
-
-
-static inline uint32_t hashlist_2_sort(uint32_t a, uint32_t b, std::vector<uint32_t> &l)
-{
-    uint32_t seed = 0;
-    update_seed(a, seed);
-    update_seed(b, seed);
-
-    std::sort(l.begin(), l.end());
-
-    for(auto&i : l)
-        update_seed(i, seed);
-
-    return seed;
-}
-
-
 static inline bool is_dummy_bond(const Molecule *const restrict molecule, BondIdx bond)
 {
     uint8_t type = molecule_get_bond_type(molecule, bond);
@@ -108,6 +69,9 @@ std::map<uint32_t, int> rc_fingerprint_get(const Molecule *molecule, int minRadi
     }
 
 
+    std::vector<uint32_t> hs;
+    hs.reserve(molecule->atomCount);
+
     for(int radius = 1; radius <= maxRadius; radius++)
     {
         std::map<AtomIdx, AtomDesc> newdesc;
@@ -118,8 +82,7 @@ std::map<uint32_t, int> rc_fingerprint_get(const Molecule *molecule, int minRadi
             if(molecule_get_atom_number(molecule, i) == H_ATOM_NUMBER || !desc.count(i))
                 continue;
 
-            std::vector<uint32_t> hs;
-            hs.reserve(molecule->atomCount);
+            hs.clear();
             std::set<BondIdx> newcover;
             bool acceptable = true;
 
@@ -155,7 +118,7 @@ std::map<uint32_t, int> rc_fingerprint_get(const Molecule *molecule, int minRadi
             }
             else
             {
-                newdesc[i] = AtomDesc(hashlist_2_sort(desc[i].hash, newcover.size(), hs), i, std::move(newcover));
+                newdesc[i] = AtomDesc(hashlist_2_sort(desc[i].hash, newcover.size(), hs.data(), hs.size()), i, std::move(newcover));
 
                 if(radius >= minRadius)
                     result.push_back(newdesc[i]);
@@ -12,6 +12,7 @@
 #include <vector>
 #include <algorithm>
 #include "SGFingerprint.hpp"
+#include "FeatureHash.hpp"
 
 extern "C"
 {
@@ -25,29 +26,6 @@ typedef std::map<uint32_t, std::set<uint32_t>> BitInfo;
 typedef std::pair<uint32_t, std::list<uint32_t>> AtomDesc;
 
 
-static inline void update_seed(uint32_t x, uint32_t &seed)
-{
-    seed ^= (uint32_t) x * 2654435761 + 2654435769 + (seed << 6) + (seed >> 2);
-}
-
-
-template<class C>
-static inline uint32_t list_hash(uint32_t a, uint32_t b, const C &l)
-{
-    std::vector<uint32_t> s(l.begin(), l.end());
-    std::sort(s.begin(), s.end());
-
-    uint32_t seed = 0;
-    update_seed(a, seed);
-    update_seed(b, seed);
-
-    for(uint32_t &i : s)
-        update_seed(i, seed);
-
-    return seed;
-}
-
-
 static inline uint32_t bond_hash(const Molecule *molecule, BondIdx b)
 {
     return molecule_get_bond_type(molecule, b);
@@ -1,6 +1,5 @@
 #include <map>
 #include <vector>
-#include <fstream>
 #include "IOCBFingerprint.hpp"
 
 extern "C"
@@ -16,32 +15,7 @@ extern "C"
 #define QUERY_MAX_FPS          32
 
 
-static bool initialized = false;
 static const unsigned char b64str[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static std::map<uint32_t, int> fporder;
-
-
-void fingerprint_init(void)
-{
-    char *fporderPath = get_file_path(ORDER_FILE);
-    std::ifstream stream(fporderPath, std::ios::in | std::ios::binary);
-
-    if(stream.is_open())
-    {
-        int fpn = 0;
-
-        while(!stream.eof())
-        {
-            uint32_t fp;
-            stream.read((char *) &fp, sizeof(uint32_t));
-            fporder[fp] = fpn++;
-        }
-    }
-    else
-    {
-        elog(WARNING, "cannot load the fporder file: %s", fporderPath);
-    }
-}
 
 
 static inline void write_bitword(char *buffer, uint32_t fp)
@@ -84,11 +58,7 @@ static inline std::set<uint32_t> substructure_fingerprint_get_native(const Molec
 
 static inline std::set<uint32_t> substructure_fingerprint_get_query_native(const Molecule *molecule)
 {
-    if(unlikely(initialized == false))
-    {
-        fingerprint_init();
-        initialized = true;
-    }
+    fporder_refresh();
 
 
     BitInfo info;
@@ -101,14 +71,14 @@ static inline std::set<uint32_t> substructure_fingerprint_get_query_native(const
 
     for(uint32_t i : res)
     {
-        auto o = fporder.find(i);
+        int32_t rank = fporder_rank(i);
 
-        if(o == fporder.end())
+        if(rank == ORDER_UNKNOWN_RANK)
             // if the fingerprint is not known to fporder (which it should be but keeping that database in shape
             // is not very easy), let's assume it's very good (and put it on the beginning of the queue...
             fpi[unknownId--] = i;
         else
-            fpi[o->second] = i;
+            fpi[rank] = i;
     }
 
 
@@ -153,6 +123,17 @@ static inline std::set<uint32_t> substructure_fingerprint_get_query_native(const
 }
 
 
+static inline std::set<uint32_t> folded_fingerprint_get_native(const std::set<uint32_t> &res)
+{
+    std::set<uint32_t> fps;
+
+    for(uint32_t i : res)
+        fps.insert(i % FOLDED_FP_SIZE);
+
+    return fps;
+}
+
+
 static inline std::set<uint32_t> similarity_fingerprint_get_native(const Molecule *molecule)
 {
     return iocb_similarity_fingerprint_get(molecule, CIRC_SIZE, MAX_FEAT_LOGCOUNT);
@@ -254,6 +235,28 @@ IntegerFingerprint integer_substructure_fingerprint_get_query(const Molecule *mo
 }
 
 
+IntegerFingerprint integer_folded_substructure_fingerprint_get(const Molecule *molecule)
+{
+    SAFE_CPP_BEGIN;
+
+    std::set<uint32_t> res = folded_fingerprint_get_native(substructure_fingerprint_get_native(molecule));
+    return integer_fingerprint_create(res);
+
+    SAFE_CPP_END;
+}
+
+
+IntegerFingerprint integer_folded_substructure_fingerprint_get_query(const Molecule *molecule)
+{
+    SAFE_CPP_BEGIN;
+
+    std::set<uint32_t> res = folded_fingerprint_get_native(substructure_fingerprint_get_query_native(molecule));
+    return integer_fingerprint_create(res);
+
+    SAFE_CPP_END;
+}
+
+
 IntegerFingerprint integer_similarity_fingerprint_get(const Molecule *molecule)
 {
     SAFE_CPP_BEGIN;
@@ -274,3 +277,46 @@ IntegerFingerprint integer_similarity_fingerprint_get_query(const Molecule *mole
 
     SAFE_CPP_END;
 }
+
+
+CountFingerprint count_similarity_fingerprint_get(const Molecule *molecule)
+{
+    SAFE_CPP_BEGIN;
+
+    std::map<uint32_t, int> res = iocb_similarity_count_fingerprint_get(molecule, CIRC_SIZE);
+
+    if(res.size() > 0)
+    {
+        size_t size = res.size();
+        uint32_t *data = (uint32_t *) palloc_extended(size * sizeof(uint32_t), MCXT_ALLOC_NO_OOM);
+        uint32_t *counts = (uint32_t *) palloc_extended(size * sizeof(uint32_t), MCXT_ALLOC_NO_OOM);
+
+        if(data == NULL || counts == NULL)
+        {
+            if(data != NULL)
+                pfree(data);
+
+            if(counts != NULL)
+                pfree(counts);
+
+            throw std::bad_alloc();
+        }
+
+
+        CountFingerprint fp = {size : size, data: data, counts: counts};
+
+        for(auto &i : res)
+        {
+            *(data++) = i.first;
+            *(counts++) = i.second;
+        }
+
+        return fp;
+    }
+    else
+    {
+        return {.size = 0, .data = NULL, .counts = NULL};
+    }
+
+    SAFE_CPP_END;
+}
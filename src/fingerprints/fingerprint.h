@@ -9,6 +9,7 @@
 #define GRAPH_SIZE              7
 #define MAX_FEAT_LOGCOUNT       5
 #define CIRC_SIZE               3
+#define FOLDED_FP_SIZE          4096
 
 
 typedef struct Molecule Molecule;
@@ -28,13 +29,24 @@ typedef struct
 } IntegerFingerprint;
 
 
+typedef struct
+{
+    size_t size;
+    uint32_t *data;
+    uint32_t *counts;
+} CountFingerprint;
+
+
 StringFingerprint string_substructure_fingerprint_get(const Molecule *molecule);
 StringFingerprint string_substructure_fingerprint_get_query(const Molecule *molecule);
 
 IntegerFingerprint integer_substructure_fingerprint_get(const Molecule *molecule);
 IntegerFingerprint integer_substructure_fingerprint_get_query(const Molecule *molecule);
+IntegerFingerprint integer_folded_substructure_fingerprint_get(const Molecule *molecule);
+IntegerFingerprint integer_folded_substructure_fingerprint_get_query(const Molecule *molecule);
 IntegerFingerprint integer_similarity_fingerprint_get(const Molecule *molecule);
 IntegerFingerprint integer_similarity_fingerprint_get_query(const Molecule *molecule);
+CountFingerprint count_similarity_fingerprint_get(const Molecule *molecule);
 
 
 static inline void string_fingerprint_free(StringFingerprint fingerprint)
@@ -50,4 +62,15 @@ static inline void integer_fingerprint_free(IntegerFingerprint fingerprint)
         pfree(fingerprint.data);
 }
 
+
+
+static inline void count_fingerprint_free(CountFingerprint fingerprint)
+{
+    if(fingerprint.data)
+        pfree(fingerprint.data);
+
+    if(fingerprint.counts)
+        pfree(fingerprint.counts);
+}
+
 #endif /* FINGERPRINT_H__ */
@@ -0,0 +1,258 @@
+#include <postgres.h>
+#include <executor/spi.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bitset.h"
+#include "fpindex.h"
+#include "molecule.h"
+#include "sachem.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define FETCH_SIZE              100000
+#define MOLECULES_TABLE         "sachem_molecules"
+
+
+/*
+ * The index uses the same layout as the ecdk substructure index: a table of FOLDED_FP_SIZE offsets (in words),
+ * the molecule count, and then the bit-sliced bitset of molecule ids for each bit of the folded fingerprint.
+ */
+void fingerprint_index_build(const char *indexFilePath)
+{
+    int indexFd = open(indexFilePath, O_EXCL | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+
+    if(indexFd == -1)
+        elog(ERROR, "%s: open() failed", __func__);
+
+
+    PG_TRY();
+    {
+        if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, false, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1)
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        char isNullFlag;
+        Datum moleculeCountDatum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag);
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        int64_t moleculeCount = DatumGetInt32(moleculeCountDatum);
+
+        SPI_freetuptable(SPI_tuptable);
+
+
+        BitSet *bitmap = palloc(FOLDED_FP_SIZE * sizeof(BitSet));
+
+        for(int i = 0; i < FOLDED_FP_SIZE; i++)
+            bitset_init_empty(bitmap + i, moleculeCount);
+
+
+        Portal moleculeCursor = SPI_cursor_open_with_args(NULL, "select id, molecule from " MOLECULES_TABLE, 0, NULL,
+                NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+        while(true)
+        {
+            SPI_cursor_fetch(moleculeCursor, true, FETCH_SIZE);
+
+            if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+                elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+            if(SPI_processed == 0)
+                break;
+
+
+            for(size_t i = 0; i < SPI_processed; i++)
+            {
+                HeapTuple tuple = SPI_tuptable->vals[i];
+
+                int32_t id = DatumGetInt32(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                Datum moleculeDatum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                bytea *moleculeData = DatumGetByteaP(moleculeDatum);
+
+                Molecule molecule;
+                molecule_simple_init(&molecule, (uint8_t *) VARDATA(moleculeData));
+
+                IntegerFingerprint fp = integer_folded_substructure_fingerprint_get(&molecule);
+
+                for(size_t j = 0; j < fp.size; j++)
+                    bitset_set(bitmap + fp.data[j], id);
+
+                integer_fingerprint_free(fp);
+                molecule_simple_free(&molecule);
+
+                if((void *) moleculeData != DatumGetPointer(moleculeDatum))
+                    pfree(moleculeData);
+            }
+
+            SPI_freetuptable(SPI_tuptable);
+        }
+
+        SPI_cursor_close(moleculeCursor);
+
+
+        uint64_t offset = FOLDED_FP_SIZE + 1;
+
+        for(int i = 0; i < FOLDED_FP_SIZE; i++)
+        {
+            if(write(indexFd, &offset, sizeof(uint64_t)) != sizeof(uint64_t))
+                elog(ERROR, "%s: write() failed", __func__);
+
+            offset += bitmap[i].wordsInUse + 1;
+        }
+
+        if(write(indexFd, &moleculeCount, sizeof(int64_t)) != sizeof(int64_t))
+            elog(ERROR, "%s: write() failed", __func__);
+
+        for(int i = 0; i < FOLDED_FP_SIZE; i++)
+        {
+            uint64_t wordsInUse = bitmap[i].wordsInUse;
+
+            if(write(indexFd, &wordsInUse, sizeof(uint64_t)) != sizeof(uint64_t))
+                elog(ERROR, "%s: write() failed", __func__);
+
+            if(write(indexFd, bitmap[i].words, wordsInUse * sizeof(uint64_t)) != (ssize_t) (wordsInUse * sizeof(uint64_t)))
+                elog(ERROR, "%s: write() failed", __func__);
+
+            pfree(bitmap[i].words);
+        }
+
+        pfree(bitmap);
+
+
+        int fd = indexFd;
+        indexFd = -1;
+
+        if(close(fd) != 0)
+            elog(ERROR, "%s: close() failed", __func__);
+    }
+    PG_CATCH();
+    {
+        if(indexFd != -1)
+            close(indexFd);
+
+        unlink(indexFilePath);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+}
+
+
+void sachem_generate_fingerprint_index(int indexNumber)
+{
+    fingerprint_index_build(get_index_path(FINGERPRINT_INDEX_PREFIX, FINGERPRINT_INDEX_SUFFIX, indexNumber));
+}
+
+
+void fingerprint_index_init(FingerprintIndex *index)
+{
+    index->address = MAP_FAILED;
+    index->size = 0;
+    index->moleculeCount = 0;
+}
+
+
+void fingerprint_index_open(FingerprintIndex *index, int indexNumber)
+{
+    fingerprint_index_map(index, get_index_path(FINGERPRINT_INDEX_PREFIX, FINGERPRINT_INDEX_SUFFIX, indexNumber));
+}
+
+
+void fingerprint_index_map(FingerprintIndex *index, const char *indexFilePath)
+{
+    fingerprint_index_close(index);
+
+    int fd = -1;
+
+    PG_TRY();
+    {
+        if(unlikely((fd = open(indexFilePath, O_RDONLY, 0)) < 0))
+            elog(ERROR, "%s: open() failed", __func__);
+
+        struct stat st;
+
+        if(fstat(fd, &st) < 0)
+            elog(ERROR, "%s: fstat() failed", __func__);
+
+        index->size = st.st_size;
+
+        if(unlikely((index->address = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+            elog(ERROR, "%s: mmap() failed", __func__);
+
+        if(unlikely(close(fd) < 0))
+            elog(ERROR, "%s: close() failed", __func__);
+    }
+    PG_CATCH();
+    {
+        if(index->address != MAP_FAILED)
+            munmap(index->address, index->size);
+
+        index->address = MAP_FAILED;
+
+        if(fd != -1)
+            close(fd);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+
+    index->moleculeCount = *(index->address + FOLDED_FP_SIZE);
+
+    for(int i = 0; i < FOLDED_FP_SIZE; i++)
+    {
+        uint64_t *address = index->address + index->address[i];
+        bitset_init(index->bitmap + i, address + 1, *address);
+    }
+}
+
+
+void fingerprint_index_close(FingerprintIndex *index)
+{
+    if(likely(index->address != MAP_FAILED))
+    {
+        if(unlikely(munmap(index->address, index->size) < 0))
+            elog(ERROR, "%s: munmap() failed", __func__);
+
+        index->address = MAP_FAILED;
+    }
+}
+
+
+void fingerprint_index_search(const FingerprintIndex *index, IntegerFingerprint fp, BitSet *candidates)
+{
+    if(fp.size == 0)
+    {
+        for(int i = 0; i < candidates->length; i++)
+            candidates->words[i] = WORD_MASK;
+
+        if(candidates->length > 0)
+            candidates->words[candidates->length - 1] = WORD_MASK >> (-index->moleculeCount & 0x3f);
+
+        candidates->wordsInUse = candidates->length;
+        return;
+    }
+
+
+    const BitSet *first = index->bitmap + fp.data[0];
+
+    memcpy(candidates->words, first->words, first->wordsInUse * sizeof(uint64_t));
+    candidates->wordsInUse = first->wordsInUse;
+
+    for(size_t i = 1; i < fp.size && candidates->wordsInUse > 0; i++)
+        bitset_merge(candidates, index->bitmap + fp.data[i]);
+}
@@ -0,0 +1,32 @@
+#ifndef FPINDEX_H_
+#define FPINDEX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "bitset.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define FINGERPRINT_INDEX_PREFIX      "sachem_fingerprints"
+#define FINGERPRINT_INDEX_SUFFIX      ".idx"
+
+
+typedef struct
+{
+    uint64_t *address;
+    size_t size;
+    int moleculeCount;
+    BitSet bitmap[FOLDED_FP_SIZE];
+} FingerprintIndex;
+
+
+void sachem_generate_fingerprint_index(int indexNumber);
+void fingerprint_index_build(const char *indexFilePath);
+
+void fingerprint_index_init(FingerprintIndex *index);
+void fingerprint_index_open(FingerprintIndex *index, int indexNumber);
+void fingerprint_index_map(FingerprintIndex *index, const char *indexFilePath);
+void fingerprint_index_close(FingerprintIndex *index);
+void fingerprint_index_search(const FingerprintIndex *index, IntegerFingerprint fp, BitSet *candidates);
+
+#endif /* FPINDEX_H_ */
@@ -7,6 +7,9 @@
 #include <storage/shm_toc.h>
 #include <storage/ipc.h>
 #include <storage/spin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "fporder.h"
 #include "molecule.h"
 #include "sachem.h"
@@ -18,102 +21,326 @@
 #define SYNC_FETCH_SIZE           100000
 #define QUEUE_SIZE                1000
 #define MOLECULES_TABLE           "sachem_molecules"
+#define INDEX_TABLE               "sachem_index"
 
 
 typedef struct
 {
     slock_t mutex;
     int worker;
-    int offset;
+    int32_t nextId;
+    int32_t endId;
     int processed;
+    float4 samplingRate;
+    size_t capacity;
     bool verbose;
 } WorkerHeader;
 
 
-void fporder_worker(dsm_segment *seg, shm_toc *toc)
+static FporderHeader *table = MAP_FAILED;
+static size_t tableSize;
+static dev_t tableDevice;
+static ino_t tableInode;
+static bool tableMissing = false;
+static bool tableRejected = false;
+static dev_t rejectedDevice;
+static ino_t rejectedInode;
+static bool callbackRegistered = false;
+static char pendingPath[MAXPGPATH];
+static char publishPath[MAXPGPATH];
+
+
+static void fporder_unmap(void)
 {
-    volatile WorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
+    if(table != MAP_FAILED)
+        munmap(table, tableSize);
 
-    SpinLockAcquire(&header->mutex);
-    int worker = header->worker++;
-    SpinLockRelease(&header->mutex);
+    table = MAP_FAILED;
+}
 
-    shm_mq *queue = shm_toc_lookup_key(toc, QUEUE_KEY) + worker * QUEUE_SIZE * sizeof(StatItem);
-    shm_mq_set_sender(queue, MyProc);
-    shm_mq_handle *out = shm_mq_attach(queue, seg, NULL);
 
+void fporder_refresh(void)
+{
+    char *fporderPath = get_file_path(ORDER_FILE);
+    struct stat st;
 
-    Stats *stats = stats = stats_create();
+    if(stat(fporderPath, &st) < 0)
+    {
+        fporder_unmap();
 
+        if(!tableMissing)
+            elog(WARNING, "cannot load the fporder file: %s", fporderPath);
 
-    PG_TRY();
+        tableMissing = true;
+        pfree(fporderPath);
+        return;
+    }
+
+    tableMissing = false;
+
+    if(table != MAP_FAILED && st.st_dev == tableDevice && st.st_ino == tableInode)
     {
-        if(unlikely(SPI_connect() != SPI_OK_CONNECT))
-            elog(ERROR, "%s: SPI_connect() failed", __func__);
+        pfree(fporderPath);
+        return;
+    }
 
-        char isNullFlag;
+    /* a rejected file is not mapped (and reported) again until a new file is published */
+    if(tableRejected && st.st_dev == rejectedDevice && st.st_ino == rejectedInode)
+    {
+        pfree(fporderPath);
+        return;
+    }
+
+
+    fporder_unmap();
+
+    tableRejected = true;
+    rejectedDevice = st.st_dev;
+    rejectedInode = st.st_ino;
+
+    int fd = open(fporderPath, O_RDONLY, 0);
+
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        elog(WARNING, "cannot open the fporder file: %s", fporderPath);
+
+        if(fd >= 0)
+            close(fd);
+
+        pfree(fporderPath);
+        return;
+    }
+
+    FporderHeader *address = MAP_FAILED;
 
-        SPIPlanPtr queryPlan = SPI_prepare("select molecule from " MOLECULES_TABLE " offset $1 limit $2", 2, (Oid[]) { INT4OID, INT4OID });
+    if(st.st_size >= sizeof(FporderHeader))
+        address = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
+    close(fd);
 
-        while(true)
+    if(address == MAP_FAILED || address->magic != ORDER_FILE_MAGIC ||
+            st.st_size != sizeof(FporderHeader) + ((size_t) address->mask + 1) * sizeof(FporderSlot))
+    {
+        elog(WARNING, "unsupported format of the fporder file (run sachem_generate_fporder): %s", fporderPath);
+
+        if(address != MAP_FAILED)
+            munmap(address, st.st_size);
+
+        pfree(fporderPath);
+        return;
+    }
+
+    tableRejected = false;
+
+    table = address;
+    tableSize = st.st_size;
+    tableDevice = st.st_dev;
+    tableInode = st.st_ino;
+
+    pfree(fporderPath);
+}
+
+
+int32_t fporder_rank(uint32_t fp)
+{
+    if(unlikely(table == MAP_FAILED))
+        return ORDER_UNKNOWN_RANK;
+
+    const FporderSlot *slots = (const FporderSlot *) (table + 1);
+    uint32_t mask = table->mask;
+
+    for(uint32_t i = fporder_hash(fp, mask); slots[i].rank != ORDER_UNKNOWN_RANK; i = (i + 1) & mask)
+        if(slots[i].fp == fp)
+            return slots[i].rank;
+
+    return ORDER_UNKNOWN_RANK;
+}
+
+
+/*
+ * The exact fingerprint counts of the molecules stored in the index version N are kept in the file
+ * COUNTS_INDEX_PREFIX-N. The sync functions load the counts of the previous version, let the index workers
+ * update them by the molecules deleted and added from the audit table, and publish them together with a new
+ * rank table.
+ */
+Stats *fporder_counts_load(int indexNumber, size_t *limit)
+{
+    Stats *counts = stats_create(0);
+    char *countsPath = get_index_path(COUNTS_INDEX_PREFIX, COUNTS_INDEX_SUFFIX, indexNumber);
+
+    if(!stats_load(counts, countsPath, limit))
+    {
+        stats_delete(counts);
+        counts = NULL;
+    }
+
+    pfree(countsPath);
+    return counts;
+}
+
+
+static void fporder_xact_callback(XactEvent event, void *arg)
+{
+    if(pendingPath[0] == '\0')
+        return;
+
+    if(event == XACT_EVENT_COMMIT)
+    {
+        if(rename(pendingPath, publishPath) != 0)
         {
-            SpinLockAcquire(&header->mutex);
-            int offset = header->offset;
-            header->offset += SYNC_FETCH_SIZE;
-            SpinLockRelease(&header->mutex);
+            elog(WARNING, "cannot publish the fporder file: %s", publishPath);
+            unlink(pendingPath);
+        }
+    }
+    else if(event == XACT_EVENT_ABORT)
+    {
+        unlink(pendingPath);
+    }
+    else
+    {
+        return;
+    }
 
+    pendingPath[0] = '\0';
+}
 
-            Datum values[] = { Int32GetDatum(offset), Int32GetDatum(SYNC_FETCH_SIZE)};
 
-            if(unlikely(SPI_execute_plan(queryPlan, values, NULL, true, 0) != SPI_OK_SELECT))
-                elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+/*
+ * The counts of the new index version are saved immediately, as they are used only by the following syncs, while
+ * the new rank table is written aside and renamed into place only when the sync transaction commits.
+ */
+void fporder_counts_publish(Stats *counts, int indexNumber, size_t limit)
+{
+    char *countsPath = get_index_path(COUNTS_INDEX_PREFIX, COUNTS_INDEX_SUFFIX, indexNumber);
+    stats_save(counts, countsPath, limit);
+    pfree(countsPath);
 
-            if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
-                elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+    if(unlikely(!callbackRegistered))
+    {
+        RegisterXactCallback(fporder_xact_callback, NULL);
+        callbackRegistered = true;
+    }
 
-            if(SPI_processed == 0)
-                break;
+    if(pendingPath[0] != '\0')
+        unlink(pendingPath);
 
-            int processed = SPI_processed;
-            SPITupleTable *tuptable = SPI_tuptable;
+    char *fporderPath = get_file_path(ORDER_FILE);
+    snprintf(publishPath, MAXPGPATH, "%s", fporderPath);
+    snprintf(pendingPath, MAXPGPATH, "%s.%i", fporderPath, indexNumber);
+    pfree(fporderPath);
 
-            for(int i = 0; i < processed; i++)
-            {
-                CHECK_FOR_INTERRUPTS();
+    stats_write(counts, pendingPath, limit);
+}
 
-                HeapTuple tuple = tuptable->vals[i];
 
-                Datum mol = SPI_getbinval(tuple, tuptable->tupdesc, 1, &isNullFlag);
+/*
+ * Counts the molecules of the id ranges claimed from the header; it is run by the workers, or by the leader
+ * itself when no worker has been launched.
+ */
+static void fporder_count_molecules(volatile WorkerHeader *header, Stats *stats)
+{
+    if(unlikely(SPI_connect() != SPI_OK_CONNECT))
+        elog(ERROR, "%s: SPI_connect() failed", __func__);
 
-                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
-                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+    char isNullFlag;
 
-                bytea *data = DatumGetByteaP(mol);
+    bool sampled = header->samplingRate < 1.0;
 
-                Molecule molecule;
-                molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
+    SPIPlanPtr queryPlan = sampled ?
+            SPI_prepare("select molecule from " MOLECULES_TABLE " where id >= $1 and id < $2 and random() < $3", 3,
+                    (Oid[]) { INT4OID, INT4OID, FLOAT4OID }) :
+            SPI_prepare("select molecule from " MOLECULES_TABLE " where id >= $1 and id < $2", 2,
+                    (Oid[]) { INT4OID, INT4OID });
 
-                stats_add(stats, &molecule);
+    if(unlikely(queryPlan == NULL))
+        elog(ERROR, "%s: SPI_prepare() failed", __func__);
 
-                molecule_simple_free(&molecule);
 
-                if((char *) data != DatumGetPointer(mol))
-                    pfree(data);
-            }
+    while(true)
+    {
+        /* workers claim disjoint id ranges, so each range is an index range scan and no rows are skipped */
+        SpinLockAcquire(&header->mutex);
+        int32_t fromId = header->nextId;
+
+        if(fromId < header->endId)
+            header->nextId = fromId + Min(SYNC_FETCH_SIZE, header->endId - fromId);
+
+        int32_t toId = header->nextId;
+        SpinLockRelease(&header->mutex);
+
+        if(fromId >= toId)
+            break;
+
+
+        Datum values[] = { Int32GetDatum(fromId), Int32GetDatum(toId), Float4GetDatum(header->samplingRate) };
+
+        if(unlikely(SPI_execute_plan(queryPlan, values, NULL, true, 0) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+        int processed = SPI_processed;
+        SPITupleTable *tuptable = SPI_tuptable;
+
+        for(int i = 0; i < processed; i++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            HeapTuple tuple = tuptable->vals[i];
+
+            Datum mol = SPI_getbinval(tuple, tuptable->tupdesc, 1, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *data = DatumGetByteaP(mol);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
 
-            SPI_freetuptable(tuptable);
+            stats_add(stats, &molecule);
 
-            SpinLockAcquire(&header->mutex);
-            header->processed += processed;
-            int count = header->processed;
-            SpinLockRelease(&header->mutex);
+            molecule_simple_free(&molecule);
 
-            if(header->verbose)
-                elog(NOTICE, "already processed: %i", count);
+            if((char *) data != DatumGetPointer(mol))
+                pfree(data);
         }
 
-        SPI_finish();
+        SPI_freetuptable(tuptable);
+
+        SpinLockAcquire(&header->mutex);
+        header->processed += processed;
+        int count = header->processed;
+        SpinLockRelease(&header->mutex);
+
+        if(header->verbose)
+            elog(NOTICE, "already processed: %i", count);
+    }
+
+    SPI_finish();
+}
+
+
+void fporder_worker(dsm_segment *seg, shm_toc *toc)
+{
+    volatile WorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
+
+    SpinLockAcquire(&header->mutex);
+    int worker = header->worker++;
+    SpinLockRelease(&header->mutex);
+
+    shm_mq *queue = shm_toc_lookup_key(toc, QUEUE_KEY) + worker * QUEUE_SIZE * sizeof(StatItem);
+    shm_mq_set_sender(queue, MyProc);
+    shm_mq_handle *out = shm_mq_attach(queue, seg, NULL);
+
+
+    Stats *stats = stats_create(header->capacity);
+
+
+    PG_TRY();
+    {
+        fporder_count_molecules(header, stats);
 
 
         StatItem *items;
@@ -155,14 +382,60 @@ Datum sachem_generate_fporder(PG_FUNCTION_ARGS)
 {
     int32_t limit = PG_GETARG_INT32(0);
     bool verbose = PG_GETARG_BOOL(1);
+    float4 samplingRate = PG_GETARG_FLOAT4(2);
+    int32_t capacity = PG_GETARG_INT32(3);
+
+    if(samplingRate <= 0 || samplingRate > 1)
+        elog(ERROR, "%s: sampling rate must be in the interval (0, 1]", __func__);
+
+    if(capacity < 0)
+        elog(ERROR, "%s: capacity must not be negative", __func__);
 
     int countOfProcessors = sysconf(_SC_NPROCESSORS_ONLN);
 
 
-    Stats *stats = stats_create();
+    Stats *stats = stats_create(capacity);
+    int indexNumber = -1;
 
     PG_TRY();
     {
+        if(unlikely(SPI_connect() != SPI_OK_CONNECT))
+            elog(ERROR, "%s: SPI_connect() failed", __func__);
+
+        if(unlikely(SPI_execute("select coalesce(min(id), 0), coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2)
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        char isNullFlag;
+        int32_t startId = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        int32_t endId = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isNullFlag));
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        if(unlikely(SPI_exec("select id from " INDEX_TABLE, 0) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_exec() failed", __func__);
+
+        if(SPI_processed != 0)
+        {
+            if(unlikely(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+                elog(ERROR, "%s: SPI_exec() failed", __func__);
+
+            indexNumber = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+        }
+
+        SPI_finish();
+
+
         EnterParallelMode();
 
         ParallelContext *pcxt = CreateParallelContextForExternalFunction("libsachem", "fporder_worker", countOfProcessors);
@@ -175,8 +448,11 @@ Datum sachem_generate_fporder(PG_FUNCTION_ARGS)
 
         WorkerHeader *header = shm_toc_allocate(pcxt->toc, sizeof(WorkerHeader));
         SpinLockInit(&header->mutex);
-        header->offset = 0;
+        header->nextId = startId;
+        header->endId = endId;
         header->processed = 0;
+        header->samplingRate = samplingRate;
+        header->capacity = capacity;
         header->verbose = verbose;
         shm_toc_insert(pcxt->toc, HEADER_KEY, header);
 
@@ -216,13 +492,40 @@ Datum sachem_generate_fporder(PG_FUNCTION_ARGS)
 #endif
         }
 
+        int launched = pcxt->nworkers_launched;
+
         WaitForParallelWorkersToFinish(pcxt);
         DestroyParallelContext(pcxt);
         ExitParallelMode();
 
 
+        /* without workers, the leader counts all molecules itself */
+        if(launched == 0)
+        {
+            WorkerHeader leader;
+            SpinLockInit(&leader.mutex);
+            leader.worker = 0;
+            leader.nextId = startId;
+            leader.endId = endId;
+            leader.processed = 0;
+            leader.samplingRate = samplingRate;
+            leader.capacity = capacity;
+            leader.verbose = verbose;
+
+            fporder_count_molecules(&leader, stats);
+        }
+
+
         char *fporderPath = get_file_path(ORDER_FILE);
-        stats_write(stats, fporderPath, limit);
+        /* the limit applies to the expected counts in the sample */
+        stats_write(stats, fporderPath, (size_t) (limit * samplingRate));
+
+        /* exact counts become the base for the incremental maintenance done by the sync functions */
+        if(indexNumber >= 0 && samplingRate == 1.0 && capacity == 0)
+        {
+            char *countsPath = get_index_path(COUNTS_INDEX_PREFIX, COUNTS_INDEX_SUFFIX, indexNumber);
+            stats_save(stats, countsPath, limit);
+        }
     }
     PG_CATCH();
     {
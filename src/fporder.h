@@ -1,7 +1,49 @@
 #ifndef FPORDER_H_
 #define FPORDER_H_
 
+#include <stdint.h>
+#include "stats.h"
+
 
 #define ORDER_FILE              "fporder.bin"
+#define ORDER_FILE_MAGIC        0x4f505346
+#define ORDER_UNKNOWN_RANK      -1
+#define ORDER_DEFAULT_LIMIT     1000
+#define COUNTS_INDEX_PREFIX     "sachem_fpcounts"
+#define COUNTS_INDEX_SUFFIX     ".bin"
+
+
+/*
+ * The order file is an open addressing hash table (linear probing, load factor at most 1/2) mapping each
+ * fingerprint to its rank, i.e. to its position in ascending count order. It is published by rename(), so
+ * backends can keep the old table mapped until they notice that a new file has appeared.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t mask;
+    uint32_t reserved;
+} FporderHeader;
+
+
+typedef struct
+{
+    uint32_t fp;
+    int32_t rank;
+} FporderSlot;
+
+
+static inline uint32_t fporder_hash(uint32_t fp, uint32_t mask)
+{
+    return (uint32_t) ((fp * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & mask;
+}
+
+
+void fporder_refresh(void);
+int32_t fporder_rank(uint32_t fp);
+
+Stats *fporder_counts_load(int indexNumber, size_t *limit);
+void fporder_counts_publish(Stats *counts, int indexNumber, size_t limit);
 
 #endif /* FPORDER_H_ */
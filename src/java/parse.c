@@ -152,6 +152,8 @@ int java_parse_substructure_query(SubstructureQueryData **data, char* query, siz
 
             results[i].molecule = (uint8_t *) palloc(moleculeSize);
             memcpy(results[i].molecule, molecule, moleculeSize);
+            results[i].moleculeSize = moleculeSize;
+            results[i].restHSize = restHSize;
 
 
             if(restHArray)
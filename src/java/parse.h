@@ -11,6 +11,8 @@ typedef struct
 {
     uint8_t *molecule;
     bool *restH;
+    int moleculeSize;
+    int restHSize;
 } SubstructureQueryData;
 
 
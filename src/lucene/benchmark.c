@@ -0,0 +1,351 @@
+#include <postgres.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "molecule.h"
+#include "sachem.h"
+#include "lucene.h"
+#include "indexer.h"
+#include "measurement.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define BENCHMARK_FETCH_SIZE    100000
+#define BENCHMARK_BUFFER_SIZE   100000
+#define BENCHMARK_TOP_N         100
+#define BENCHMARK_CUTOFF        0.8f
+#define BENCHMARK_LAYOUTS       2
+
+
+typedef struct
+{
+    int64_t indexSize;
+    double buildTime;
+    double subsearchTime;
+    double simsearchTime;
+} BenchmarkResult;
+
+
+static const char *layouts[BENCHMARK_LAYOUTS] = { "indexType=TEXT", "indexType=POINTS" };
+static const char *layoutNames[BENCHMARK_LAYOUTS] = { "TEXT", "POINTS" };
+
+
+static int64_t lucene_benchmark_directory_size(const char *path)
+{
+    int64_t size = 0;
+    DIR *dp = opendir(path);
+
+    if(dp == NULL)
+        elog(ERROR, "%s: opendir() failed", __func__);
+
+    struct dirent *ep;
+
+    while((ep = readdir(dp)))
+    {
+        char *file = psprintf("%s/%s", path, ep->d_name);
+        struct stat st;
+
+        if(stat(file, &st) == 0 && S_ISREG(st.st_mode))
+            size += st.st_size;
+
+        pfree(file);
+    }
+
+    closedir(dp);
+
+    return size;
+}
+
+
+static double lucene_benchmark_build(const char *path, const char *options)
+{
+    char isNullFlag;
+    int64_t time = 0;
+
+    LuceneIndexer indexer;
+    lucene_indexer_init(&indexer);
+    lucene_indexer_begin(&indexer, path, options);
+
+    PG_TRY();
+    {
+        Portal moleculeCursor = SPI_cursor_open_with_args(NULL, "select id, molecule from " MOLECULES_TABLE,
+                0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+        while(true)
+        {
+            SPI_cursor_fetch(moleculeCursor, true, BENCHMARK_FETCH_SIZE);
+
+            if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+                elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+            if(SPI_processed == 0)
+                break;
+
+            for(size_t i = 0; i < SPI_processed; i++)
+            {
+                CHECK_FOR_INTERRUPTS();
+
+                int32_t id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                Datum mol = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                bytea *data = DatumGetByteaP(mol);
+
+                Molecule molecule;
+                molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
+
+                IntegerFingerprint subfp = integer_substructure_fingerprint_get(&molecule);
+                IntegerFingerprint simfp = integer_similarity_fingerprint_get(&molecule);
+
+                struct timeval begin = time_get();
+                lucene_indexer_add(&indexer, id, subfp, simfp);
+                time += time_spent(begin, time_get());
+
+                if(subfp.data != NULL)
+                    pfree(subfp.data);
+
+                if(simfp.data != NULL)
+                    pfree(simfp.data);
+
+                molecule_simple_free(&molecule);
+
+                if((char *) data != DatumGetPointer(mol))
+                    pfree(data);
+            }
+
+            SPI_freetuptable(SPI_tuptable);
+        }
+
+        SPI_cursor_close(moleculeCursor);
+
+        struct timeval begin = time_get();
+        lucene_indexer_commit(&indexer);
+        time += time_spent(begin, time_get());
+    }
+    PG_CATCH();
+    {
+        lucene_indexer_rollback(&indexer);
+        lucene_indexer_terminate(&indexer);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    lucene_indexer_terminate(&indexer);
+
+    return time_to_ms(time);
+}
+
+
+static void lucene_benchmark_search(const char *path, int32_t maxId, int queryCount, IntegerFingerprint *subfps,
+        IntegerFingerprint *simfps, BenchmarkResult *result)
+{
+    int32_t *buffer = palloc(BENCHMARK_BUFFER_SIZE * sizeof(int32_t));
+    int64_t subsearchTime = 0;
+    int64_t simsearchTime = 0;
+
+    Lucene lucene;
+    lucene_init(&lucene);
+
+    LuceneSubsearchResult subsearchResult;
+    lucene_subsearch_init_result(&subsearchResult, maxId);
+
+    LuceneSimsearchResult simsearchResult = { .hitArray = NULL, .hits = NULL, .count = 0, .possition = 0 };
+
+    PG_TRY();
+    {
+        lucene_set_folder(&lucene, path);
+
+        for(int q = 0; q < queryCount; q++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            struct timeval begin = time_get();
+
+            lucene_subsearch_submit(&lucene, &subsearchResult, subfps[q]);
+
+            while(lucene_subsearch_get(&lucene, &subsearchResult, buffer, BENCHMARK_BUFFER_SIZE) > 0);
+
+            subsearchTime += time_spent(begin, time_get());
+
+
+            begin = time_get();
+
+            int32_t id;
+            float score;
+
+            simsearchResult = lucene_simsearch_submit(&lucene, simfps[q], BENCHMARK_TOP_N, BENCHMARK_CUTOFF, NULL);
+
+            while(lucene_simsearch_get(&lucene, &simsearchResult, &id, &score));
+
+            simsearchTime += time_spent(begin, time_get());
+        }
+    }
+    PG_CATCH();
+    {
+        lucene_subsearch_fail(&lucene, &subsearchResult);
+        lucene_simsearch_fail(&lucene, &simsearchResult);
+        lucene_terminate(&lucene);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    lucene_terminate(&lucene);
+
+    pfree(subsearchResult.hits.words);
+    pfree(buffer);
+
+    result->subsearchTime = time_to_ms(subsearchTime);
+    result->simsearchTime = time_to_ms(simsearchTime);
+}
+
+
+/*
+ * Builds a temporary index of the current molecules for each supported index layout and measures its size, the
+ * build time and the time spent by the index part of substructure and similarity searches of a sample of the stored
+ * molecules. The temporary indexes share the prefix of the regular index, so leftovers are removed by the cleanup.
+ */
+PG_FUNCTION_INFO_V1(lucene_benchmark);
+Datum lucene_benchmark(PG_FUNCTION_ARGS)
+{
+    if(SRF_IS_FIRSTCALL())
+    {
+        int32_t queryCount = PG_GETARG_INT32(0);
+
+        FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+        BenchmarkResult *results;
+
+        PG_MEMCONTEXT_BEGIN(funcctx->multi_call_memory_ctx);
+
+        TupleDesc desc = CreateTemplateTupleDesc(5, false);
+        TupleDescInitEntry(desc, (AttrNumber) 1, "layout", VARCHAROID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 2, "index_size", INT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 3, "build_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 4, "subsearch_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 5, "simsearch_time", FLOAT8OID, -1, 0);
+        funcctx->tuple_desc = BlessTupleDesc(desc);
+
+        results = palloc(BENCHMARK_LAYOUTS * sizeof(BenchmarkResult));
+        funcctx->user_fctx = results;
+        funcctx->max_calls = BENCHMARK_LAYOUTS;
+
+        PG_MEMCONTEXT_END();
+
+
+        if(unlikely(SPI_connect() != SPI_OK_CONNECT))
+            elog(ERROR, "%s: SPI_connect() failed", __func__);
+
+
+        /* get the size of the hit bitsets */
+        if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1)
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        char isNullFlag;
+        int32_t maxId = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        SPI_freetuptable(SPI_tuptable);
+
+
+        /* sample the query molecules */
+        Oid argtypes[] = { INT4OID };
+        Datum args[] = { Int32GetDatum(queryCount) };
+
+        if(unlikely(SPI_execute_with_args("select molecule from " MOLECULES_TABLE " order by random() limit $1",
+                1, argtypes, args, NULL, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+            elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
+
+        queryCount = SPI_processed;
+        IntegerFingerprint *subfps = palloc((queryCount + 1) * sizeof(IntegerFingerprint));
+        IntegerFingerprint *simfps = palloc((queryCount + 1) * sizeof(IntegerFingerprint));
+
+        for(int q = 0; q < queryCount; q++)
+        {
+            Datum mol = SPI_getbinval(SPI_tuptable->vals[q], SPI_tuptable->tupdesc, 1, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *data = DatumGetByteaP(mol);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
+
+            subfps[q] = integer_substructure_fingerprint_get(&molecule);
+            simfps[q] = integer_similarity_fingerprint_get(&molecule);
+
+            molecule_simple_free(&molecule);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+
+
+        for(int l = 0; l < BENCHMARK_LAYOUTS; l++)
+        {
+            char *path = get_file_path(psprintf(LUCENE_INDEX_PREFIX "-benchmark-%s", layoutNames[l]));
+
+            lucene_indexer_delete_directory(path);
+
+            PG_TRY();
+            {
+                results[l].buildTime = lucene_benchmark_build(path, layouts[l]);
+                results[l].indexSize = lucene_benchmark_directory_size(path);
+
+                lucene_benchmark_search(path, maxId, queryCount, subfps, simfps, &results[l]);
+            }
+            PG_CATCH();
+            {
+                lucene_indexer_delete_directory(path);
+
+                PG_RE_THROW();
+            }
+            PG_END_TRY();
+
+            lucene_indexer_delete_directory(path);
+        }
+
+        SPI_finish();
+    }
+
+
+    FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+    BenchmarkResult *results = funcctx->user_fctx;
+
+    if(funcctx->call_cntr == funcctx->max_calls)
+        SRF_RETURN_DONE(funcctx);
+
+    BenchmarkResult *result = &results[funcctx->call_cntr];
+
+    char isnull[5] = {0, 0, 0, 0, 0};
+    Datum values[5] = {
+            PointerGetDatum(cstring_to_text(layoutNames[funcctx->call_cntr])),
+            Int64GetDatum(result->indexSize),
+            Float8GetDatum(result->buildTime),
+            Float8GetDatum(result->subsearchTime),
+            Float8GetDatum(result->simsearchTime)
+    };
+
+    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, isnull);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+}
@@ -20,6 +20,8 @@ static jmethodID deleteMethod;
 static jmethodID optimizeMethod;
 static jmethodID commitMethod;
 static jmethodID rollbackMethod;
+static jmethodID getSettingsMethod;
+static jmethodID requiresRebuildMethod;
 
 
 static void lucene_indexer_java_init()
@@ -35,7 +37,7 @@ static void lucene_indexer_java_init()
     constructor = (*env)->GetMethodID(env, indexerClass, "<init>", "()V");
     java_check_exception(__func__);
 
-    beginMethod = (*env)->GetMethodID(env, indexerClass, "begin", "(Ljava/lang/String;)V");
+    beginMethod = (*env)->GetMethodID(env, indexerClass, "begin", "(Ljava/lang/String;Ljava/lang/String;)V");
     java_check_exception(__func__);
 
     addMethod = (*env)->GetMethodID(env, indexerClass, "add", "(I[I[I)V");
@@ -56,6 +58,13 @@ static void lucene_indexer_java_init()
     rollbackMethod = (*env)->GetMethodID(env, indexerClass, "rollback", "()V");
     java_check_exception(__func__);
 
+    getSettingsMethod = (*env)->GetMethodID(env, indexerClass, "getSettings", "()Ljava/lang/String;");
+    java_check_exception(__func__);
+
+    requiresRebuildMethod = (*env)->GetStaticMethodID(env, indexerClass, "requiresRebuild",
+            "(Ljava/lang/String;Ljava/lang/String;)Z");
+    java_check_exception(__func__);
+
     indexerInitialized = true;
 }
 
@@ -75,27 +84,105 @@ void lucene_indexer_terminate(LuceneIndexer *lucene)
 }
 
 
-void lucene_indexer_begin(LuceneIndexer *lucene, const char *path)
+void lucene_indexer_begin(LuceneIndexer *lucene, const char *path, const char *options)
 {
     jstring folder = NULL;
+    jstring optionString = NULL;
 
     PG_TRY();
     {
         folder = (*env)->NewStringUTF(env, path);
         java_check_exception(__func__);
 
-        (*env)->CallVoidMethod(env, lucene->instance, beginMethod, folder);
+        if(options != NULL)
+        {
+            optionString = (*env)->NewStringUTF(env, options);
+            java_check_exception(__func__);
+        }
+
+        (*env)->CallVoidMethod(env, lucene->instance, beginMethod, folder, optionString);
         java_check_exception(__func__);
 
         JavaDeleteRef(folder);
+        JavaDeleteRef(optionString);
     }
     PG_CATCH();
     {
         JavaDeleteRef(folder);
+        JavaDeleteRef(optionString);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+}
+
+
+char *lucene_indexer_get_settings(LuceneIndexer *lucene)
+{
+    jstring settings = NULL;
+    const char *chars = NULL;
+    char *result = NULL;
+
+    PG_TRY();
+    {
+        settings = (jstring) (*env)->CallObjectMethod(env, lucene->instance, getSettingsMethod);
+        java_check_exception(__func__);
+
+        chars = (*env)->GetStringUTFChars(env, settings, NULL);
+        java_check_exception(__func__);
+
+        result = pstrdup(chars);
+
+        (*env)->ReleaseStringUTFChars(env, settings, chars);
+        JavaDeleteRef(settings);
+    }
+    PG_CATCH();
+    {
+        if(chars != NULL)
+            (*env)->ReleaseStringUTFChars(env, settings, chars);
+
+        JavaDeleteRef(settings);
 
         PG_RE_THROW();
     }
     PG_END_TRY();
+
+    return result;
+}
+
+
+bool lucene_indexer_requires_rebuild(const char *path, const char *options)
+{
+    lucene_indexer_java_init();
+
+    jstring folder = NULL;
+    jstring optionString = NULL;
+    bool result = false;
+
+    PG_TRY();
+    {
+        folder = (*env)->NewStringUTF(env, path);
+        java_check_exception(__func__);
+
+        optionString = (*env)->NewStringUTF(env, options);
+        java_check_exception(__func__);
+
+        result = (*env)->CallStaticBooleanMethod(env, indexerClass, requiresRebuildMethod, folder, optionString);
+        java_check_exception(__func__);
+
+        JavaDeleteRef(folder);
+        JavaDeleteRef(optionString);
+    }
+    PG_CATCH();
+    {
+        JavaDeleteRef(folder);
+        JavaDeleteRef(optionString);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    return result;
 }
 
 
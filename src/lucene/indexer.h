@@ -15,7 +15,9 @@ typedef struct
 
 void lucene_indexer_init(LuceneIndexer *lucene);
 void lucene_indexer_terminate(LuceneIndexer *lucene);
-void lucene_indexer_begin(LuceneIndexer *lucene, const char *path);
+void lucene_indexer_begin(LuceneIndexer *lucene, const char *path, const char *options);
+char *lucene_indexer_get_settings(LuceneIndexer *lucene);
+bool lucene_indexer_requires_rebuild(const char *path, const char *options);
 void lucene_indexer_add(LuceneIndexer *lucene, int32_t id, IntegerFingerprint subfp, IntegerFingerprint simfp);
 void lucene_indexer_add_index(LuceneIndexer *lucene, const char *path);
 void lucene_indexer_delete(LuceneIndexer *lucene, int32_t id);
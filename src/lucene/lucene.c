@@ -14,11 +14,10 @@ static bool luceneInitialized = false;
 static jclass luceneClass;
 static jmethodID constructor;
 static jmethodID setFolderMethod;
+static jmethodID setThreadsMethod;
 static jmethodID subsearchMethod;
+static jmethodID subsearchNextMethod;
 static jmethodID simsearchMethod;
-static jclass scoreHitClass;
-static jfieldID idField;
-static jfieldID scoreField;
 
 
 void lucene_java_init()
@@ -36,19 +35,16 @@ void lucene_java_init()
         setFolderMethod = (*env)->GetMethodID(env, luceneClass, "setFolder", "(Ljava/lang/String;)V");
         java_check_exception(__func__);
 
-        subsearchMethod = (*env)->GetMethodID(env, luceneClass, "subsearch", "([II)[J");
+        setThreadsMethod = (*env)->GetMethodID(env, luceneClass, "setThreads", "(I)V");
         java_check_exception(__func__);
 
-        simsearchMethod = (*env)->GetMethodID(env, luceneClass, "simsearch", "([IIF)[Lcz/iocb/sachem/lucene/ScoreHit;");
+        subsearchMethod = (*env)->GetMethodID(env, luceneClass, "subsearch", "([ILjava/nio/ByteBuffer;)V");
         java_check_exception(__func__);
 
-        scoreHitClass = (*env)->FindClass(env, "cz/iocb/sachem/lucene/ScoreHit");
+        subsearchNextMethod = (*env)->GetMethodID(env, luceneClass, "subsearchNext", "()J");
         java_check_exception(__func__);
 
-        idField = (*env)->GetFieldID(env, scoreHitClass, "id", "I");
-        java_check_exception(__func__);
-
-        scoreField = (*env)->GetFieldID(env, scoreHitClass, "score", "F");
+        simsearchMethod = (*env)->GetMethodID(env, luceneClass, "simsearch", "([IIFLjava/nio/ByteBuffer;)[J");
         java_check_exception(__func__);
 
         luceneInitialized = true;
@@ -95,9 +91,26 @@ void lucene_set_folder(Lucene *lucene, const char *path)
 }
 
 
-LuceneSubsearchResult lucene_subsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t maxId)
+void lucene_set_threads(Lucene *lucene, int threads)
+{
+    (*env)->CallVoidMethod(env, lucene->instance, setThreadsMethod, (jint) threads);
+    java_check_exception(__func__);
+}
+
+
+void lucene_subsearch_init_result(LuceneSubsearchResult *result, int32_t maxId)
+{
+    result->buffer = NULL;
+    result->mask = NULL;
+    result->possition = -1;
+    result->end = -1;
+
+    bitset_init_empty(&result->hits, maxId);
+}
+
+
+void lucene_subsearch_submit(Lucene *lucene, LuceneSubsearchResult *result, IntegerFingerprint fp)
 {
-    LuceneSubsearchResult result = { .bitsetArray = NULL, .bitsetWords = NULL };
     jintArray fpArray = NULL;
 
     PG_TRY();
@@ -108,66 +121,99 @@ LuceneSubsearchResult lucene_subsearch_submit(Lucene *lucene, IntegerFingerprint
         (*env)->SetIntArrayRegion(env, fpArray, 0, fp.size, (jint*) fp.data);
         java_check_exception(__func__);
 
-        result.bitsetArray = (jlongArray) (*env)->CallObjectMethod(env, lucene->instance, subsearchMethod, fpArray, maxId);
+        result->buffer = (*env)->NewDirectByteBuffer(env, result->hits.words, result->hits.length * sizeof(uint64_t));
         java_check_exception(__func__);
 
-        jsize size = (*env)->GetArrayLength(env, result.bitsetArray);
-        result.bitsetWords = (*env)->GetLongArrayElements(env, result.bitsetArray, NULL);
+        (*env)->CallVoidMethod(env, lucene->instance, subsearchMethod, fpArray, result->buffer);
         java_check_exception(__func__);
 
-        bitset_init(&result.hits, (uint64_t *) result.bitsetWords, size);
+        result->possition = 0;
+        result->end = 0;
 
         JavaDeleteRef(fpArray);
     }
     PG_CATCH();
     {
         JavaDeleteRef(fpArray);
-        JavaDeleteLongArray(result.bitsetArray, result.bitsetWords, JNI_ABORT);
+        JavaDeleteRef(result->buffer);
 
         PG_RE_THROW();
     }
     PG_END_TRY();
+}
 
-    return result;
+
+static void lucene_subsearch_next_segment(Lucene *lucene, LuceneSubsearchResult *result)
+{
+    jlong range = (*env)->CallLongMethod(env, lucene->instance, subsearchNextMethod);
+    java_check_exception(__func__);
+
+    if(range < 0)
+    {
+        JavaDeleteRef(result->buffer);
+        result->possition = -1;
+        result->end = -1;
+    }
+    else
+    {
+        result->possition = (uint64_t) range >> 32;
+        result->end = (uint64_t) range & UINT32_MAX;
+    }
 }
 
 
 size_t lucene_subsearch_get(Lucene *lucene, LuceneSubsearchResult *result, int32_t *buffer, size_t size)
 {
-    int ret = 0;
+    size_t count = 0;
 
-    while(size > 0)
+    while(count < size && lucene_subsearch_is_open(result))
     {
-        int id = bitset_next_set_bit(&result->hits, result->possition);
-        result->possition = id == -1 ? -1 : id + 1;
+        if(result->possition == result->end)
+        {
+            lucene_subsearch_next_segment(lucene, result);
+            continue;
+        }
+
+        uint64_t word = result->hits.words[result->possition];
+
+        /* the hits outside the mask are dropped together with the consumed ones */
+        if(result->mask != NULL)
+            word &= result->possition < result->mask->length ? result->mask->words[result->possition] : 0;
 
-        if(id == -1)
+        while(word != 0 && count < size)
         {
-            JavaDeleteLongArray(result->bitsetArray, result->bitsetWords, JNI_ABORT);
-            break;
+            buffer[count++] = result->possition * BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
         }
 
-        *(buffer++) = id;
+        result->hits.words[result->possition] = word;
 
-        ret++;
-        size--;
+        if(word == 0)
+            result->possition++;
     }
 
-    return ret;
+    return count;
 }
 
 
 void lucene_subsearch_fail(Lucene *lucene, LuceneSubsearchResult *result)
 {
-    JavaDeleteLongArray(result->bitsetArray, result->bitsetWords, JNI_ABORT);
+    JavaDeleteRef(result->buffer);
+
+    if(lucene_subsearch_is_open(result))
+        memset(result->hits.words, 0, result->hits.length * sizeof(uint64_t));
+
+    result->possition = -1;
+    result->end = -1;
 }
 
 
-LuceneSimsearchResult lucene_simsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t topN, float cutoff)
+LuceneSimsearchResult lucene_simsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t topN, float cutoff,
+        const BitSet *mask)
 {
+    LuceneSimsearchResult result = { .hitArray = NULL, .hits = NULL, .count = 0, .possition = 0 };
     jintArray fpArray = NULL;
-    jobjectArray result = NULL;
-    jsize count;
+    jobject maskBuffer = NULL;
 
     PG_TRY();
     {
@@ -177,23 +223,34 @@ LuceneSimsearchResult lucene_simsearch_submit(Lucene *lucene, IntegerFingerprint
         (*env)->SetIntArrayRegion(env, fpArray, 0, fp.size, (jint*) fp.data);
         java_check_exception(__func__);
 
-        result = (jobjectArray) (*env)->CallObjectMethod(env, lucene->instance, simsearchMethod, fpArray, topN, cutoff);
+        if(mask != NULL)
+        {
+            maskBuffer = (*env)->NewDirectByteBuffer(env, mask->words, mask->length * sizeof(uint64_t));
+            java_check_exception(__func__);
+        }
+
+        result.hitArray = (jlongArray) (*env)->CallObjectMethod(env, lucene->instance, simsearchMethod, fpArray, topN,
+                cutoff, maskBuffer);
         java_check_exception(__func__);
 
-        count = (*env)->GetArrayLength(env, result);
+        result.count = (*env)->GetArrayLength(env, result.hitArray);
+        result.hits = (*env)->GetLongArrayElements(env, result.hitArray, NULL);
+        java_check_exception(__func__);
 
         JavaDeleteRef(fpArray);
+        JavaDeleteRef(maskBuffer);
     }
     PG_CATCH();
     {
         JavaDeleteRef(fpArray);
-        JavaDeleteRef(result);
+        JavaDeleteRef(maskBuffer);
+        JavaDeleteLongArray(result.hitArray, result.hits, JNI_ABORT);
 
         PG_RE_THROW();
     }
     PG_END_TRY();
 
-    return (LuceneSimsearchResult) { .count = count, .possition = 0, .result = result };
+    return result;
 }
 
 
@@ -201,37 +258,22 @@ bool lucene_simsearch_get(Lucene *lucene, LuceneSimsearchResult *result, int32_t
 {
     if(result->possition == result->count)
     {
-        JavaDeleteRef(result->result);
+        JavaDeleteLongArray(result->hitArray, result->hits, JNI_ABORT);
         return false;
     }
 
+    /* the hits are packed by the java side as (score bits << 32 | id) */
+    uint64_t hit = result->hits[result->possition++];
+    uint32_t scoreBits = hit >> 32;
 
-    jobject element = NULL;
-
-    PG_TRY();
-    {
-        element = (*env)->GetObjectArrayElement(env, result->result, result->possition);
-        *id = (*env)->GetIntField(env, element, idField);
-        *score = (*env)->GetFloatField(env, element, scoreField);
-
-        java_check_exception(__func__);
-
-        JavaDeleteRef(element);
-    }
-    PG_CATCH();
-    {
-        JavaDeleteRef(element);
-
-        PG_RE_THROW();
-    }
-    PG_END_TRY();
+    *id = (int32_t) (uint32_t) hit;
+    memcpy(score, &scoreBits, sizeof(float));
 
-    result->possition++;
     return true;
 }
 
 
 void lucene_simsearch_fail(Lucene *lucene, LuceneSimsearchResult *result)
 {
-    JavaDeleteRef(result->result);
+    JavaDeleteLongArray(result->hitArray, result->hits, JNI_ABORT);
 }
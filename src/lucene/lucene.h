@@ -7,27 +7,32 @@
 #include "fingerprints/fingerprint.h"
 
 
-#define NULL_SUBSEARCH_RESULT       ((LuceneSubsearchResult) { .possition = -1 })
-
-
 typedef struct
 {
     jobject instance;
 } Lucene;
 
 
+/*
+ * The hits are collected by the java side directly into the words of the bitset through a direct byte buffer. The
+ * index segments are searched one by one as the hits are consumed, and the consumed words are cleared on the way,
+ * so the bitset is empty again when the next segment or query is searched. If the mask is set, only the hits that
+ * are also in the mask are returned.
+ */
 typedef struct
 {
-    jlongArray bitsetArray;
-    jlong *bitsetWords;
+    jobject buffer;
     BitSet hits;
+    const BitSet *mask;
     size_t possition;
+    size_t end;
 } LuceneSubsearchResult;
 
 
 typedef struct
 {
-    jobjectArray result;
+    jlongArray hitArray;
+    jlong *hits;
     size_t count;
     size_t possition;
 } LuceneSimsearchResult;
@@ -41,10 +46,13 @@ static inline bool lucene_subsearch_is_open(LuceneSubsearchResult *resultSet)
 void lucene_init(Lucene *lucene);
 void lucene_terminate(Lucene *lucene);
 void lucene_set_folder(Lucene *lucene, const char *path);
-LuceneSubsearchResult lucene_subsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t maxId);
+void lucene_set_threads(Lucene *lucene, int threads);
+void lucene_subsearch_init_result(LuceneSubsearchResult *result, int32_t maxId);
+void lucene_subsearch_submit(Lucene *lucene, LuceneSubsearchResult *result, IntegerFingerprint fp);
 size_t lucene_subsearch_get(Lucene *lucene, LuceneSubsearchResult *resultSet, int32_t *buffer, size_t size);
 void lucene_subsearch_fail(Lucene *lucene, LuceneSubsearchResult *resultSet);
-LuceneSimsearchResult lucene_simsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t topN, float cutoff);
+LuceneSimsearchResult lucene_simsearch_submit(Lucene *lucene, IntegerFingerprint fp, int32_t topN, float cutoff,
+        const BitSet *mask);
 bool lucene_simsearch_get(Lucene *lucene, LuceneSimsearchResult *result, int32_t *id, float *score);
 void lucene_simsearch_fail(Lucene *lucene, LuceneSimsearchResult *result);
 
@@ -1,5 +1,8 @@
 #include <postgres.h>
+#include <catalog/pg_type.h>
 #include <executor/spi.h>
+#include <utils/array.h>
+#include <unistd.h>
 #include "common.h"
 #include "search.h"
 #include "sachem.h"
@@ -11,6 +14,8 @@ static bool initialized = false;
 static bool javaInitialized = false;
 static bool luceneInitialised = false;
 static int indexId = -1;
+static int32_t moleculeCount = 0;
+static int searchThreads = 1;
 static SPIPlanPtr snapshotQueryPlan;
 Lucene lucene;
 
@@ -73,9 +78,39 @@ int lucene_search_update_snapshot(void)
     if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
         elog(ERROR, "%s: SPI_getbinval() failed", __func__);
 
+    SPI_freetuptable(SPI_tuptable);
+
+
+    /* the molecule count bounds the restrictions of the searches */
+    if(unlikely(dbIndexNumber != indexId))
+    {
+        if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1)
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        moleculeCount = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
     SPI_finish();
 
 
+    /* the pool of the search threads should not exceed the processors of the machine */
+    int threads = Min(luceneSearchThreads, sysconf(_SC_NPROCESSORS_ONLN));
+
+    if(unlikely(Max(threads, 1) != searchThreads))
+    {
+        lucene_set_threads(&lucene, threads);
+        searchThreads = Max(threads, 1);
+    }
+
+
     if(unlikely(dbIndexNumber != indexId))
     {
         char *path = get_index_path(LUCENE_INDEX_PREFIX, LUCENE_INDEX_SUFFIX, dbIndexNumber);
@@ -85,3 +120,87 @@ int lucene_search_update_snapshot(void)
 
     return indexId;
 }
+
+
+/*
+ * The search functions are not strict because of their optional restriction, so the other arguments are checked
+ * here; the search behaves as a strict function if any of them is null.
+ */
+bool lucene_search_has_null_argument(FunctionCallInfo fcinfo, int count)
+{
+    for(int i = 0; i < count; i++)
+        if(PG_ARGISNULL(i))
+            return true;
+
+    return false;
+}
+
+
+/*
+ * Reads the optional restriction of the search: the set of the allowed ids at the given argument and the range
+ * [from, to) of the allowed ids at the next two ones, where a null bound leaves the range open on its side. It
+ * returns NULL if the search is not restricted, otherwise a bitset of the allowed ids allocated in the current
+ * memory context; the null and negative ids are ignored, and so are the ids beyond the molecules of the current
+ * snapshot, which bound the size of the bitset.
+ */
+BitSet *lucene_search_get_restriction(FunctionCallInfo fcinfo, int argument)
+{
+    bool hasIds = PG_NARGS() > argument && !PG_ARGISNULL(argument);
+    bool hasFrom = PG_NARGS() > argument + 1 && !PG_ARGISNULL(argument + 1);
+    bool hasTo = PG_NARGS() > argument + 2 && !PG_ARGISNULL(argument + 2);
+
+    if(!hasIds && !hasFrom && !hasTo)
+        return NULL;
+
+    int32_t from = hasFrom ? Max(PG_GETARG_INT32(argument + 1), 0) : 0;
+    int32_t to = hasTo ? Min(PG_GETARG_INT32(argument + 2), moleculeCount) : moleculeCount;
+
+    BitSet *restriction = (BitSet *) palloc(sizeof(BitSet));
+
+
+    /* the range can be large, so its words are filled at once */
+    if(!hasIds)
+    {
+        bitset_init_empty(restriction, Max(to, 0));
+
+        if(from < to)
+        {
+            for(int i = from >> ADDRESS_BITS_PER_WORD; i < restriction->length; i++)
+                restriction->words[i] = WORD_MASK;
+
+            restriction->words[from >> ADDRESS_BITS_PER_WORD] &= WORD_MASK << (from % BITS_PER_WORD);
+            restriction->words[restriction->length - 1] &= WORD_MASK >> (-to & 0x3f);
+            restriction->wordsInUse = restriction->length;
+        }
+
+        return restriction;
+    }
+
+
+    ArrayType *array = PG_GETARG_ARRAYTYPE_P(argument);
+
+    Datum *elements;
+    bool *nulls;
+    int count;
+
+    deconstruct_array(array, INT4OID, sizeof(int32), true, 'i', &elements, &nulls, &count);
+
+    int32_t maxId = -1;
+
+    for(int i = 0; i < count; i++)
+        if(!nulls[i] && DatumGetInt32(elements[i]) < to && DatumGetInt32(elements[i]) > maxId)
+            maxId = DatumGetInt32(elements[i]);
+
+    bitset_init_empty(restriction, maxId + 1);
+
+    for(int i = 0; i < count; i++)
+        if(!nulls[i] && DatumGetInt32(elements[i]) >= from && DatumGetInt32(elements[i]) < to)
+            bitset_set(restriction, DatumGetInt32(elements[i]));
+
+    pfree(elements);
+    pfree(nulls);
+
+    PG_FREE_IF_COPY(array, argument);
+
+    return restriction;
+}
@@ -1,6 +1,9 @@
 #ifndef LUCENE_SEARCH_H_
 #define LUCENE_SEARCH_H_
 
+#include <postgres.h>
+#include <fmgr.h>
+#include "bitset.h"
 #include "lucene.h"
 
 
@@ -9,5 +12,19 @@ extern Lucene lucene;
 
 void lucene_search_init(void);
 int lucene_search_update_snapshot(void);
+bool lucene_search_has_null_argument(FunctionCallInfo fcinfo, int count);
+BitSet *lucene_search_get_restriction(FunctionCallInfo fcinfo, int argument);
+
+
+static inline bool lucene_search_is_allowed(const BitSet *restriction, int32_t id)
+{
+    if(restriction == NULL)
+        return true;
+
+    if(id < 0 || (id >> ADDRESS_BITS_PER_WORD) >= restriction->length)
+        return false;
+
+    return (restriction->words[id >> ADDRESS_BITS_PER_WORD] & (1L << (id % BITS_PER_WORD))) != 0;
+}
 
 #endif /* LUCENE_SEARCH_H_ */
@@ -9,11 +9,14 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include "common.h"
+#include "countindex.h"
+#include "heap.h"
 #include "search.h"
 #include "molecule.h"
 #include "sachem.h"
 #include "lucene.h"
 #include "measurement.h"
+#include "resultcache.h"
 #include "java/parse.h"
 #include "fingerprints/fingerprint.h"
 
@@ -25,6 +28,12 @@ typedef struct
 {
     LuceneSimsearchResult result;
 
+    bool cached;
+    int32_t indexId;
+    ResultCacheKey cacheKey;
+    ResultCacheReader cacheReader;
+    ResultCacheWriter cacheWriter;
+
 #if SHOW_STATS
     int32_t foundResults;
     struct timeval begin;
@@ -33,11 +42,37 @@ typedef struct
 } SimilaritySearchData;
 
 
+typedef struct
+{
+    int32_t topN;
+    float4 cutoff;
+    BitSet *restriction;
+
+    CountFingerprint fp;
+    uint32_t total;
+
+    int64_t lowPosition;
+    int64_t highPosition;
+    int32_t foundResults;
+
+    Heap heap;
+
+#if SHOW_STATS
+    int32_t candidateCount;
+    struct timeval begin;
+#endif
+
+} CountSimilaritySearchData;
+
+
 static bool initialized = false;
+static bool countIndexInitialized = false;
+static int countIndexId = -1;
+static CountIndex countIndex;
 static TupleDesc tupdesc = NULL;
 
 
-void lucene_simsearch_init(void)
+int lucene_simsearch_init(void)
 {
     if(unlikely(initialized == false))
     {
@@ -79,7 +114,7 @@ void lucene_simsearch_init(void)
 
 
     /* get snapshot information */
-    lucene_search_update_snapshot();
+    return lucene_search_update_snapshot();
 }
 
 
@@ -88,10 +123,16 @@ Datum lucene_similarity_search(PG_FUNCTION_ARGS)
 {
     if(SRF_IS_FIRSTCALL())
     {
+        if(lucene_search_has_null_argument(fcinfo, 4))
+        {
+            FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+            SRF_RETURN_DONE(funcctx);
+        }
+
 #if SHOW_STATS
         struct timeval begin = time_get();
 #endif
-        lucene_simsearch_init();
+        int32_t indexId = lucene_simsearch_init();
 
         VarChar *query = PG_GETARG_VARCHAR_P(0);
         int32_t type = PG_GETARG_INT32(1);
@@ -105,15 +146,35 @@ Datum lucene_similarity_search(PG_FUNCTION_ARGS)
         SimilaritySearchData *info = (SimilaritySearchData *) palloc(sizeof(SimilaritySearchData));
         funcctx->user_fctx = info;
 
-        SimilarityQueryData queryData;
-        java_parse_similarity_query(&queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ, type);
+        int32_t cutoffBits;
+        memcpy(&cutoffBits, &cutoff, sizeof(int32_t));
 
-        Molecule molecule;
-        molecule_simple_init(&molecule, queryData.molecule);
+        BitSet *restriction = lucene_search_get_restriction(fcinfo, 4);
+
+        /* a restricted result is not complete, so it is neither looked up nor stored */
+        int32_t options[] = { type, cutoffBits, topN };
+        info->indexId = indexId;
+        info->cacheKey = result_cache_key(__func__, options, sizeof(options) / sizeof(int32_t), VARDATA(query),
+                VARSIZE(query) - VARHDRSZ);
+        info->cached = restriction == NULL && result_cache_lookup(&info->cacheKey, indexId, &info->cacheReader);
+
+        if(!info->cached)
+        {
+            SimilarityQueryData queryData;
+            java_parse_similarity_query(&queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ, type);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, queryData.molecule);
+
+            IntegerFingerprint fp = integer_similarity_fingerprint_get_query(&molecule);
 
-        IntegerFingerprint fp = integer_similarity_fingerprint_get_query(&molecule);
+            info->result = lucene_simsearch_submit(&lucene, fp, topN, cutoff, restriction);
 
-        info->result = lucene_simsearch_submit(&lucene, fp, topN, cutoff);
+            result_cache_writer_init(&info->cacheWriter);
+
+            if(restriction != NULL)
+                result_cache_writer_invalidate(&info->cacheWriter);
+        }
 
         PG_FREE_IF_COPY(query, 0);
 
@@ -133,17 +194,37 @@ Datum lucene_similarity_search(PG_FUNCTION_ARGS)
     float score;
     bool isNull = true;
 
-    PG_TRY();
+    if(info->cached)
     {
-        isNull = !lucene_simsearch_get(&lucene, &info->result, &id, &score);
+        isNull = !result_cache_read_id(&info->cacheReader, &id);
+
+        if(!isNull)
+            score = result_cache_read_score(&info->cacheReader);
     }
-    PG_CATCH();
+    else
     {
-        lucene_simsearch_fail(&lucene, &info->result);
+        PG_TRY();
+        {
+            isNull = !lucene_simsearch_get(&lucene, &info->result, &id, &score);
+        }
+        PG_CATCH();
+        {
+            lucene_simsearch_fail(&lucene, &info->result);
+
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
 
-        PG_RE_THROW();
+        if(isNull)
+        {
+            result_cache_store(&info->cacheKey, info->indexId, &info->cacheWriter);
+        }
+        else
+        {
+            result_cache_write_id(&info->cacheWriter, id);
+            result_cache_write_score(&info->cacheWriter, score);
+        }
     }
-    PG_END_TRY();
 
     if(unlikely(isNull))
     {
@@ -169,3 +250,150 @@ Datum lucene_similarity_search(PG_FUNCTION_ARGS)
         SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
     }
 }
+
+
+void lucene_count_simsearch_init(void)
+{
+    int dbIndexNumber = lucene_simsearch_init();
+
+    if(unlikely(countIndexInitialized == false))
+    {
+        count_index_init(&countIndex);
+        countIndexInitialized = true;
+    }
+
+    if(unlikely(dbIndexNumber != countIndexId))
+    {
+        count_index_open(&countIndex, dbIndexNumber);
+        countIndexId = dbIndexNumber;
+    }
+}
+
+
+PG_FUNCTION_INFO_V1(lucene_count_similarity_search);
+Datum lucene_count_similarity_search(PG_FUNCTION_ARGS)
+{
+    if(SRF_IS_FIRSTCALL())
+    {
+        if(lucene_search_has_null_argument(fcinfo, 4))
+        {
+            FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+            SRF_RETURN_DONE(funcctx);
+        }
+
+#if SHOW_STATS
+        struct timeval begin = time_get();
+#endif
+        lucene_count_simsearch_init();
+
+        VarChar *query = PG_GETARG_VARCHAR_P(0);
+        int32_t type = PG_GETARG_INT32(1);
+        float4 cutoff = PG_GETARG_FLOAT4(2);
+        int32_t topN = PG_GETARG_INT32(3);
+
+        FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+
+        PG_MEMCONTEXT_BEGIN(funcctx->multi_call_memory_ctx);
+
+        CountSimilaritySearchData *info = (CountSimilaritySearchData *) palloc(sizeof(CountSimilaritySearchData));
+        funcctx->user_fctx = info;
+
+        info->topN = topN;
+        info->cutoff = cutoff;
+        info->restriction = lucene_search_get_restriction(fcinfo, 4);
+
+        SimilarityQueryData queryData;
+        java_parse_similarity_query(&queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ, type);
+
+        Molecule molecule;
+        molecule_simple_init(&molecule, queryData.molecule);
+
+        info->fp = count_similarity_fingerprint_get(&molecule);
+        info->total = count_fingerprint_total(info->fp);
+
+        /* start at the molecules with the same total count and expand the range in both directions */
+        info->highPosition = count_index_lower_bound(&countIndex, info->total);
+        info->lowPosition = info->highPosition - 1;
+        info->foundResults = 0;
+
+        heap_init(&info->heap);
+
+        PG_FREE_IF_COPY(query, 0);
+
+#if SHOW_STATS
+        info->candidateCount = 0;
+        info->begin = begin;
+#endif
+
+        PG_MEMCONTEXT_END();
+    }
+
+
+    FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+    CountSimilaritySearchData *info = funcctx->user_fctx;
+    Heap *heap = &info->heap;
+
+    HeapItem result;
+    bool isNull = true;
+
+
+    if(likely(info->topN <= 0 || info->topN != info->foundResults))
+    {
+        while(true)
+        {
+            float4 lowBound = info->lowPosition >= 0 ?
+                    count_index_bound(info->total, countIndex.molecules[info->lowPosition].total) : -1.0f;
+            float4 highBound = info->highPosition < countIndex.moleculeCount ?
+                    count_index_bound(info->total, countIndex.molecules[info->highPosition].total) : -1.0f;
+            float4 bound = lowBound > highBound ? lowBound : highBound;
+
+            if(heap_size(heap) > 0 && heap_head(heap).score >= bound)
+            {
+                result = heap_head(heap);
+                heap_remove(heap);
+                isNull = false;
+                break;
+            }
+
+            if(bound < 0.0f || bound < info->cutoff)
+                break;
+
+            int64_t position = highBound >= lowBound ? info->highPosition++ : info->lowPosition--;
+
+            if(!lucene_search_is_allowed(info->restriction, countIndex.molecules[position].id))
+                continue;
+
+            float4 score = count_index_score(&countIndex, position, info->fp, info->total);
+
+#if SHOW_STATS
+            info->candidateCount++;
+#endif
+
+            if(score >= info->cutoff)
+                heap_add(heap, (HeapItem) {.id = countIndex.molecules[position].id, .score = score});
+        }
+    }
+
+
+    if(unlikely(isNull))
+    {
+#if SHOW_STATS
+        struct timeval end = time_get();
+        int64_t spentTime = time_spent(info->begin, end);
+        elog(NOTICE, "stat: %i %i", info->foundResults, info->candidateCount);
+        elog(NOTICE, "time: %.3fms", time_to_ms(spentTime));
+#endif
+
+        SRF_RETURN_DONE(funcctx);
+    }
+    else
+    {
+        info->foundResults++;
+
+        char isnull[2] = {0, 0};
+        Datum values[2] = {Int32GetDatum(result.id), Float4GetDatum(result.score)};
+        HeapTuple tuple = heap_form_tuple(tupdesc, values, isnull);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+}
@@ -2,11 +2,15 @@
 #include <catalog/pg_type.h>
 #include <executor/spi.h>
 #include <funcapi.h>
+#include <access/htup_details.h>
+#include <utils/array.h>
 #include <utils/memutils.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <math.h>
 #include "bitset.h"
 #include "common.h"
 #include "search.h"
@@ -17,12 +21,17 @@
 #include "subsearch.h"
 #include "lucene.h"
 #include "measurement.h"
+#include "resultcache.h"
 #include "java/parse.h"
 #include "fingerprints/fingerprint.h"
 
 
 #define SHOW_STATS              0
 #define FETCH_SIZE              10000
+#define CACHE_NAME              "lucene_substructure_search"
+#define REFINE_CANDIDATES       8
+#define ESTIMATE_ROUND_SIZE     64
+#define ESTIMATE_Z_SCORE        1.96
 
 
 typedef struct
@@ -35,6 +44,7 @@ typedef struct
     StereoMode stereoMode;
     int32_t vf2_timeout;
 
+    BitSet *restriction;
     BitSet resultMask;
     int32_t foundResults;
 
@@ -44,6 +54,17 @@ typedef struct
 
     LuceneSubsearchResult result;
 
+    bool cached;
+    ResultCacheKey cacheKey;
+    ResultCacheReader cacheReader;
+    ResultCacheWriter cacheWriter;
+
+    bool refinable;
+    uint64_t family;
+    int32_t *refinedIds;
+    size_t refinedCount;
+    size_t refinedPosition;
+
 #if USE_MOLECULE_INDEX == 0
     SPITupleTable *table;
 #endif
@@ -218,11 +239,81 @@ void lucene_subsearch_init(void)
 }
 
 
+/*
+ * Looks for a cached complete result of a query that is contained in the current query. The hits of the current
+ * query are a subset of its hits, so only they have to be verified instead of the candidates from the index.
+ */
+static bool lucene_subsearch_refine(SubstructureSearchData *info)
+{
+    ResultCacheQuery queries[REFINE_CANDIDATES];
+    int count = result_cache_find_queries(CACHE_NAME, info->family, indexId, queries, REFINE_CANDIDATES);
+
+    SubstructureQueryData *data = &(info->queryData[0]);
+
+    for(int i = 0; i < count; i++)
+    {
+        bool extended = info->extended || molecule_is_extended_search_needed(queries[i].molecule,
+                info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE);
+
+        Molecule query;
+        Molecule target;
+        VF2State vf2state;
+
+        molecule_init(&query, queries[i].molecule, NULL, extended, info->chargeMode != CHARGE_IGNORE,
+                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+        vf2state_init(&vf2state, &query, GRAPH_SUBSTRUCTURE, info->chargeMode, info->isotopeMode, info->stereoMode);
+        molecule_init(&target, data->molecule, NULL, extended, info->chargeMode != CHARGE_IGNORE,
+                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+
+        if(!vf2state_match(&vf2state, &target, -1, info->vf2_timeout))
+            continue;
+
+        ResultCacheReader reader;
+
+        if(!result_cache_fetch_query(&queries[i], indexId, &reader))
+            continue;
+
+        /* each id takes at least one byte */
+        info->refinedIds = (int32_t *) palloc(reader.size * sizeof(int32_t) + 1);
+        info->refinedCount = 0;
+        info->refinedPosition = 0;
+
+        while(result_cache_read_id(&reader, &info->refinedIds[info->refinedCount]))
+            if(lucene_search_is_allowed(info->restriction, info->refinedIds[info->refinedCount]))
+                info->refinedCount++;
+
+        return true;
+    }
+
+    return false;
+}
+
+
+static size_t lucene_subsearch_get_refined(SubstructureSearchData *info, int32_t *buffer, size_t size)
+{
+    size_t count = Min(size, info->refinedCount - info->refinedPosition);
+
+    memcpy(buffer, info->refinedIds + info->refinedPosition, count * sizeof(int32_t));
+    info->refinedPosition += count;
+
+    if(count == 0)
+        info->refinedIds = NULL;
+
+    return count;
+}
+
+
 PG_FUNCTION_INFO_V1(lucene_substructure_search);
 Datum lucene_substructure_search(PG_FUNCTION_ARGS)
 {
     if(SRF_IS_FIRSTCALL())
     {
+        if(lucene_search_has_null_argument(fcinfo, 9))
+        {
+            FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+            SRF_RETURN_DONE(funcctx);
+        }
+
 #if SHOW_STATS
         struct timeval begin = time_get();
 #endif
@@ -251,51 +342,82 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
         info->isotopeMode = isotopeMode;
         info->stereoMode = stereoMode;
         info->vf2_timeout = vf2_timeout;
+        info->restriction = lucene_search_get_restriction(fcinfo, 9);
+
+        /* a restricted result is not complete, so it is neither looked up nor stored */
+        int32_t options[] = { type, topN, graphMode, chargeMode, isotopeMode, stereoMode, tautomerMode };
+        info->cacheKey = result_cache_key(CACHE_NAME, options, sizeof(options) / sizeof(int32_t), VARDATA(query),
+                VARSIZE(query) - VARHDRSZ);
+        info->cached = info->restriction == NULL && result_cache_lookup(&info->cacheKey, indexId, &info->cacheReader);
 
+        if(info->cached)
+        {
+            PG_FREE_IF_COPY(query, 0);
+        }
+        else
+        {
 #if SHOW_STATS
-        struct timeval java_begin = time_get();
+            struct timeval java_begin = time_get();
 #endif
-        info->queryDataCount = java_parse_substructure_query(&info->queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ,
-                type, graphMode == GRAPH_EXACT, tautomerMode == TAUTOMER_INCHI);
+            info->queryDataCount = java_parse_substructure_query(&info->queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ,
+                    type, graphMode == GRAPH_EXACT, tautomerMode == TAUTOMER_INCHI);
 #if SHOW_STATS
-        struct timeval java_end = time_get();
+            struct timeval java_end = time_get();
 #endif
 
-        PG_FREE_IF_COPY(query, 0);
+            PG_FREE_IF_COPY(query, 0);
 
-        info->queryDataPosition = -1;
-        info->result = NULL_SUBSEARCH_RESULT;
-        info->tableRowCount = -1;
-        info->tableRowPosition = -1;
-        info->foundResults = 0;
+            info->queryDataPosition = -1;
+            lucene_subsearch_init_result(&info->result, moleculeCount);
+            info->result.mask = info->restriction;
+            info->tableRowCount = -1;
+            info->tableRowPosition = -1;
+            info->foundResults = 0;
 #if USE_MOLECULE_INDEX == 0
-        info->table = NULL;
+            info->table = NULL;
 #endif
 
-        bitset_init_empty(&info->resultMask, moleculeCount);
+            bitset_init_empty(&info->resultMask, moleculeCount);
 
-        info->isomorphismContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
-                "subsearch-lucene isomorphism context", ALLOCSET_DEFAULT_SIZES);
-        info->targetContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
-                "subsearch-lucene target context", ALLOCSET_DEFAULT_SIZES);
+            info->isomorphismContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
+                    "subsearch-lucene isomorphism context", ALLOCSET_DEFAULT_SIZES);
+            info->targetContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
+                    "subsearch-lucene target context", ALLOCSET_DEFAULT_SIZES);
 
 #if USE_MOLECULE_INDEX
-        info->arrayBuffer = (int32_t *) palloc(FETCH_SIZE * sizeof(int32_t));
+            info->arrayBuffer = (int32_t *) palloc(FETCH_SIZE * sizeof(int32_t));
 #else
-        info->arrayBuffer = (ArrayType *) palloc(FETCH_SIZE * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
-        info->arrayBuffer->ndim = 1;
-        info->arrayBuffer->dataoffset = 0;
-        info->arrayBuffer->elemtype = INT4OID;
+            info->arrayBuffer = (ArrayType *) palloc(FETCH_SIZE * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
+            info->arrayBuffer->ndim = 1;
+            info->arrayBuffer->dataoffset = 0;
+            info->arrayBuffer->elemtype = INT4OID;
 #endif
 
 #if SHOW_STATS
-        info->begin = begin;
-        info->candidateCount = 0;
-        info->prepareTime = time_spent(java_begin, java_end);
-        info->indexTime = 0;
-        info->matchTime = 0;
+            info->begin = begin;
+            info->candidateCount = 0;
+            info->prepareTime = time_spent(java_begin, java_end);
+            info->indexTime = 0;
+            info->matchTime = 0;
 #endif
 
+            /* only simple queries can be compared with the cached queries as molecules */
+            info->refinable = graphMode == GRAPH_SUBSTRUCTURE && tautomerMode == TAUTOMER_IGNORE &&
+                    info->queryDataCount == 1 && info->queryData[0].restH == NULL &&
+                    !molecule_has_pseudo_atom(info->queryData[0].molecule);
+            info->family = (uint64_t) chargeMode | (uint64_t) isotopeMode << 16 | (uint64_t) stereoMode << 32;
+            info->refinedIds = NULL;
+
+            result_cache_writer_init(&info->cacheWriter);
+
+            if(info->refinable && topN <= 0)
+                result_cache_write_query(&info->cacheWriter, info->family, info->queryData[0].molecule,
+                        info->queryData[0].moleculeSize);
+
+            if(info->restriction != NULL)
+                result_cache_writer_invalidate(&info->cacheWriter);
+        }
+
         PG_MEMCONTEXT_END();
     }
 
@@ -305,6 +427,16 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
     FuncCallContext *funcctx = SRF_PERCALL_SETUP();
     SubstructureSearchData *info = funcctx->user_fctx;
 
+    if(info->cached)
+    {
+        int32_t id;
+
+        if(result_cache_read_id(&info->cacheReader, &id))
+            SRF_RETURN_NEXT(funcctx, Int32GetDatum(id));
+
+        SRF_RETURN_DONE(funcctx);
+    }
+
     Datum result;
     bool isNull = true;
 
@@ -324,7 +456,7 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
                     }
 #endif
 
-                    if(!lucene_subsearch_is_open(&info->result))
+                    if(!lucene_subsearch_is_open(&info->result) && info->refinedIds == NULL)
                     {
                         info->queryDataPosition++;
 
@@ -347,23 +479,26 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
                         vf2state_init(&info->vf2state, &info->queryMolecule, info->graphMode, info->chargeMode, info->isotopeMode,
                                 info->stereoMode);
 
-                        IntegerFingerprint fp = integer_substructure_fingerprint_get_query(&info->queryMolecule);
+                        if(!info->refinable || !lucene_subsearch_refine(info))
+                        {
+                            IntegerFingerprint fp = integer_substructure_fingerprint_get_query(&info->queryMolecule);
 #if SHOW_STATS
-                        struct timeval fingerprint_end = time_get();
-                        info->prepareTime += time_spent(fingerprint_begin, fingerprint_end);
+                            struct timeval fingerprint_end = time_get();
+                            info->prepareTime += time_spent(fingerprint_begin, fingerprint_end);
 #endif
 
 #if SHOW_STATS
-                        struct timeval search_begin = time_get();
+                            struct timeval search_begin = time_get();
 #endif
-                        info->result = lucene_subsearch_submit(&lucene, fp, moleculeCount);
+                            lucene_subsearch_submit(&lucene, &info->result, fp);
 #if SHOW_STATS
-                        struct timeval search_end = time_get();
-                        info->indexTime += time_spent(search_begin, search_end);
+                            struct timeval search_end = time_get();
+                            info->indexTime += time_spent(search_begin, search_end);
 #endif
 
-                        if(fp.data != NULL)
-                            pfree(fp.data);
+                            if(fp.data != NULL)
+                                pfree(fp.data);
+                        }
 
                         PG_MEMCONTEXT_END();
                     }
@@ -377,7 +512,8 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
 #if SHOW_STATS
                     struct timeval get_begin = time_get();
 #endif
-                    size_t count = lucene_subsearch_get(&lucene, &info->result, arrayData, FETCH_SIZE);
+                    size_t count = info->refinedIds != NULL ? lucene_subsearch_get_refined(info, arrayData, FETCH_SIZE) :
+                            lucene_subsearch_get(&lucene, &info->result, arrayData, FETCH_SIZE);
 #if SHOW_STATS
                     struct timeval get_end = time_get();
                     info->indexTime += time_spent(get_begin, get_end);
@@ -490,6 +626,10 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
                     PG_MEMCONTEXT_END();
                     MemoryContextReset(info->targetContext);
 
+                    /* an expired match makes the result incomplete, so it cannot be reused */
+                    if(unlikely(vf2Timeouted))
+                        result_cache_writer_invalidate(&info->cacheWriter);
+
 #if SHOW_STATS
                     info->candidateCount++;
                     struct timeval match_end = time_get();
@@ -500,6 +640,7 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
                     {
                         bitset_set(&info->resultMask, id);
                         info->foundResults++;
+                        result_cache_write_id(&info->cacheWriter, id);
                         result = Int32GetDatum(id);
                         isNull = false;
                         break;
@@ -542,6 +683,8 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
                 info->indexTime / scale, info->matchTime / scale, sumTime / scale);
 #endif
 
+        result_cache_store(&info->cacheKey, indexId, &info->cacheWriter);
+
         SRF_RETURN_DONE(funcctx);
     }
     else
@@ -549,3 +692,1014 @@ Datum lucene_substructure_search(PG_FUNCTION_ARGS)
         SRF_RETURN_NEXT(funcctx, result);
     }
 }
+
+
+/*
+ * One query molecule of the batch search. A query can produce several query molecules (e.g. tautomers), the hits of
+ * all of them belong to the same query.
+ */
+typedef struct
+{
+    int32_t query;
+    bool extended;
+    Molecule molecule;
+    VF2State vf2state;
+    Molecule extendedMolecule;
+    VF2State extendedVf2state;
+
+    int32_t *candidates;
+    size_t candidateCount;
+    size_t candidatePosition;
+} BatchQueryPart;
+
+
+typedef struct
+{
+    GraphMode graphMode;
+    ChargeMode chargeMode;
+    IsotopeMode isotopeMode;
+    StereoMode stereoMode;
+    int32_t vf2_timeout;
+    const BitSet *restriction;
+
+    BatchQueryPart *parts;
+    int partCount;
+    bool sampling;
+    bool timeouted;
+
+    /* a query expression requires all queries to match and none of the excluded parts */
+    bool conjunctive;
+    int termCount;
+    BatchQueryPart *excluded;
+    int excludedCount;
+    bool rejected;
+
+    /* union of the candidates of all query parts that have not been processed yet */
+    BitSet candidates;
+    int wordPosition;
+
+    /* query parts of the molecules of the current chunk stored as a compressed sparse row */
+    int32_t *chunkIds;
+    int32_t *chunkPartOffsets;
+    int32_t *chunkParts;
+
+    int32_t *matches;
+    int matchCount;
+    int matchPosition;
+    int32_t matchId;
+
+#if USE_MOLECULE_INDEX
+    int32_t *arrayBuffer;
+#else
+    ArrayType *arrayBuffer;
+    SPITupleTable *table;
+#endif
+    int tableRowCount;
+    int tableRowPosition;
+
+    MemoryContext chunkContext;
+    MemoryContext targetContext;
+} BatchSearchData;
+
+
+static int lucene_subsearch_batch_compare_ids(const void *a, const void *b)
+{
+    int32_t x = *((const int32_t *) a);
+    int32_t y = *((const int32_t *) b);
+
+    return (x > y) - (x < y);
+}
+
+
+static void lucene_subsearch_batch_screen(BatchSearchData *info, BatchQueryPart *part, IntegerFingerprint fp)
+{
+    LuceneSubsearchResult result;
+    lucene_subsearch_init_result(&result, moleculeCount);
+    result.mask = info->restriction;
+
+    size_t capacity = FETCH_SIZE;
+    part->candidates = (int32_t *) palloc(capacity * sizeof(int32_t));
+    part->candidateCount = 0;
+    part->candidatePosition = 0;
+
+    PG_TRY();
+    {
+        lucene_subsearch_submit(&lucene, &result, fp);
+
+        while(lucene_subsearch_is_open(&result))
+        {
+            if(part->candidateCount + FETCH_SIZE > capacity)
+            {
+                capacity *= 2;
+                part->candidates = (int32_t *) repalloc(part->candidates, capacity * sizeof(int32_t));
+            }
+
+            part->candidateCount += lucene_subsearch_get(&lucene, &result, part->candidates + part->candidateCount,
+                    FETCH_SIZE);
+        }
+    }
+    PG_CATCH();
+    {
+        lucene_subsearch_fail(&lucene, &result);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    pfree(result.hits.words);
+
+    /* the segments of the index are searched one by one, so the hits need not be ordered */
+    qsort(part->candidates, part->candidateCount, sizeof(int32_t), lucene_subsearch_batch_compare_ids);
+
+    for(size_t i = 0; i < part->candidateCount; i++)
+        bitset_set(&info->candidates, part->candidates[i]);
+}
+
+
+static size_t lucene_subsearch_batch_next_chunk(BatchSearchData *info)
+{
+#if USE_MOLECULE_INDEX
+    int32_t *ids = info->arrayBuffer;
+#else
+    int32_t *ids = (int32_t *) ARR_DATA_PTR(info->arrayBuffer);
+#endif
+    size_t count = 0;
+
+    while(count < FETCH_SIZE && info->wordPosition < info->candidates.length)
+    {
+        uint64_t word = info->candidates.words[info->wordPosition];
+
+        while(word != 0 && count < FETCH_SIZE)
+        {
+            ids[count++] = info->wordPosition * BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+
+        info->candidates.words[info->wordPosition] = word;
+
+        if(word == 0)
+            info->wordPosition++;
+    }
+
+    if(count == 0)
+        return 0;
+
+
+    /* assign the query parts to the molecules of the chunk */
+    MemoryContextReset(info->chunkContext);
+    PG_MEMCONTEXT_BEGIN(info->chunkContext);
+
+    int32_t last = ids[count - 1];
+    int32_t *offsets = (int32_t *) palloc0((count + 1) * sizeof(int32_t));
+    size_t total = 0;
+
+    for(int p = 0; p < info->partCount; p++)
+    {
+        BatchQueryPart *part = &info->parts[p];
+
+        /* the sampled molecules are not processed in the id order, so the candidates are looked up directly */
+        if(info->sampling)
+        {
+            for(size_t i = 0; i < count; i++)
+            {
+                if(bsearch(&ids[i], part->candidates, part->candidateCount, sizeof(int32_t),
+                        lucene_subsearch_batch_compare_ids) != NULL)
+                {
+                    offsets[i + 1]++;
+                    total++;
+                }
+            }
+
+            continue;
+        }
+
+        for(size_t c = part->candidatePosition; c < part->candidateCount && part->candidates[c] <= last; c++)
+        {
+            int32_t *position = bsearch(&part->candidates[c], ids, count, sizeof(int32_t),
+                    lucene_subsearch_batch_compare_ids);
+            offsets[position - ids + 1]++;
+            total++;
+        }
+    }
+
+    for(size_t i = 0; i < count; i++)
+        offsets[i + 1] += offsets[i];
+
+    int32_t *fill = (int32_t *) palloc(count * sizeof(int32_t));
+    memcpy(fill, offsets, count * sizeof(int32_t));
+
+    int32_t *parts = (int32_t *) palloc((total + 1) * sizeof(int32_t));
+
+    for(int p = 0; p < info->partCount; p++)
+    {
+        BatchQueryPart *part = &info->parts[p];
+
+        if(info->sampling)
+        {
+            for(size_t i = 0; i < count; i++)
+                if(bsearch(&ids[i], part->candidates, part->candidateCount, sizeof(int32_t),
+                        lucene_subsearch_batch_compare_ids) != NULL)
+                    parts[fill[i]++] = p;
+
+            continue;
+        }
+
+        for(; part->candidatePosition < part->candidateCount && part->candidates[part->candidatePosition] <= last;
+                part->candidatePosition++)
+        {
+            int32_t *position = bsearch(&part->candidates[part->candidatePosition], ids, count, sizeof(int32_t),
+                    lucene_subsearch_batch_compare_ids);
+            parts[fill[position - ids]++] = p;
+        }
+    }
+
+    info->chunkIds = (int32_t *) palloc(count * sizeof(int32_t));
+    memcpy(info->chunkIds, ids, count * sizeof(int32_t));
+    info->chunkPartOffsets = offsets;
+    info->chunkParts = parts;
+
+    PG_MEMCONTEXT_END();
+
+    return count;
+}
+
+
+/*
+ * Matches one query part against the molecule. The target is decoded only on demand, into one of the variants of the
+ * molecule initialization that the query parts need.
+ */
+static bool lucene_subsearch_batch_match_part(BatchSearchData *info, BatchQueryPart *part, int32_t id,
+        uint8_t *molecule, bool special, Molecule *targets, bool *ready)
+{
+    bool match;
+
+    if(!part->extended && special)
+    {
+        if(!ready[2])
+        {
+            molecule_init(&targets[2], molecule, NULL, true, info->chargeMode != CHARGE_IGNORE,
+                    info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+            ready[2] = true;
+        }
+
+        match = vf2state_match(&part->extendedVf2state, &targets[2], id, info->vf2_timeout);
+    }
+    else
+    {
+        if(!ready[part->extended])
+        {
+            molecule_init(&targets[part->extended], molecule, NULL, part->extended,
+                    info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE,
+                    info->stereoMode != STEREO_IGNORE, info->chargeMode == CHARGE_DEFAULT_AS_UNCHARGED,
+                    info->isotopeMode == ISOTOPE_DEFAULT_AS_STANDARD);
+            ready[part->extended] = true;
+        }
+
+        match = vf2state_match(&part->vf2state, &targets[part->extended], id, info->vf2_timeout);
+    }
+
+    if(unlikely(vf2Timeouted))
+        info->timeouted = true;
+
+    return match;
+}
+
+
+/*
+ * Matches one molecule against all query parts whose screen it has passed. The target is decoded only once for each
+ * variant of the molecule initialization the query parts need.
+ */
+static void lucene_subsearch_batch_match(BatchSearchData *info, int32_t id, uint8_t *molecule, int row)
+{
+    Molecule targets[3];
+    bool ready[3] = { false, false, false };
+    bool special = molecule_has_pseudo_atom(molecule) || molecule_has_multivalent_hydrogen(molecule);
+    int32_t lastQuery = 0;
+
+    info->matchCount = 0;
+    info->matchPosition = 0;
+    info->matchId = id;
+
+    PG_MEMCONTEXT_BEGIN(info->targetContext);
+
+    for(int i = info->chunkPartOffsets[row]; i < info->chunkPartOffsets[row + 1]; i++)
+    {
+        BatchQueryPart *part = &info->parts[info->chunkParts[i]];
+
+        /* a query of the conjunction without a match rejects the molecule, so the next ones are not needed */
+        if(info->conjunctive && part->query != lastQuery && lastQuery != 0 &&
+                (info->matchCount == 0 || info->matches[info->matchCount - 1] != lastQuery))
+            break;
+
+        lastQuery = part->query;
+
+        /* the query has already matched by another of its parts */
+        if(info->matchCount > 0 && info->matches[info->matchCount - 1] == part->query)
+            continue;
+
+        if(lucene_subsearch_batch_match_part(info, part, id, molecule, special, targets, ready))
+            info->matches[info->matchCount++] = part->query;
+    }
+
+    /* the excluded parts are matched only against the molecules that have matched all queries */
+    info->rejected = info->matchCount < info->termCount;
+
+    for(int i = 0; i < info->excludedCount && !info->rejected; i++)
+        if(lucene_subsearch_batch_match_part(info, &info->excluded[i], id, molecule, special, targets, ready))
+            info->rejected = true;
+
+    PG_MEMCONTEXT_END();
+    MemoryContextReset(info->targetContext);
+}
+
+
+static void lucene_subsearch_batch_init_part(BatchSearchData *info, BatchQueryPart *part, int32_t query,
+        SubstructureQueryData *data)
+{
+    part->query = query;
+    part->extended = molecule_is_extended_search_needed(data->molecule, info->chargeMode != CHARGE_IGNORE,
+            info->isotopeMode != ISOTOPE_IGNORE);
+    molecule_init(&part->molecule, data->molecule, data->restH, part->extended, info->chargeMode != CHARGE_IGNORE,
+            info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+    vf2state_init(&part->vf2state, &part->molecule, info->graphMode, info->chargeMode, info->isotopeMode,
+            info->stereoMode);
+
+    if(!part->extended)
+    {
+        molecule_init(&part->extendedMolecule, data->molecule, data->restH, true, info->chargeMode != CHARGE_IGNORE,
+                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+        vf2state_init(&part->extendedVf2state, &part->extendedMolecule, info->graphMode, info->chargeMode,
+                info->isotopeMode, info->stereoMode);
+    }
+
+    part->candidates = NULL;
+    part->candidateCount = 0;
+    part->candidatePosition = 0;
+}
+
+
+/*
+ * Parses and screens the queries; the data live in the current memory context. If the restriction is not NULL, only
+ * the candidates in it are kept.
+ */
+static void lucene_subsearch_batch_prepare(BatchSearchData *info, Datum *queries, bool *nulls, int queryCount,
+        int32_t type, GraphMode graphMode, ChargeMode chargeMode, IsotopeMode isotopeMode, StereoMode stereoMode,
+        TautomerMode tautomerMode, int32_t vf2_timeout, const BitSet *restriction)
+{
+    info->graphMode = graphMode;
+    info->chargeMode = chargeMode;
+    info->isotopeMode = isotopeMode;
+    info->stereoMode = stereoMode;
+    info->vf2_timeout = vf2_timeout;
+    info->restriction = restriction;
+
+    info->matches = (int32_t *) palloc((queryCount + 1) * sizeof(int32_t));
+    info->parts = NULL;
+    info->partCount = 0;
+    info->sampling = false;
+    info->timeouted = false;
+    info->conjunctive = false;
+    info->termCount = 0;
+    info->excluded = NULL;
+    info->excludedCount = 0;
+    info->rejected = false;
+
+    bitset_init_empty(&info->candidates, moleculeCount);
+    info->wordPosition = 0;
+
+    int capacity = 0;
+
+    for(int q = 0; q < queryCount; q++)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        if(nulls[q])
+            continue;
+
+        VarChar *query = DatumGetVarCharP(queries[q]);
+
+        SubstructureQueryData *queryData;
+        int queryDataCount = java_parse_substructure_query(&queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ,
+                type, graphMode == GRAPH_EXACT, tautomerMode == TAUTOMER_INCHI);
+
+        if(info->partCount + queryDataCount > capacity)
+        {
+            capacity = Max(2 * capacity, info->partCount + queryDataCount);
+
+            if(info->parts == NULL)
+                info->parts = (BatchQueryPart *) palloc(capacity * sizeof(BatchQueryPart));
+            else
+                info->parts = (BatchQueryPart *) repalloc(info->parts, capacity * sizeof(BatchQueryPart));
+        }
+
+        for(int d = 0; d < queryDataCount; d++)
+        {
+            BatchQueryPart *part = &info->parts[info->partCount++];
+            lucene_subsearch_batch_init_part(info, part, q + 1, &queryData[d]);
+
+            IntegerFingerprint fp = integer_substructure_fingerprint_get_query(&part->molecule);
+            lucene_subsearch_batch_screen(info, part, fp);
+
+            if(fp.data != NULL)
+                pfree(fp.data);
+        }
+    }
+
+    info->chunkIds = NULL;
+    info->matchCount = 0;
+    info->matchPosition = 0;
+    info->tableRowCount = 0;
+    info->tableRowPosition = 0;
+#if USE_MOLECULE_INDEX == 0
+    info->table = NULL;
+#endif
+
+    info->chunkContext = AllocSetContextCreate(CurrentMemoryContext,
+            "subsearch-lucene batch chunk context", ALLOCSET_DEFAULT_SIZES);
+    info->targetContext = AllocSetContextCreate(CurrentMemoryContext,
+            "subsearch-lucene batch target context", ALLOCSET_DEFAULT_SIZES);
+
+#if USE_MOLECULE_INDEX
+    info->arrayBuffer = (int32_t *) palloc(FETCH_SIZE * sizeof(int32_t));
+#else
+    info->arrayBuffer = (ArrayType *) palloc(FETCH_SIZE * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
+    info->arrayBuffer->ndim = 1;
+    info->arrayBuffer->dataoffset = 0;
+    info->arrayBuffer->elemtype = INT4OID;
+#endif
+}
+
+
+/*
+ * Loads and matches the next candidate molecule, the matching queries are stored in the matches of the data. Returns
+ * false if there is no candidate left.
+ */
+static bool lucene_subsearch_batch_next(BatchSearchData *info, MemoryContext context, bool *connected)
+{
+    if(unlikely(info->tableRowPosition == info->tableRowCount))
+    {
+#if USE_MOLECULE_INDEX == 0
+        if(info->table != NULL)
+        {
+            MemoryContextDelete(info->table->tuptabcxt);
+            info->table = NULL;
+        }
+#endif
+
+        size_t count = lucene_subsearch_batch_next_chunk(info);
+
+        if(unlikely(count == 0))
+            return false;
+
+#if USE_MOLECULE_INDEX == 0
+        *(ARR_DIMS(info->arrayBuffer)) = count;
+        SET_VARSIZE(info->arrayBuffer, count * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
+
+        Datum values[] = { PointerGetDatum(info->arrayBuffer)};
+
+
+        if(unlikely(!*connected && SPI_connect() != SPI_OK_CONNECT))
+             elog(ERROR, "%s: SPI_connect() failed", __func__);
+
+        *connected = true;
+
+
+        if(unlikely(SPI_execute_plan(mainQueryPlan, values, NULL, true, 0) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+        if(unlikely(SPI_processed != count || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+        info->table = SPI_tuptable;
+        MemoryContextSetParent(SPI_tuptable->tuptabcxt, context);
+#endif
+
+        info->tableRowCount = count;
+        info->tableRowPosition = 0;
+    }
+
+#if USE_MOLECULE_INDEX
+    int32_t id = info->chunkIds[info->tableRowPosition];
+    uint8_t *molecule = moleculeData + offsetData[id];
+#else
+    TupleDesc tupdesc = info->table->tupdesc;
+    HeapTuple tuple = info->table->vals[info->tableRowPosition];
+    char isNullFlag;
+
+    int32_t id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isNullFlag));
+
+    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+    Datum moleculeDatum = SPI_getbinval(tuple, tupdesc, 2, &isNullFlag);
+
+    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+    bytea *moleculeData;
+
+    PG_MEMCONTEXT_BEGIN(info->targetContext);
+    moleculeData = DatumGetByteaP(moleculeDatum);
+    PG_MEMCONTEXT_END();
+
+    uint8_t *molecule = (uint8_t *) VARDATA(moleculeData);
+#endif
+
+    info->tableRowPosition++;
+
+    /* the rows of the table are not ordered, so the position of the molecule in the chunk is looked up */
+    int32_t *position = bsearch(&id, info->chunkIds, info->tableRowCount, sizeof(int32_t),
+            lucene_subsearch_batch_compare_ids);
+
+    if(unlikely(position == NULL))
+        elog(ERROR, "%s: unexpected molecule id", __func__);
+
+    lucene_subsearch_batch_match(info, id, molecule, position - info->chunkIds);
+
+    return true;
+}
+
+
+PG_FUNCTION_INFO_V1(lucene_substructure_search_batch);
+Datum lucene_substructure_search_batch(PG_FUNCTION_ARGS)
+{
+    if(SRF_IS_FIRSTCALL())
+    {
+        if(lucene_search_has_null_argument(fcinfo, 8))
+        {
+            FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+            SRF_RETURN_DONE(funcctx);
+        }
+
+        lucene_subsearch_init();
+
+        ArrayType *queries = PG_GETARG_ARRAYTYPE_P(0);
+        int32_t type = PG_GETARG_INT32(1);
+        GraphMode graphMode = PG_GETARG_INT32(2);
+        ChargeMode chargeMode = PG_GETARG_INT32(3);
+        IsotopeMode isotopeMode = PG_GETARG_INT32(4);
+        StereoMode stereoMode = PG_GETARG_INT32(5);
+        TautomerMode tautomerMode = PG_GETARG_INT32(6);
+        int32_t vf2_timeout = PG_GETARG_INT32(7);
+
+        FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+
+        PG_MEMCONTEXT_BEGIN(funcctx->multi_call_memory_ctx);
+
+        TupleDesc desc = CreateTemplateTupleDesc(2, false);
+        TupleDescInitEntry(desc, (AttrNumber) 1, "query_idx", INT4OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 2, "compound", INT4OID, -1, 0);
+        funcctx->tuple_desc = BlessTupleDesc(desc);
+
+        BatchSearchData *info = (BatchSearchData *) palloc(sizeof(BatchSearchData));
+        funcctx->user_fctx = info;
+
+        Datum *elements;
+        bool *nulls;
+        int queryCount;
+
+        deconstruct_array(queries, VARCHAROID, -1, false, 'i', &elements, &nulls, &queryCount);
+
+        lucene_subsearch_batch_prepare(info, elements, nulls, queryCount, type, graphMode, chargeMode, isotopeMode,
+                stereoMode, tautomerMode, vf2_timeout, lucene_search_get_restriction(fcinfo, 8));
+
+        PG_FREE_IF_COPY(queries, 0);
+
+        PG_MEMCONTEXT_END();
+    }
+
+
+    bool connected = false;
+
+    FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+    BatchSearchData *info = funcctx->user_fctx;
+
+    while(info->matchPosition == info->matchCount)
+        if(!lucene_subsearch_batch_next(info, funcctx->multi_call_memory_ctx, &connected))
+            break;
+
+    if(connected)
+        SPI_finish();
+
+    if(unlikely(info->matchPosition == info->matchCount))
+        SRF_RETURN_DONE(funcctx);
+
+    char isnull[2] = {0, 0};
+    Datum values[2] = {Int32GetDatum(info->matches[info->matchPosition++]), Int32GetDatum(info->matchId)};
+    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, isnull);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+}
+
+
+PG_FUNCTION_INFO_V1(lucene_substructure_count);
+Datum lucene_substructure_count(PG_FUNCTION_ARGS)
+{
+    if(lucene_search_has_null_argument(fcinfo, 8))
+        PG_RETURN_NULL();
+
+    lucene_subsearch_init();
+
+    VarChar *query = PG_GETARG_VARCHAR_P(0);
+    int32_t type = PG_GETARG_INT32(1);
+    GraphMode graphMode = PG_GETARG_INT32(2);
+    ChargeMode chargeMode = PG_GETARG_INT32(3);
+    IsotopeMode isotopeMode = PG_GETARG_INT32(4);
+    StereoMode stereoMode = PG_GETARG_INT32(5);
+    TautomerMode tautomerMode = PG_GETARG_INT32(6);
+    int32_t vf2_timeout = PG_GETARG_INT32(7);
+    BitSet *restriction = lucene_search_get_restriction(fcinfo, 8);
+
+    int64_t count = 0;
+    int32_t id;
+
+
+    /* the count shares the cached results with the unlimited substructure search */
+    int32_t options[] = { type, 0, graphMode, chargeMode, isotopeMode, stereoMode, tautomerMode };
+    ResultCacheKey key = result_cache_key(CACHE_NAME, options, sizeof(options) / sizeof(int32_t), VARDATA(query),
+            VARSIZE(query) - VARHDRSZ);
+    ResultCacheReader reader;
+
+    if(restriction == NULL && result_cache_lookup(&key, indexId, &reader))
+    {
+        while(result_cache_read_id(&reader, &id))
+            count++;
+
+        PG_RETURN_INT64(count);
+    }
+
+
+    MemoryContext context = CurrentMemoryContext;
+    Datum queries[] = { PointerGetDatum(query) };
+    bool nulls[] = { false };
+
+    BatchSearchData info;
+    lucene_subsearch_batch_prepare(&info, queries, nulls, 1, type, graphMode, chargeMode, isotopeMode, stereoMode,
+            tautomerMode, vf2_timeout, restriction);
+
+    ResultCacheWriter writer;
+    result_cache_writer_init(&writer);
+
+    if(restriction != NULL)
+        result_cache_writer_invalidate(&writer);
+
+    bool connected = false;
+
+    while(lucene_subsearch_batch_next(&info, context, &connected))
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        if(info.matchCount > 0)
+        {
+            result_cache_write_id(&writer, info.matchId);
+            count++;
+        }
+    }
+
+    if(connected)
+        SPI_finish();
+
+    if(info.timeouted)
+        result_cache_writer_invalidate(&writer);
+
+    result_cache_store(&key, indexId, &writer);
+
+    PG_FREE_IF_COPY(query, 0);
+
+    PG_RETURN_INT64(count);
+}
+
+
+/*
+ * Estimates the number of hits from the candidates of the index and a uniform sample of them verified within the time
+ * budget. The sample is drawn in rounds of a fixed size and only complete rounds are taken into account; the interval
+ * is the Wilson score interval with the finite population correction.
+ */
+PG_FUNCTION_INFO_V1(lucene_substructure_estimate);
+Datum lucene_substructure_estimate(PG_FUNCTION_ARGS)
+{
+    if(lucene_search_has_null_argument(fcinfo, 9))
+        PG_RETURN_NULL();
+
+    lucene_subsearch_init();
+
+    VarChar *query = PG_GETARG_VARCHAR_P(0);
+    int32_t type = PG_GETARG_INT32(1);
+    GraphMode graphMode = PG_GETARG_INT32(2);
+    ChargeMode chargeMode = PG_GETARG_INT32(3);
+    IsotopeMode isotopeMode = PG_GETARG_INT32(4);
+    StereoMode stereoMode = PG_GETARG_INT32(5);
+    TautomerMode tautomerMode = PG_GETARG_INT32(6);
+    int32_t vf2_timeout = PG_GETARG_INT32(7);
+    int32_t budget = PG_GETARG_INT32(8);
+    BitSet *restriction = lucene_search_get_restriction(fcinfo, 9);
+
+    struct timeval begin = time_get();
+
+    TupleDesc tupdesc;
+
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "%s: get_call_result_type() failed", __func__);
+
+    tupdesc = BlessTupleDesc(tupdesc);
+
+
+    MemoryContext context = CurrentMemoryContext;
+    Datum queries[] = { PointerGetDatum(query) };
+    bool nulls[] = { false };
+
+    BatchSearchData info;
+    lucene_subsearch_batch_prepare(&info, queries, nulls, 1, type, graphMode, chargeMode, isotopeMode, stereoMode,
+            tautomerMode, vf2_timeout, restriction);
+
+
+    /* take the candidates out of the bitset and shuffle them */
+    size_t candidateCount = 0;
+
+    for(int i = 0; i < info.candidates.length; i++)
+        candidateCount += __builtin_popcountll(info.candidates.words[i]);
+
+    int32_t *candidates = (int32_t *) palloc((candidateCount + 1) * sizeof(int32_t));
+    size_t position = 0;
+
+    for(int i = 0; i < info.candidates.length; i++)
+    {
+        uint64_t word = info.candidates.words[i];
+
+        while(word != 0)
+        {
+            candidates[position++] = i * BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+
+        info.candidates.words[i] = 0;
+    }
+
+    for(size_t i = candidateCount; i > 1; i--)
+    {
+        size_t j = random() % i;
+        int32_t swap = candidates[i - 1];
+        candidates[i - 1] = candidates[j];
+        candidates[j] = swap;
+    }
+
+
+    info.sampling = true;
+
+    int64_t sampled = 0;
+    int64_t matched = 0;
+    bool connected = false;
+    bool expired = false;
+
+    while(sampled < candidateCount && !expired)
+    {
+        size_t round = Min(ESTIMATE_ROUND_SIZE, candidateCount - sampled);
+        int64_t roundMatched = 0;
+
+        for(size_t i = 0; i < round; i++)
+            bitset_set(&info.candidates, candidates[sampled + i]);
+
+        info.wordPosition = 0;
+
+        while(lucene_subsearch_batch_next(&info, context, &connected))
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            if(info.matchCount > 0)
+                roundMatched++;
+
+            /* the first round is always completed, so there is something to estimate from */
+            if(sampled > 0 && time_spent(begin, time_get()) > (int64_t) budget * 1000)
+            {
+                expired = true;
+                break;
+            }
+        }
+
+        if(expired)
+            break;
+
+        sampled += round;
+        matched += roundMatched;
+    }
+
+    if(connected)
+        SPI_finish();
+
+
+    double estimate = 0.0;
+    double lower = 0.0;
+    double upper = 0.0;
+
+    if(sampled == candidateCount)
+    {
+        estimate = lower = upper = matched;
+    }
+    else
+    {
+        double n = sampled;
+        double p = matched / n;
+        double z = ESTIMATE_Z_SCORE;
+        double fpc = sqrt((candidateCount - n) / (candidateCount - 1.0));
+        double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+        double half = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / (1 + z * z / n) * fpc;
+
+        estimate = p * candidateCount;
+        lower = Max(Max(center - half, 0.0) * candidateCount, matched);
+        upper = Min(Min(center + half, 1.0) * candidateCount, candidateCount - (sampled - matched));
+    }
+
+    PG_FREE_IF_COPY(query, 0);
+
+
+    char isnull[5] = {0, 0, 0, 0, 0};
+    Datum values[5] = { Int64GetDatum(candidateCount), Int64GetDatum(sampled), Float8GetDatum(estimate),
+            Float8GetDatum(lower), Float8GetDatum(upper) };
+
+    HeapTuple tuple = heap_form_tuple(tupdesc, values, isnull);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+
+/*
+ * Keeps only the candidates that have passed the screens of all queries. The parts of one query are adjacent, and
+ * the molecule passes the screen of the query if it passes the screen of any of its parts.
+ */
+static void lucene_subsearch_query_intersect(BatchSearchData *info)
+{
+    BitSet screen;
+    bitset_init_empty(&screen, moleculeCount);
+
+    int screened = 0;
+
+    for(int p = 0; p < info->partCount; screened++)
+    {
+        int32_t query = info->parts[p].query;
+
+        for(; p < info->partCount && info->parts[p].query == query; p++)
+            for(size_t c = 0; c < info->parts[p].candidateCount; c++)
+                bitset_set(&screen, info->parts[p].candidates[c]);
+
+        for(int i = 0; i < info->candidates.length; i++)
+        {
+            info->candidates.words[i] &= screen.words[i];
+            screen.words[i] = 0;
+        }
+    }
+
+    /* a query without any part cannot match */
+    if(screened < info->termCount)
+        memset(info->candidates.words, 0, info->candidates.length * sizeof(uint64_t));
+
+    pfree(screen.words);
+
+
+    for(int p = 0; p < info->partCount; p++)
+    {
+        BatchQueryPart *part = &info->parts[p];
+        size_t count = 0;
+
+        for(size_t c = 0; c < part->candidateCount; c++)
+            if(bitset_get(&info->candidates, part->candidates[c]))
+                part->candidates[count++] = part->candidates[c];
+
+        part->candidateCount = count;
+    }
+}
+
+
+/*
+ * Prepares the evaluation of a query expression, i.e. of the conjunction of the positive queries and the negations of
+ * the negated ones. The queries are passed as separate array elements, so no query text (CXSMILES extensions, molfile
+ * headers) is interpreted by the expression. The candidates are the intersection of the screens of the positive
+ * queries; the negated queries are not screened at all, they are matched only against the molecules that have matched
+ * all positive queries.
+ */
+static void lucene_subsearch_query_prepare(BatchSearchData *info, ArrayType *positive, ArrayType *negated,
+        int32_t type, GraphMode graphMode, ChargeMode chargeMode, IsotopeMode isotopeMode, StereoMode stereoMode,
+        TautomerMode tautomerMode, int32_t vf2_timeout, const BitSet *restriction)
+{
+    Datum *included;
+    Datum *excluded;
+    bool *includedNulls;
+    bool *excludedNulls;
+    int includedCount;
+    int excludedCount;
+
+    deconstruct_array(positive, VARCHAROID, -1, false, 'i', &included, &includedNulls, &includedCount);
+    deconstruct_array(negated, VARCHAROID, -1, false, 'i', &excluded, &excludedNulls, &excludedCount);
+
+    for(int q = 0; q < includedCount; q++)
+        if(includedNulls[q])
+            elog(ERROR, "%s: null positive query in the expression", __func__);
+
+    for(int q = 0; q < excludedCount; q++)
+        if(excludedNulls[q])
+            elog(ERROR, "%s: null negated query in the expression", __func__);
+
+
+    lucene_subsearch_batch_prepare(info, included, includedNulls, includedCount, type, graphMode, chargeMode,
+            isotopeMode, stereoMode, tautomerMode, vf2_timeout, restriction);
+
+    info->conjunctive = true;
+    info->termCount = includedCount;
+
+    if(includedCount > 0)
+    {
+        lucene_subsearch_query_intersect(info);
+    }
+    else
+    {
+        /* without a positive query, all molecules of the index are the candidates */
+        BatchQueryPart all;
+        lucene_subsearch_batch_screen(info, &all, (IntegerFingerprint) { .size = 0, .data = NULL });
+        pfree(all.candidates);
+    }
+
+
+    int capacity = 0;
+
+    for(int q = 0; q < excludedCount; q++)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        VarChar *query = DatumGetVarCharP(excluded[q]);
+
+        SubstructureQueryData *queryData;
+        int queryDataCount = java_parse_substructure_query(&queryData, VARDATA(query), VARSIZE(query) - VARHDRSZ,
+                type, graphMode == GRAPH_EXACT, tautomerMode == TAUTOMER_INCHI);
+
+        if(info->excludedCount + queryDataCount > capacity)
+        {
+            capacity = Max(2 * capacity, info->excludedCount + queryDataCount);
+
+            if(info->excluded == NULL)
+                info->excluded = (BatchQueryPart *) palloc(capacity * sizeof(BatchQueryPart));
+            else
+                info->excluded = (BatchQueryPart *) repalloc(info->excluded, capacity * sizeof(BatchQueryPart));
+        }
+
+        for(int d = 0; d < queryDataCount; d++)
+            lucene_subsearch_batch_init_part(info, &info->excluded[info->excludedCount++], -(q + 1), &queryData[d]);
+    }
+}
+
+
+PG_FUNCTION_INFO_V1(lucene_structure_query);
+Datum lucene_structure_query(PG_FUNCTION_ARGS)
+{
+    if(SRF_IS_FIRSTCALL())
+    {
+        if(lucene_search_has_null_argument(fcinfo, 9))
+        {
+            FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+            SRF_RETURN_DONE(funcctx);
+        }
+
+        lucene_subsearch_init();
+
+        ArrayType *positive = PG_GETARG_ARRAYTYPE_P(0);
+        ArrayType *negated = PG_GETARG_ARRAYTYPE_P(1);
+        int32_t type = PG_GETARG_INT32(2);
+        GraphMode graphMode = PG_GETARG_INT32(3);
+        ChargeMode chargeMode = PG_GETARG_INT32(4);
+        IsotopeMode isotopeMode = PG_GETARG_INT32(5);
+        StereoMode stereoMode = PG_GETARG_INT32(6);
+        TautomerMode tautomerMode = PG_GETARG_INT32(7);
+        int32_t vf2_timeout = PG_GETARG_INT32(8);
+
+        FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+
+        PG_MEMCONTEXT_BEGIN(funcctx->multi_call_memory_ctx);
+
+        BatchSearchData *info = (BatchSearchData *) palloc(sizeof(BatchSearchData));
+        funcctx->user_fctx = info;
+
+        lucene_subsearch_query_prepare(info, positive, negated, type, graphMode, chargeMode, isotopeMode, stereoMode,
+                tautomerMode, vf2_timeout, lucene_search_get_restriction(fcinfo, 9));
+
+        PG_FREE_IF_COPY(positive, 0);
+        PG_FREE_IF_COPY(negated, 1);
+
+        PG_MEMCONTEXT_END();
+    }
+
+
+    bool connected = false;
+    bool found = false;
+
+    FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+    BatchSearchData *info = funcctx->user_fctx;
+
+    while(!found && lucene_subsearch_batch_next(info, funcctx->multi_call_memory_ctx, &connected))
+        found = !info->rejected;
+
+    if(connected)
+        SPI_finish();
+
+    if(unlikely(!found))
+        SRF_RETURN_DONE(funcctx);
+
+    SRF_RETURN_NEXT(funcctx, Int32GetDatum(info->matchId));
+}
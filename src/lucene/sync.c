@@ -11,9 +11,12 @@
 #include "common.h"
 #include "molecule.h"
 #include "molindex.h"
+#include "countindex.h"
 #include "sachem.h"
 #include "indexer.h"
 #include "fporder.h"
+#include "syncpool.h"
+#include "resultcache.h"
 #include "java/parse.h"
 #include "fingerprints/fingerprint.h"
 
@@ -21,18 +24,7 @@
 #define SYNC_FETCH_SIZE         100000
 #define SUBOPTIMIZE_PROCESSES   4
 #define HEADER_KEY              0
-#define ID_TABLE_KEY            1
-#define IDEX_KEY_OFFSET         2
-#define MOLECULE_KEY_OFFSET     10000
-
-
-typedef struct
-{
-    slock_t mutex;
-    int attachedWorkers;
-    int moleculeCount;
-    int moleculePosition;
-} IndexWorkerHeader;
+#define IDEX_KEY_OFFSET         1
 
 
 typedef struct
@@ -48,59 +40,67 @@ static bool luceneSyncInitialised = false;
 static LuceneIndexer lucene;
 
 
-void lucene_index_worker(dsm_segment *seg, shm_toc *toc)
+static void lucene_index_molecules(SyncPoolWorker *worker, char *indexPath)
 {
-    volatile IndexWorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
-    SpinLockAcquire(&header->mutex);
-    int workerNumber = header->attachedWorkers++;
-    SpinLockRelease(&header->mutex);
-
-    int *ids = shm_toc_lookup_key(toc, ID_TABLE_KEY);
-    char *indexPath = shm_toc_lookup_key(toc, IDEX_KEY_OFFSET + workerNumber);
+    LuceneIndexer indexer;
 
-    lucene_indexer_init(&lucene);
-    lucene_indexer_begin(&lucene, indexPath);
+    lucene_indexer_init(&indexer);
+    lucene_indexer_begin(&indexer, indexPath, NULL);
 
     PG_TRY();
     {
-        while(true)
+        int32_t id;
+        uint8_t *data;
+
+        while(sync_pool_next(worker, &id, &data))
         {
             CHECK_FOR_INTERRUPTS();
 
-            SpinLockAcquire(&header->mutex);
-            int position = header->moleculePosition++;
-            SpinLockRelease(&header->mutex);
-
-            if(position >= header->moleculeCount)
-                break;
-
-            uint8_t *data = shm_toc_lookup_key(toc, MOLECULE_KEY_OFFSET + position);
-
             Molecule molecule;
             molecule_simple_init(&molecule, data);
+            sync_pool_count(worker, &molecule);
 
             IntegerFingerprint subfp = integer_substructure_fingerprint_get(&molecule);
             IntegerFingerprint simfp = integer_similarity_fingerprint_get(&molecule);
-            lucene_indexer_add(&lucene, ids[position], subfp, simfp);
+            lucene_indexer_add(&indexer, id, subfp, simfp);
 
             integer_fingerprint_free(subfp);
             integer_fingerprint_free(simfp);
             molecule_simple_free(&molecule);
         }
 
-        lucene_indexer_commit(&lucene);
+        lucene_indexer_commit(&indexer);
+    }
+    PG_CATCH();
+    {
+        lucene_indexer_rollback(&indexer);
+        lucene_indexer_terminate(&indexer);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    lucene_indexer_terminate(&indexer);
+}
+
+
+void lucene_index_worker(dsm_segment *seg, shm_toc *toc)
+{
+    SyncPoolWorker worker;
+    char *indexPath = sync_pool_attach(&worker, seg, toc);
+
+    PG_TRY();
+    {
+        lucene_index_molecules(&worker, indexPath);
     }
     PG_CATCH();
     {
-        lucene_indexer_rollback(&lucene);
-        lucene_indexer_terminate(&lucene);
         java_terminate();
 
         PG_RE_THROW();
     }
     PG_END_TRY();
 
-    lucene_indexer_terminate(&lucene);
     java_terminate();
 }
 
@@ -123,7 +123,7 @@ void lucene_optimize_worker(dsm_segment *seg, shm_toc *toc)
             break;
 
         char *indexPath = shm_toc_lookup_key(toc, IDEX_KEY_OFFSET + position);
-        lucene_indexer_begin(&lucene, indexPath);
+        lucene_indexer_begin(&lucene, indexPath, NULL);
 
         PG_TRY();
         {
@@ -158,6 +158,7 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
 
     bool verbose = PG_GETARG_BOOL(0);
     bool optimize = PG_GETARG_BOOL(1);
+    char *options = text_to_cstring(PG_GETARG_VARCHAR_P(2));
 
     create_base_directory();
 
@@ -179,6 +180,9 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
     /* clone old index */
     int indexNumber = 0;
     char *oldIndexPath = NULL;
+    int previousNumber = -1;
+    Stats *counts = NULL;
+    size_t orderLimit = ORDER_DEFAULT_LIMIT;
 
     if(unlikely(SPI_exec("select id from " INDEX_TABLE, 0) != SPI_OK_SELECT))
         elog(ERROR, "%s: SPI_exec() failed", __func__);
@@ -194,10 +198,22 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
             elog(ERROR, "%s: SPI_getbinval() failed", __func__);
 
         indexNumber = number + 1;
+        previousNumber = number;
         oldIndexPath = get_index_path(LUCENE_INDEX_PREFIX, LUCENE_INDEX_SUFFIX, number);
     }
 
 
+    /* a change of the index type cannot be applied to the old index, so the index is built from scratch */
+    bool rebuild = oldIndexPath != NULL && lucene_indexer_requires_rebuild(oldIndexPath, options);
+
+    if(rebuild)
+    {
+        elog(NOTICE, "the index type has changed, the whole index is rebuilt");
+
+        oldIndexPath = NULL;
+    }
+
+
     int countOfProcessors = sysconf(_SC_NPROCESSORS_ONLN);
 
     char *indexPath = get_index_path(LUCENE_INDEX_PREFIX, LUCENE_INDEX_SUFFIX, indexNumber);
@@ -217,16 +233,47 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
         elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
 
 
-    lucene_indexer_begin(&lucene, indexPath);
+    lucene_indexer_begin(&lucene, indexPath, options);
     int subindexCount = 0;
 
 
     PG_TRY();
     {
+        /* the counts of a rebuilt index are collected from scratch */
+        if(oldIndexPath == NULL)
+            counts = stats_create(0);
+        else if((counts = fporder_counts_load(previousNumber, &orderLimit)) == NULL)
+            elog(NOTICE, "fingerprint counts are not available, run sachem_generate_fporder to enable their maintenance");
+
+
+        /* the subindexes are created in advance, so that the workers use the settings of the index */
+        char *settings = lucene_indexer_get_settings(&lucene);
+
+        LuceneIndexer subindexer;
+        lucene_indexer_init(&subindexer);
+
+        for(int p = 0; p < countOfProcessors; p++)
+        {
+            lucene_indexer_begin(&subindexer, subindexPath[p], settings);
+            lucene_indexer_commit(&subindexer);
+        }
+
+        lucene_indexer_terminate(&subindexer);
+
+
         /*
          * delete unnecessary data
          */
 
+        if(rebuild)
+        {
+            if(unlikely(SPI_exec("delete from " MOLECULES_TABLE, 0) != SPI_OK_DELETE))
+                elog(ERROR, "%s: SPI_exec() failed", __func__);
+
+            if(unlikely(SPI_exec("delete from " MOLECULE_ERRORS_TABLE, 0) != SPI_OK_DELETE))
+                elog(ERROR, "%s: SPI_exec() failed", __func__);
+        }
+
         Portal auditCursor = SPI_cursor_open_with_args(NULL, "select id from " AUDIT_TABLE " where not stored",
                 0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
 
@@ -256,6 +303,13 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
         SPI_cursor_close(auditCursor);
 
 
+        /* the workers index the new molecules and maintain the fingerprint counts */
+        SyncPool pool;
+        sync_pool_begin(&pool, "lucene_index_worker", lucene_index_molecules, subindexPath, countOfProcessors, counts);
+
+        if(!rebuild)
+            sync_pool_subtract_deleted(&pool);
+
         if(unlikely(SPI_exec("delete from " MOLECULES_TABLE " tbl using "
                 AUDIT_TABLE " aud where tbl.id = aud.id", 0) != SPI_OK_DELETE))
             elog(ERROR, "%s: SPI_exec() failed", __func__);
@@ -281,12 +335,9 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
             elog(ERROR, "%s: cannot determine bigint[] oid", __func__);
 
 
-        SPIPlanPtr moleculesPlan = SPI_prepare("insert into " MOLECULES_TABLE " (id, molecule) values ($1,$2)",
-                2, (Oid[]) { INT4OID, BYTEAOID });
-
-
-        Portal compoundCursor = SPI_cursor_open_with_args(NULL, "select cmp.id, cmp.molfile from " COMPOUNDS_TABLE " cmp, "
-                AUDIT_TABLE " aud where cmp.id = aud.id and aud.stored",
+        Portal compoundCursor = SPI_cursor_open_with_args(NULL, rebuild ?
+                "select cmp.id, cmp.molfile from " COMPOUNDS_TABLE " cmp" :
+                "select cmp.id, cmp.molfile from " COMPOUNDS_TABLE " cmp, " AUDIT_TABLE " aud where cmp.id = aud.id and aud.stored",
                 0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
 
 
@@ -333,66 +384,6 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
             java_parse_data(processed, molfiles, data);
 
 
-            EnterParallelMode();
-
-            ParallelContext *pcxt = CreateParallelContextForExternalFunction("libsachem", "lucene_index_worker", countOfProcessors);
-
-            shm_toc_estimate_keys(&pcxt->estimator, 2 + countOfProcessors + processed);
-            shm_toc_estimate_chunk(&pcxt->estimator, sizeof(IndexWorkerHeader));
-            shm_toc_estimate_chunk(&pcxt->estimator, processed * sizeof(int));
-
-            for(int i = 0; i < countOfProcessors; i++)
-                shm_toc_estimate_chunk(&pcxt->estimator, strlen(subindexPath[i]) + 1);
-
-            for(int i = 0; i < processed; i++)
-                if(data[i].molecule != NULL)
-                    shm_toc_estimate_chunk(&pcxt->estimator, VARSIZE(data[i].molecule) - VARHDRSZ);
-
-            InitializeParallelDSM(pcxt);
-
-            int *idValues = shm_toc_allocate(pcxt->toc, processed * sizeof(int));
-            shm_toc_insert(pcxt->toc, ID_TABLE_KEY, idValues);
-
-            for(int i = 0; i < countOfProcessors; i++)
-            {
-                void *path = shm_toc_allocate(pcxt->toc, strlen(subindexPath[i]) + 1);
-                strcpy(path, subindexPath[i]);
-                shm_toc_insert(pcxt->toc, IDEX_KEY_OFFSET + i, path);
-            }
-
-
-            int valid = 0;
-
-            for(int i = 0; i < processed; i++)
-            {
-                if(likely(data[i].molecule != NULL))
-                {
-                    void *molecule = shm_toc_allocate(pcxt->toc, VARSIZE(data[i].molecule) - VARHDRSZ);
-                    memcpy(molecule, VARDATA(data[i].molecule), VARSIZE(data[i].molecule) - VARHDRSZ);
-                    shm_toc_insert(pcxt->toc, MOLECULE_KEY_OFFSET + valid, molecule);
-
-                    idValues[valid] = DatumGetInt32(ids[i]);
-                    valid++;
-                }
-            }
-
-            IndexWorkerHeader *header = shm_toc_allocate(pcxt->toc, sizeof(IndexWorkerHeader));
-            SpinLockInit(&header->mutex);
-            header->attachedWorkers = 0;
-            header->moleculePosition = 0;
-            header->moleculeCount = valid;
-            shm_toc_insert(pcxt->toc, HEADER_KEY, header);
-
-            LaunchParallelWorkers(pcxt);
-
-            if(subindexCount < pcxt->nworkers_launched)
-                subindexCount = pcxt->nworkers_launched;
-
-            WaitForParallelWorkersToFinish(pcxt);
-            DestroyParallelContext(pcxt);
-            ExitParallelMode();
-
-
             for(int i = 0; i < processed; i++)
             {
                 HeapTuple tuple = tuptable->vals[i];
@@ -400,37 +391,18 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
                 if((char *) molfiles[i] != DatumGetPointer(SPI_getbinval(tuple, tuptable->tupdesc, 2, &isNullFlag)))
                     pfree(molfiles[i]);
 
+                sync_pool_add(&pool, ids[i], &data[i]);
 
-                if(data[i].error)
-                {
-                    if(data[i].error == NULL)
-                        data[i].error = cstring_to_text("fingerprint cannot be generated");
-
-                    char *message = text_to_cstring(data[i].error);
-                    elog(NOTICE, "%i: %s", DatumGetInt32(ids[i]), message);
-                    pfree(message);
-
-                    Datum values[] = {ids[i], PointerGetDatum(data[i].error)};
-
-                    if(SPI_execute_with_args("insert into " MOLECULE_ERRORS_TABLE " (compound, message) values ($1,$2)",
-                            2, (Oid[]) { INT4OID, TEXTOID }, values, NULL, false, 0) != SPI_OK_INSERT)
-                        elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
-
+                if(data[i].error != NULL)
                     pfree(data[i].error);
-                }
 
-                if(data[i].molecule == NULL)
-                    continue;
-
-
-                Datum moleculesValues[] = {ids[i], PointerGetDatum(data[i].molecule)};
-
-                if(SPI_execute_plan(moleculesPlan, moleculesValues, NULL, false, 0) != SPI_OK_INSERT)
-                    elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
-
-                pfree(data[i].molecule);
+                if(data[i].molecule != NULL)
+                    pfree(data[i].molecule);
             }
 
+            /* the workers index this batch while the next one is being parsed */
+            sync_pool_flush(&pool);
+
 
             SPI_freetuptable(tuptable);
 
@@ -442,8 +414,7 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
 
         SPI_cursor_close(compoundCursor);
 
-        if(unlikely(SPI_exec("delete from " AUDIT_TABLE, 0) != SPI_OK_DELETE))
-            elog(ERROR, "%s: SPI_exec() failed", __func__);
+        subindexCount = sync_pool_end(&pool);
 
 
         if(optimize)
@@ -480,9 +451,11 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
             ExitParallelMode();
         }
 
-        for(int p = 0; p < subindexCount; p++)
+        for(int p = 0; p < countOfProcessors; p++)
         {
-            lucene_indexer_add_index(&lucene, subindexPath[p]);
+            if(p < subindexCount)
+                lucene_indexer_add_index(&lucene, subindexPath[p]);
+
             lucene_indexer_delete_directory(subindexPath[p]);
         }
 
@@ -491,6 +464,15 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
 
         lucene_indexer_commit(&lucene);
 
+        /* the count index of the previous version is updated by the changes recorded in the audit table */
+        sachem_generate_count_index(indexNumber, oldIndexPath != NULL ? previousNumber : -1);
+
+        if(unlikely(SPI_exec("delete from " AUDIT_TABLE, 0) != SPI_OK_DELETE))
+            elog(ERROR, "%s: SPI_exec() failed", __func__);
+
+        if(counts != NULL)
+            fporder_counts_publish(counts, indexNumber, orderLimit);
+
 #if USE_MOLECULE_INDEX
         sachem_generate_molecule_index(indexNumber, false);
 #endif
@@ -499,10 +481,19 @@ Datum lucene_sync_data(PG_FUNCTION_ARGS)
     {
         lucene_indexer_rollback(&lucene);
 
+        if(counts != NULL)
+            stats_delete(counts);
+
         PG_RE_THROW();
     }
     PG_END_TRY();
 
+    if(counts != NULL)
+        stats_delete(counts);
+
+    /* the cached results are keyed by the index number as well, this only releases their memory early */
+    result_cache_reset();
+
 
     SPI_finish();
     PG_RETURN_VOID();
@@ -536,6 +527,8 @@ Datum lucene_cleanup(PG_FUNCTION_ARGS)
 
 
     char *luceneIndexName = get_index_name(LUCENE_INDEX_PREFIX, LUCENE_INDEX_SUFFIX, indexNumber);
+    char *countIndexName = get_index_name(COUNT_INDEX_PREFIX, COUNT_INDEX_SUFFIX, indexNumber);
+    char *countsFileName = get_index_name(COUNTS_INDEX_PREFIX, COUNTS_INDEX_SUFFIX, indexNumber);
 #if USE_MOLECULE_INDEX
     char *moleculeIndexName = get_index_name(MOLECULE_INDEX_PREFIX, MOLECULE_INDEX_SUFFIX, indexNumber);
 #endif
@@ -571,6 +564,16 @@ Datum lucene_cleanup(PG_FUNCTION_ARGS)
                 char *luceneIndexPath = get_file_path(ep->d_name);
                 lucene_indexer_delete_directory(luceneIndexPath);
             }
+            else if(!strncmp(ep->d_name, COUNT_INDEX_PREFIX, sizeof(COUNT_INDEX_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, countIndexName))
+                    continue;
+
+                elog(NOTICE, "delete count index '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
 #if USE_MOLECULE_INDEX
             else if(!strncmp(ep->d_name, MOLECULE_INDEX_PREFIX, sizeof(MOLECULE_INDEX_PREFIX) - 1))
             {
@@ -583,6 +586,16 @@ Datum lucene_cleanup(PG_FUNCTION_ARGS)
                     elog(ERROR, "%s: unlinkat() failed", __func__);
             }
 #endif
+            else if(!strncmp(ep->d_name, COUNTS_INDEX_PREFIX, sizeof(COUNTS_INDEX_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, countsFileName))
+                    continue;
+
+                elog(NOTICE, "delete fingerprint counts '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
             else if(strcmp(ep->d_name, ".") && strcmp(ep->d_name, "..") && strcmp(ep->d_name, ORDER_FILE))
             {
                 elog(WARNING, "unknown content '%s'", ep->d_name);
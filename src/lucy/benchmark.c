@@ -0,0 +1,478 @@
+#include <postgres.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "bitset.h"
+#include "common.h"
+#include "fpindex.h"
+#include "postindex.h"
+#include "molecule.h"
+#include "sachem.h"
+#include "lucy.h"
+#include "measurement.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define BENCHMARK_FETCH_SIZE    100000
+#define BENCHMARK_SCREENS       3
+#define BENCHMARK_LUCY          0
+#define BENCHMARK_FINGERPRINTS  1
+#define BENCHMARK_POSTINGS      2
+
+
+typedef struct
+{
+    int64_t indexSize;
+    double buildTime;
+    double screenTime;
+    int64_t candidates;
+} BenchmarkResult;
+
+
+typedef struct
+{
+    StringFingerprint *stringFps;
+    IntegerFingerprint *foldedFps;
+    IntegerFingerprint *integerFps;
+    int count;
+} BenchmarkQueries;
+
+
+static const char *screenNames[BENCHMARK_SCREENS] = { "LUCY", "FINGERPRINTS", "POSTINGS" };
+
+static bool lucyInitialised = false;
+static Lucy lucy;
+
+
+static int64_t lucy_benchmark_file_size(const char *path)
+{
+    struct stat st;
+
+    if(lstat(path, &st) != 0)
+        elog(ERROR, "%s: lstat() failed", __func__);
+
+    if(!S_ISDIR(st.st_mode))
+        return S_ISREG(st.st_mode) ? st.st_size : 0;
+
+
+    int64_t size = 0;
+    DIR *dp = opendir(path);
+
+    if(dp == NULL)
+        elog(ERROR, "%s: opendir() failed", __func__);
+
+    struct dirent *ep;
+
+    while((ep = readdir(dp)))
+    {
+        if(!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+            continue;
+
+        char *file = psprintf("%s/%s", path, ep->d_name);
+        size += lucy_benchmark_file_size(file);
+        pfree(file);
+    }
+
+    closedir(dp);
+
+    return size;
+}
+
+
+static void lucy_benchmark_delete(const char *path)
+{
+    struct stat st;
+
+    if(stat(path, &st) == 0)
+        lucy_delete_directory(path);
+}
+
+
+/*
+ * Like the builds of the alternative indexes, the time includes reading the molecules and their fingerprinting.
+ */
+static double lucy_benchmark_build(const char *path)
+{
+    char isNullFlag;
+    struct timeval begin = time_get();
+
+    lucy_set_folder(&lucy, path);
+    lucy_begin(&lucy);
+
+    PG_TRY();
+    {
+        Portal moleculeCursor = SPI_cursor_open_with_args(NULL, "select id, molecule from " MOLECULES_TABLE,
+                0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+        while(true)
+        {
+            SPI_cursor_fetch(moleculeCursor, true, BENCHMARK_FETCH_SIZE);
+
+            if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+                elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+            if(SPI_processed == 0)
+                break;
+
+            for(size_t i = 0; i < SPI_processed; i++)
+            {
+                CHECK_FOR_INTERRUPTS();
+
+                int32_t id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                Datum mol = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+                if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                    elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                bytea *data = DatumGetByteaP(mol);
+
+                Molecule molecule;
+                molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
+
+                StringFingerprint fp = string_substructure_fingerprint_get(&molecule);
+                lucy_add(&lucy, id, fp);
+
+                string_fingerprint_free(fp);
+                molecule_simple_free(&molecule);
+
+                if((char *) data != DatumGetPointer(mol))
+                    pfree(data);
+            }
+
+            SPI_freetuptable(SPI_tuptable);
+        }
+
+        SPI_cursor_close(moleculeCursor);
+
+        lucy_commit(&lucy);
+    }
+    PG_CATCH();
+    {
+        lucy_rollback(&lucy);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    return time_to_ms(time_spent(begin, time_get()));
+}
+
+
+static void lucy_benchmark_search(const char *path, int32_t maxId, const BenchmarkQueries *queries,
+        BenchmarkResult *result)
+{
+    int64_t time = 0;
+    int64_t candidates = 0;
+
+    BitSet hits;
+    bitset_init_alloc(&hits, maxId);
+
+    lucy_set_folder(&lucy, path);
+
+    for(int q = 0; q < queries->count; q++)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        struct timeval begin = time_get();
+        lucy_search_bitset(&lucy, queries->stringFps[q], &hits);
+        time += time_spent(begin, time_get());
+
+        candidates += bitset_cardinality(&hits);
+    }
+
+    /* release the searcher of the temporary index */
+    lucy_set_folder(&lucy, path);
+
+    pfree(hits.words);
+
+    result->screenTime = time_to_ms(time);
+    result->candidates = candidates;
+}
+
+
+static void lucy_benchmark_fingerprints(const char *path, const BenchmarkQueries *queries, BenchmarkResult *result)
+{
+    int64_t time = 0;
+    int64_t candidates = 0;
+
+    struct timeval begin = time_get();
+    fingerprint_index_build(path);
+    result->buildTime = time_to_ms(time_spent(begin, time_get()));
+    result->indexSize = lucy_benchmark_file_size(path);
+
+    FingerprintIndex index;
+    fingerprint_index_init(&index);
+    fingerprint_index_map(&index, path);
+
+    PG_TRY();
+    {
+        BitSet hits;
+        bitset_init_alloc(&hits, index.moleculeCount);
+
+        for(int q = 0; q < queries->count; q++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            struct timeval begin = time_get();
+            fingerprint_index_search(&index, queries->foldedFps[q], &hits);
+            time += time_spent(begin, time_get());
+
+            candidates += bitset_cardinality(&hits);
+        }
+
+        pfree(hits.words);
+    }
+    PG_CATCH();
+    {
+        fingerprint_index_close(&index);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    fingerprint_index_close(&index);
+
+    result->screenTime = time_to_ms(time);
+    result->candidates = candidates;
+}
+
+
+static void lucy_benchmark_postings(const char *path, const BenchmarkQueries *queries, BenchmarkResult *result)
+{
+    int64_t time = 0;
+    int64_t candidates = 0;
+
+    struct timeval begin = time_get();
+    posting_index_build(path, false);
+    result->buildTime = time_to_ms(time_spent(begin, time_get()));
+    result->indexSize = lucy_benchmark_file_size(path);
+
+    PostingIndex index;
+    posting_index_init(&index);
+
+    if(!posting_index_map(&index, path))
+        elog(ERROR, "%s: posting_index_map() failed", __func__);
+
+    PG_TRY();
+    {
+        for(int q = 0; q < queries->count; q++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            struct timeval begin = time_get();
+            PostingResultSet resultSet = posting_index_search(&index, queries->integerFps[q]);
+            time += time_spent(begin, time_get());
+
+            candidates += resultSet.count;
+
+            if(resultSet.ids != NULL)
+                pfree(resultSet.ids);
+        }
+    }
+    PG_CATCH();
+    {
+        posting_index_close(&index);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    posting_index_close(&index);
+
+    result->screenTime = time_to_ms(time);
+    result->candidates = candidates;
+}
+
+
+/*
+ * Builds temporary indexes of the current molecules for the Lucy screen and for the alternative screening indexes
+ * and measures their size, the build time, the time spent by screening a sample of the stored molecules and the
+ * total number of candidates returned by the screen. The temporary Lucy index shares the prefix of the regular
+ * index, so its leftovers are removed by the cleanup.
+ */
+PG_FUNCTION_INFO_V1(lucy_benchmark);
+Datum lucy_benchmark(PG_FUNCTION_ARGS)
+{
+    if(SRF_IS_FIRSTCALL())
+    {
+        int32_t queryCount = PG_GETARG_INT32(0);
+
+        FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+        BenchmarkResult *results;
+
+        PG_MEMCONTEXT_BEGIN(funcctx->multi_call_memory_ctx);
+
+        TupleDesc desc = CreateTemplateTupleDesc(5, false);
+        TupleDescInitEntry(desc, (AttrNumber) 1, "screen", VARCHAROID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 2, "index_size", INT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 3, "build_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 4, "screen_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(desc, (AttrNumber) 5, "candidates", INT8OID, -1, 0);
+        funcctx->tuple_desc = BlessTupleDesc(desc);
+
+        results = palloc(BENCHMARK_SCREENS * sizeof(BenchmarkResult));
+        funcctx->user_fctx = results;
+        funcctx->max_calls = BENCHMARK_SCREENS;
+
+        PG_MEMCONTEXT_END();
+
+
+        if(unlikely(lucyInitialised == false))
+        {
+            lucy_init(&lucy);
+            lucyInitialised = true;
+        }
+
+
+        if(unlikely(SPI_connect() != SPI_OK_CONNECT))
+            elog(ERROR, "%s: SPI_connect() failed", __func__);
+
+
+        /* get the size of the hit bitsets */
+        if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1)
+            elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+        char isNullFlag;
+        int32_t maxId = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+        if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+            elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+        SPI_freetuptable(SPI_tuptable);
+
+
+        /* sample the query molecules */
+        Oid argtypes[] = { INT4OID };
+        Datum args[] = { Int32GetDatum(queryCount) };
+
+        if(unlikely(SPI_execute_with_args("select molecule from " MOLECULES_TABLE " order by random() limit $1",
+                1, argtypes, args, NULL, true, FETCH_ALL) != SPI_OK_SELECT))
+            elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+            elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
+
+        BenchmarkQueries queries;
+        queries.count = SPI_processed;
+        queries.stringFps = palloc((queries.count + 1) * sizeof(StringFingerprint));
+        queries.foldedFps = palloc((queries.count + 1) * sizeof(IntegerFingerprint));
+        queries.integerFps = palloc((queries.count + 1) * sizeof(IntegerFingerprint));
+
+        for(int q = 0; q < queries.count; q++)
+        {
+            Datum mol = SPI_getbinval(SPI_tuptable->vals[q], SPI_tuptable->tupdesc, 1, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *data = DatumGetByteaP(mol);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, (uint8_t *) VARDATA(data));
+
+            queries.stringFps[q] = string_substructure_fingerprint_get_query(&molecule);
+            queries.foldedFps[q] = integer_folded_substructure_fingerprint_get_query(&molecule);
+            queries.integerFps[q] = integer_substructure_fingerprint_get_query(&molecule);
+
+            molecule_simple_free(&molecule);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+
+
+        char *lucyPath = get_file_path(LUCY_INDEX_PREFIX "-benchmark");
+
+        lucy_benchmark_delete(lucyPath);
+
+        PG_TRY();
+        {
+            results[BENCHMARK_LUCY].buildTime = lucy_benchmark_build(lucyPath);
+            results[BENCHMARK_LUCY].indexSize = lucy_benchmark_file_size(lucyPath);
+
+            lucy_benchmark_search(lucyPath, maxId, &queries, &results[BENCHMARK_LUCY]);
+        }
+        PG_CATCH();
+        {
+            lucy_benchmark_delete(lucyPath);
+
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        lucy_benchmark_delete(lucyPath);
+
+
+        char *fingerprintPath = get_file_path(FINGERPRINT_INDEX_PREFIX "-benchmark" FINGERPRINT_INDEX_SUFFIX);
+
+        unlink(fingerprintPath);
+
+        PG_TRY();
+        {
+            lucy_benchmark_fingerprints(fingerprintPath, &queries, &results[BENCHMARK_FINGERPRINTS]);
+        }
+        PG_CATCH();
+        {
+            unlink(fingerprintPath);
+
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        unlink(fingerprintPath);
+
+
+        char *postingPath = get_file_path(POSTING_INDEX_PREFIX "-benchmark" POSTING_INDEX_SUFFIX);
+
+        unlink(postingPath);
+
+        PG_TRY();
+        {
+            lucy_benchmark_postings(postingPath, &queries, &results[BENCHMARK_POSTINGS]);
+        }
+        PG_CATCH();
+        {
+            unlink(postingPath);
+
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        unlink(postingPath);
+
+        SPI_finish();
+    }
+
+
+    FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+    BenchmarkResult *results = funcctx->user_fctx;
+
+    if(funcctx->call_cntr == funcctx->max_calls)
+        SRF_RETURN_DONE(funcctx);
+
+    BenchmarkResult *result = &results[funcctx->call_cntr];
+
+    char isnull[5] = {0, 0, 0, 0, 0};
+    Datum values[5] = {
+            PointerGetDatum(cstring_to_text(screenNames[funcctx->call_cntr])),
+            Int64GetDatum(result->indexSize),
+            Float8GetDatum(result->buildTime),
+            Float8GetDatum(result->screenTime),
+            Int64GetDatum(result->candidates)
+    };
+
+    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, isnull);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+}
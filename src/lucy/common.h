@@ -3,8 +3,11 @@
 
 
 #define USE_MOLECULE_INDEX      0
+#define USE_FINGERPRINT_INDEX   0
 #define LUCY_INDEX_PREFIX       "lucy"
 #define LUCY_INDEX_SUFFIX       ""
+#define DOCID_TABLE_PREFIX      "sachem_docids"
+#define DOCID_TABLE_SUFFIX      ".idx"
 #define COMPOUNDS_TABLE         "compounds"
 #define MOLECULES_TABLE         "sachem_molecules"
 #define MOLECULE_ERRORS_TABLE   "sachem_molecule_errors"
@@ -1,8 +1,10 @@
 #include <postgres.h>
 #include <utils/memutils.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,7 +14,10 @@
 #include <Lucy/Document/Doc.h>
 #include <Lucy/Document/HitDoc.h>
 #include <Lucy/Index/Indexer.h>
+#include <Lucy/Index/IndexReader.h>
+#include <Lucy/Index/PolyReader.h>
 #include <Lucy/Object/BitVector.h>
+#include <Lucy/Object/I32Array.h>
 #include <Lucy/Plan/FullTextType.h>
 #include <Lucy/Plan/Schema.h>
 #include <Lucy/Plan/StringType.h>
@@ -20,9 +25,11 @@
 #include <Lucy/Search/Collector.h>
 #include <Lucy/Search/IndexSearcher.h>
 #include <Lucy/Search/MatchAllQuery.h>
+#include <Lucy/Search/NoMatchQuery.h>
 #include <Lucy/Search/QueryParser.h>
 #include <Lucy/Search/TermQuery.h>
 #include "lucy.h"
+#include "measurement.h"
 #include "sachem.h"
 
 
@@ -55,6 +62,14 @@ typedef struct
 } SetFolderRoutineContext;
 
 
+typedef struct
+{
+    Lucy *lucy;
+    int part;
+    int parts;
+} SetSegmentsRoutineContext;
+
+
 typedef struct
 {
     Lucy *lucy;
@@ -82,12 +97,27 @@ typedef struct
 } DeleteRoutineContext;
 
 
+typedef struct
+{
+    String *term;
+    uint32_t freq;
+} QueryTerm;
+
+
 typedef struct
 {
     Lucy *lucy;
     StringFingerprint fp;
     String *queryStr;
     Query *query;
+    QueryTerm *terms;
+    int termCount;
+    Vector *children;
+    IndexReader *reader;
+    Vector *segReaders;
+    I32Array *offsets;
+    Vector *subReaders;
+    PolyReader *polyReader;
 #if USE_ID_TABLE && LAZY_INITIALIZATION == 0
     HitDoc *hit;
     String *id;
@@ -102,13 +132,34 @@ typedef struct
     int32_t *results;
     size_t size;
     size_t loaded;
-#if USE_ID_TABLE == 0 || LAZY_INITIALIZATION
     HitDoc *hit;
     String *id;
-#endif
 } GetRoutineContext;
 
 
+typedef struct
+{
+    Lucy *lucy;
+    BitSet *result;
+    HitDoc *hit;
+    String *id;
+} GetBitSetRoutineContext;
+
+
+typedef struct
+{
+    Lucy *lucy;
+    IndexSearcher *searcher;
+    BitVector *hits;
+    Collector *collector;
+    Query *query;
+    HitDoc *hit;
+    String *id;
+    int32_t *table;
+    int32_t size;
+} WriteDocIdsRoutineContext;
+
+
 typedef struct
 {
     Err *error;
@@ -193,9 +244,17 @@ void lucy_init(Lucy *lucy)
     lucy->searcher = NULL;
     lucy->collector = NULL;
     lucy->hits = NULL;
+    lucy->queryTime = 0;
 #if USE_ID_TABLE
     lucy->idTable = NULL;
 #endif
+    lucy->docIdAddress = MAP_FAILED;
+    lucy->docIdSize = 0;
+    lucy->docIds = NULL;
+    lucy->docIdCount = 0;
+    lucy->segmentPart = 0;
+    lucy->segmentParts = 1;
+    lucy->docBase = 0;
 
     InitRoutineContext context;
     context.lucy = lucy;
@@ -239,11 +298,74 @@ static void base_set_folder(SetFolderRoutineContext *context)
 #endif
 
     lucy->folder = Str_new_from_trusted_utf8(context->indexPath, strlen(context->indexPath));
+    lucy->segmentPart = 0;
+    lucy->segmentParts = 1;
+    lucy->docBase = 0;
+}
+
+
+static void base_set_segments(SetSegmentsRoutineContext *context)
+{
+    Lucy *lucy = context->lucy;
+
+    safeDecref(lucy->searcher);
+    safeDecref(lucy->collector);
+    safeDecref(lucy->hits);
+#if USE_ID_TABLE
+    safePfree(lucy->idTable);
+#endif
+
+    lucy->segmentPart = context->part;
+    lucy->segmentParts = context->parts;
+    lucy->docBase = 0;
+}
+
+
+/*
+ * Restricts the following searches to one of the given number of parts of the index segments. The parts are
+ * contiguous, so the docnums of a part differ from the docnums of the whole index only by a base. A segment
+ * belongs to the part containing its middle document, which balances the parts by the document counts as far as
+ * whole segments allow; a segment is never split, so an index with fewer segments than parts leaves some parts
+ * empty.
+ */
+void lucy_set_segments(Lucy *lucy, int part, int parts)
+{
+    SetSegmentsRoutineContext context;
+    context.lucy = lucy;
+    context.part = part;
+    context.parts = parts;
+
+    Err *error = Err_trap((Err_Attempt_t) &base_set_segments, (void *) &context);
+
+    if(error != NULL)
+    {
+        safeNothrowDecref(lucy->searcher);
+        safeNothrowDecref(lucy->collector);
+        safeNothrowDecref(lucy->hits);
+#if USE_ID_TABLE
+        safePfree(lucy->idTable);
+#endif
+
+        throwError(error);
+    }
+}
+
+
+static void unmap_docids(Lucy *lucy)
+{
+    if(lucy->docIdAddress != MAP_FAILED)
+        munmap(lucy->docIdAddress, lucy->docIdSize);
+
+    lucy->docIdAddress = MAP_FAILED;
+    lucy->docIds = NULL;
+    lucy->docIdCount = 0;
 }
 
 
 void lucy_set_folder(Lucy *lucy, const char *indexPath)
 {
+    unmap_docids(lucy);
+
     SetFolderRoutineContext context;
     context.lucy = lucy;
     context.indexPath = indexPath;
@@ -420,66 +542,231 @@ void lucy_rollback(Lucy *lucy)
 }
 
 
-static void base_search(SearchRoutineContext *context)
+static inline bool is_term_char(char c)
 {
-    if(context->lucy->searcher == NULL)
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+
+static int term_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const QueryTerm *) a)->freq;
+    uint32_t y = ((const QueryTerm *) b)->freq;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Builds the query directly from the fingerprint terms. The terms are extracted the same way as by the
+ * RegexTokenizer of the fp field, so they match the indexed terms exactly. The TermQuery objects are
+ * ordered by their posting length, so that the ANDQuery leads with the most selective one.
+ */
+static void build_query(SearchRoutineContext *context)
+{
+    const char *data = context->fp.data;
+    size_t size = context->fp.size;
+
+    int capacity = 0;
+
+    for(size_t i = 0; i < size; i++)
+        if(is_term_char(data[i]) && (i == 0 || !is_term_char(data[i - 1])))
+            capacity++;
+
+    context->terms = (QueryTerm *) palloc_extended(capacity * sizeof(QueryTerm), MCXT_ALLOC_NO_OOM);
+
+    if(context->terms == NULL)
+        THROW(ERR, "out of memory");
+
+    bool empty = false;
+
+    for(size_t i = 0; i < size;)
     {
-        context->lucy->searcher = IxSearcher_new((Obj *) (context->lucy->folder));
+        if(!is_term_char(data[i]))
+        {
+            i++;
+            continue;
+        }
 
-        int32_t maxId = IxSearcher_Doc_Max(context->lucy->searcher);
-        context->lucy->hits = BitVec_new(maxId + 1);
+        size_t begin = i;
+
+        while(i < size && is_term_char(data[i]))
+            i++;
+
+        QueryTerm *term = context->terms + context->termCount;
+        term->term = Str_new_from_trusted_utf8(data + begin, i - begin);
+        context->termCount++;
+
+        term->freq = IxSearcher_Doc_Freq(context->lucy->searcher, context->lucy->fpF, (Obj *) term->term);
+
+        if(term->freq == 0)
+        {
+            empty = true;
+            break;
+        }
+    }
+
+
+    if(empty)
+    {
+        context->query = (Query *) NoMatchQuery_new();
+    }
+    else if(context->termCount == 0)
+    {
+        context->query = (Query *) MatchAllQuery_new();
+    }
+    else
+    {
+        qsort(context->terms, context->termCount, sizeof(QueryTerm), term_cmp);
+
+        context->children = Vec_new(context->termCount);
+
+        for(int i = 0; i < context->termCount; i++)
+            Vec_Push(context->children, (Obj *) TermQuery_new(context->lucy->fpF, (Obj *) context->terms[i].term));
+
+        context->query = (Query *) ANDQuery_new(context->children);
+    }
+
+    safeDecref(context->children);
+
+    for(int i = 0; i < context->termCount; i++)
+        safeDecref(context->terms[i].term);
+
+    context->termCount = 0;
+    safePfree(context->terms);
+}
 
-        context->lucy->collector = (Collector *) BitColl_new(context->lucy->hits);
 
 #if USE_ID_TABLE
-        PG_MEMCONTEXT_BEGIN(TopMemoryContext);
-        context->lucy->idTable = (int32_t *) palloc_extended((maxId + 1) * sizeof(int32_t), MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
-        PG_MEMCONTEXT_END();
+static void init_id_table(SearchRoutineContext *context, int32_t maxId)
+{
+    PG_MEMCONTEXT_BEGIN(TopMemoryContext);
+    context->lucy->idTable = (int32_t *) palloc_extended((maxId + 1) * sizeof(int32_t), MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+    PG_MEMCONTEXT_END();
 
-        if(context->lucy->idTable == NULL)
-            THROW(ERR, "out of memory");
+    if(context->lucy->idTable == NULL)
+        THROW(ERR, "out of memory");
 
 #if LAZY_INITIALIZATION
-        for(int i = 0; i < maxId + 1; i++)
-            context->lucy->idTable[i] = INVALID_ID;
+    for(int i = 0; i < maxId + 1; i++)
+        context->lucy->idTable[i] = INVALID_ID;
 #else
-        context->query = (Query *) MatchAllQuery_new();
-        IxSearcher_Collect(context->lucy->searcher, context->query, context->lucy->collector);
+    context->query = (Query *) MatchAllQuery_new();
+    IxSearcher_Collect(context->lucy->searcher, context->query, context->lucy->collector);
 
-        int32_t possition = 0;
+    int32_t possition = 0;
 
-        while(true)
-        {
-            size_t docId = BitVec_Next_Hit(context->lucy->hits, possition);
+    while(true)
+    {
+        size_t docId = BitVec_Next_Hit(context->lucy->hits, possition);
 
-            if(docId == -1)
-                break;
+        if(docId == -1)
+            break;
 
-            possition++;
+        possition++;
 
-            context->hit = IxSearcher_Fetch_Doc(context->lucy->searcher, docId);
+        context->hit = IxSearcher_Fetch_Doc(context->lucy->searcher, docId);
 
-            context->id = (String *) HitDoc_Extract(context->hit, context->lucy->idF);
-            context->lucy->idTable[docId] = Str_To_I64(context->id);
+        context->id = (String *) HitDoc_Extract(context->hit, context->lucy->idF);
+        context->lucy->idTable[docId] = Str_To_I64(context->id);
 
-            safeDecref(context->id);
-            safeDecref(context->hit);
-        }
+        safeDecref(context->id);
+        safeDecref(context->hit);
+    }
+
+    safeDecref(context->query);
+#endif
+}
 #endif
+
+
+static void open_segments(SearchRoutineContext *context)
+{
+    Lucy *lucy = context->lucy;
+
+    context->reader = IxReader_open((Obj *) lucy->folder, NULL, NULL);
+    context->segReaders = IxReader_Seg_Readers(context->reader);
+    context->offsets = IxReader_Offsets(context->reader);
+
+    int32_t total = IxReader_Doc_Max(context->reader);
+    size_t count = Vec_Get_Size(context->segReaders);
+
+    context->subReaders = Vec_new(count);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        int32_t offset = I32Arr_Get(context->offsets, i);
+        int32_t next = i + 1 < count ? I32Arr_Get(context->offsets, i + 1) : total;
+
+        /* twice the position of the middle document, as the documents of the segment follow its offset */
+        int64_t middle = (int64_t) offset + next;
+
+        if(middle * lucy->segmentParts / (2 * ((int64_t) total + 1)) != lucy->segmentPart)
+            continue;
+
+        if(Vec_Get_Size(context->subReaders) == 0)
+            lucy->docBase = offset;
+
+        Vec_Push(context->subReaders, INCREF(Vec_Fetch(context->segReaders, i)));
+    }
+
+    context->polyReader = PolyReader_new(IxReader_Get_Schema(context->reader), IxReader_Get_Folder(context->reader),
+            IxReader_Get_Snapshot(context->reader), NULL, context->subReaders);
+    lucy->searcher = IxSearcher_new((Obj *) context->polyReader);
+
+    safeDecref(context->polyReader);
+    safeDecref(context->subReaders);
+    safeDecref(context->offsets);
+    safeDecref(context->segReaders);
+    safeDecref(context->reader);
+}
+
+
+static void base_search(SearchRoutineContext *context)
+{
+    if(context->lucy->searcher == NULL)
+    {
+        if(context->lucy->segmentParts > 1)
+            open_segments(context);
+        else
+            context->lucy->searcher = IxSearcher_new((Obj *) (context->lucy->folder));
+
+        int32_t maxId = IxSearcher_Doc_Max(context->lucy->searcher);
+        context->lucy->hits = BitVec_new(maxId + 1);
+
+        context->lucy->collector = (Collector *) BitColl_new(context->lucy->hits);
+
+#if USE_ID_TABLE
+        /* the id table is not needed if the sync has written the docnum table */
+        if(context->lucy->docIdCount < context->lucy->docBase + maxId + 1)
+            init_id_table(context, maxId);
 #endif
     }
 
 
+#if SHOW_STATS
+    struct timeval query_begin = time_get();
+#endif
+
     if(context->fp.size != 0)
     {
+#if USE_QUERY_PARSER
         context->queryStr = Str_new_wrap_trusted_utf8(context->fp.data, context->fp.size);
         context->query = QParser_Parse(context->lucy->qparser, context->queryStr);
+#else
+        build_query(context);
+#endif
     }
     else
     {
         context->query = (Query *) MatchAllQuery_new();
     }
 
+#if SHOW_STATS
+    struct timeval query_end = time_get();
+    context->lucy->queryTime = time_spent(query_begin, query_end);
+#endif
+
     BitVec_Clear_All(context->lucy->hits);
     IxSearcher_Collect(context->lucy->searcher, context->query, context->lucy->collector);
 
@@ -495,6 +782,14 @@ LucyResultSet lucy_search(Lucy *lucy, StringFingerprint fp)
     context.fp = fp;
     context.queryStr = NULL;
     context.query = NULL;
+    context.terms = NULL;
+    context.termCount = 0;
+    context.children = NULL;
+    context.reader = NULL;
+    context.segReaders = NULL;
+    context.offsets = NULL;
+    context.subReaders = NULL;
+    context.polyReader = NULL;
 #if USE_ID_TABLE && LAZY_INITIALIZATION == 0
     context.hit = NULL;
     context.id = NULL;
@@ -520,6 +815,17 @@ LucyResultSet lucy_search(Lucy *lucy, StringFingerprint fp)
 
         safeNothrowDecref(context.query);
         safeNothrowDecref(context.queryStr);
+        safeNothrowDecref(context.children);
+        safeNothrowDecref(context.polyReader);
+        safeNothrowDecref(context.subReaders);
+        safeNothrowDecref(context.offsets);
+        safeNothrowDecref(context.segReaders);
+        safeNothrowDecref(context.reader);
+
+        for(int i = 0; i < context.termCount; i++)
+            safeNothrowDecref(context.terms[i].term);
+
+        safePfree(context.terms);
 #if USE_ID_TABLE && LAZY_INITIALIZATION == 0
         safeNothrowDecref(context.hit);
         safeNothrowDecref(context.id);
@@ -532,6 +838,40 @@ LucyResultSet lucy_search(Lucy *lucy, StringFingerprint fp)
 }
 
 
+static inline int32_t get_docid(Lucy *lucy, HitDoc **hit, String **id, size_t docId)
+{
+    if(likely(lucy->docBase + docId < lucy->docIdCount))
+        return lucy->docIds[lucy->docBase + docId];
+
+#if USE_ID_TABLE
+#if LAZY_INITIALIZATION
+    if(lucy->idTable[docId] == INVALID_ID)
+    {
+        *hit = IxSearcher_Fetch_Doc(lucy->searcher, docId);
+
+        *id = (String *) HitDoc_Extract(*hit, lucy->idF);
+        lucy->idTable[docId] = Str_To_I64(*id);
+
+        safeDecref(*id);
+        safeDecref(*hit);
+    }
+#endif
+
+    return lucy->idTable[docId];
+#else
+    *hit = IxSearcher_Fetch_Doc(lucy->searcher, docId);
+
+    *id = (String *) HitDoc_Extract(*hit, lucy->idF);
+    int32_t value = Str_To_I64(*id);
+
+    safeDecref(*id);
+    safeDecref(*hit);
+
+    return value;
+#endif
+}
+
+
 static void base_get(GetRoutineContext *context)
 {
     int ret = 0;
@@ -546,30 +886,7 @@ static void base_get(GetRoutineContext *context)
         if(docId == -1)
             break;
 
-#if USE_ID_TABLE
-#if LAZY_INITIALIZATION
-        if(context->lucy->idTable[docId] == INVALID_ID)
-        {
-            context->hit = IxSearcher_Fetch_Doc(context->lucy->searcher, docId);
-
-            context->id = (String *) HitDoc_Extract(context->hit, context->lucy->idF);
-            context->lucy->idTable[docId] = Str_To_I64(context->id);
-
-            safeDecref(context->id);
-            safeDecref(context->hit);
-        }
-#endif
-
-        *(results++) = context->lucy->idTable[docId];
-#else
-        context->hit = IxSearcher_Fetch_Doc(context->lucy->searcher, docId);
-
-        context->id = (String *) HitDoc_Extract(context->hit, context->lucy->idF);
-        *(results++) = Str_To_I64(context->id);
-
-        safeDecref(context->id);
-        safeDecref(context->hit);
-#endif
+        *(results++) = get_docid(context->lucy, &context->hit, &context->id, docId);
 
         ret++;
         size--;
@@ -587,19 +904,15 @@ size_t lucy_get(Lucy *lucy, LucyResultSet *resultSet, int32_t *results, size_t s
     context.results = results;
     context.size = size;
     context.loaded = 0;
-#if USE_ID_TABLE == 0 || LAZY_INITIALIZATION
     context.hit = NULL;
     context.id = NULL;
-#endif
 
     Err *error = Err_trap((Err_Attempt_t) &base_get, (void *) &context);
 
     if(error != NULL)
     {
-#if USE_ID_TABLE == 0 || LAZY_INITIALIZATION
         safeNothrowDecref(context.hit);
         safeNothrowDecref(context.id);
-#endif
 
         throwError(error);
     }
@@ -613,6 +926,209 @@ void lucy_fail(Lucy *lucy, LucyResultSet *resultSet)
 }
 
 
+/*
+ * Converts the hits to molecule ids in one pass over the raw bits of the hit vector. The ids are taken from
+ * the docnum table written by the sync; the per-backend id table is used only for indexes without it.
+ */
+static void base_get_bitset(GetBitSetRoutineContext *context)
+{
+    BitSet *result = context->result;
+    const uint8_t *bits = BitVec_Get_Raw_Bits(context->lucy->hits);
+    size_t capacity = BitVec_Get_Capacity(context->lucy->hits);
+
+    for(size_t base = 0; base < capacity; base += 64)
+    {
+        uint64_t word = 0;
+        size_t bytes = capacity - base >= 64 ? 8 : (capacity - base + 7) / 8;
+
+        memcpy(&word, bits + base / 8, bytes);
+
+        while(word)
+        {
+            size_t docId = base + __builtin_ctzll(word);
+            word &= word - 1;
+
+            int32_t id = get_docid(context->lucy, &context->hit, &context->id, docId);
+
+            if(likely(id >= 0 && id < result->length * BITS_PER_WORD))
+                bitset_set(result, id);
+        }
+    }
+}
+
+
+void lucy_search_bitset(Lucy *lucy, StringFingerprint fp, BitSet *result)
+{
+    lucy_search(lucy, fp);
+
+    memset(result->words, 0, result->length * sizeof(uint64_t));
+    result->wordsInUse = 0;
+
+    GetBitSetRoutineContext context;
+    context.lucy = lucy;
+    context.result = result;
+    context.hit = NULL;
+    context.id = NULL;
+
+    Err *error = Err_trap((Err_Attempt_t) &base_get_bitset, (void *) &context);
+
+    if(error != NULL)
+    {
+        safeNothrowDecref(context.hit);
+        safeNothrowDecref(context.id);
+
+        throwError(error);
+    }
+}
+
+
+static void base_write_docids(WriteDocIdsRoutineContext *context)
+{
+    context->searcher = IxSearcher_new((Obj *) (context->lucy->folder));
+
+    int32_t maxId = IxSearcher_Doc_Max(context->searcher);
+    context->hits = BitVec_new(maxId + 1);
+    context->collector = (Collector *) BitColl_new(context->hits);
+
+    context->size = maxId + 1;
+    context->table = (int32_t *) palloc_extended(context->size * sizeof(int32_t), MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+
+    if(context->table == NULL)
+        THROW(ERR, "out of memory");
+
+    for(int i = 0; i < context->size; i++)
+        context->table[i] = INVALID_ID;
+
+    context->query = (Query *) MatchAllQuery_new();
+    IxSearcher_Collect(context->searcher, context->query, context->collector);
+
+    int32_t possition = 0;
+
+    while(true)
+    {
+        size_t docId = BitVec_Next_Hit(context->hits, possition);
+
+        if(docId == -1)
+            break;
+
+        possition = docId + 1;
+
+        context->hit = IxSearcher_Fetch_Doc(context->searcher, docId);
+
+        context->id = (String *) HitDoc_Extract(context->hit, context->lucy->idF);
+        context->table[docId] = Str_To_I64(context->id);
+
+        safeDecref(context->id);
+        safeDecref(context->hit);
+    }
+
+    safeDecref(context->query);
+    safeDecref(context->collector);
+    safeDecref(context->hits);
+    safeDecref(context->searcher);
+}
+
+
+/*
+ * Writes the docnum -> molecule id table of the index in the current folder: the count of documents followed
+ * by the 32-bit ids (INVALID_ID for deleted documents).
+ */
+void lucy_write_docids(Lucy *lucy, const char *path)
+{
+    WriteDocIdsRoutineContext context;
+    context.lucy = lucy;
+    context.searcher = NULL;
+    context.hits = NULL;
+    context.collector = NULL;
+    context.query = NULL;
+    context.hit = NULL;
+    context.id = NULL;
+    context.table = NULL;
+    context.size = 0;
+
+    Err *error = Err_trap((Err_Attempt_t) &base_write_docids, (void *) &context);
+
+    if(error != NULL)
+    {
+        safeNothrowDecref(context.id);
+        safeNothrowDecref(context.hit);
+        safeNothrowDecref(context.query);
+        safeNothrowDecref(context.collector);
+        safeNothrowDecref(context.hits);
+        safeNothrowDecref(context.searcher);
+        safePfree(context.table);
+
+        throwError(error);
+    }
+
+
+    int fd = open(path, O_EXCL | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+
+    if(fd == -1)
+        elog(ERROR, "%s: open() failed", __func__);
+
+    PG_TRY();
+    {
+        uint64_t count = context.size;
+
+        if(write(fd, &count, sizeof(uint64_t)) != sizeof(uint64_t))
+            elog(ERROR, "%s: write() failed", __func__);
+
+        if(write(fd, context.table, count * sizeof(int32_t)) != (ssize_t) (count * sizeof(int32_t)))
+            elog(ERROR, "%s: write() failed", __func__);
+
+        if(close(fd) != 0)
+            elog(ERROR, "%s: close() failed", __func__);
+    }
+    PG_CATCH();
+    {
+        unlink(path);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    pfree(context.table);
+}
+
+
+void lucy_map_docids(Lucy *lucy, const char *path)
+{
+    unmap_docids(lucy);
+
+    int fd = open(path, O_RDONLY, 0);
+
+    if(fd == -1)
+    {
+        if(errno != ENOENT)
+            elog(ERROR, "%s: open() failed", __func__);
+
+        return;
+    }
+
+    struct stat st;
+
+    if(fstat(fd, &st) < 0)
+    {
+        close(fd);
+        elog(ERROR, "%s: fstat() failed", __func__);
+    }
+
+    lucy->docIdSize = st.st_size;
+
+    if(unlikely((lucy->docIdAddress = mmap(NULL, lucy->docIdSize, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        elog(ERROR, "%s: mmap() failed", __func__);
+    }
+
+    close(fd);
+
+    lucy->docIdCount = *((uint64_t *) lucy->docIdAddress);
+    lucy->docIds = (int32_t *) ((uint64_t *) lucy->docIdAddress + 1);
+}
+
+
 static void link_directory_at(int olddirfd, int newdirfd)
 {
     DIR *dp = NULL;
@@ -3,10 +3,13 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "bitset.h"
 #include "fingerprints/fingerprint.h"
 
 #define USE_ID_TABLE        1
 #define LAZY_INITIALIZATION 1
+#define USE_QUERY_PARSER    0
+#define SHOW_STATS          0
 #define NULL_RESULT_SET     ((LucyResultSet) { .possition = -1 })
 
 
@@ -24,9 +27,23 @@ typedef struct
 
     struct lucy_Indexer *indexer;
 
+    /* time spent by building the last query (in microseconds, measured only if SHOW_STATS is enabled) */
+    int64_t queryTime;
+
 #if USE_ID_TABLE
     int32_t *idTable;
 #endif
+
+    /* docnum -> molecule id table written by the sync (mmapped) */
+    void *docIdAddress;
+    size_t docIdSize;
+    int32_t *docIds;
+    size_t docIdCount;
+
+    /* the searcher covers only the part of the segments (if parts > 1) starting at the docnum base */
+    int segmentPart;
+    int segmentParts;
+    int32_t docBase;
 } Lucy;
 
 
@@ -44,6 +61,7 @@ static inline bool lucy_is_open(LucyResultSet *resultSet)
 
 void lucy_init(Lucy *lucy);
 void lucy_set_folder(Lucy *lucy, const char *path);
+void lucy_set_segments(Lucy *lucy, int part, int parts);
 void lucy_begin(Lucy *lucy);
 void lucy_add(Lucy *lucy, int32_t id, StringFingerprint fp);
 void lucy_add_index(Lucy *lucy, const char *path);
@@ -54,6 +72,9 @@ void lucy_rollback(Lucy *lucy);
 LucyResultSet lucy_search(Lucy *lucy, StringFingerprint fp);
 size_t lucy_get(Lucy *lucy, LucyResultSet *resultSet, int32_t *buffer, size_t size);
 void lucy_fail(Lucy *lucy, LucyResultSet *resultSet);
+void lucy_search_bitset(Lucy *lucy, StringFingerprint fp, BitSet *result);
+void lucy_write_docids(Lucy *lucy, const char *path);
+void lucy_map_docids(Lucy *lucy, const char *path);
 void lucy_link_directory(const char *oldPath, const char *newPath);
 void lucy_delete_directory(const char *path);
 
@@ -1,7 +1,17 @@
 #include <postgres.h>
 #include <catalog/pg_type.h>
 #include <executor/spi.h>
+#include <access/xact.h>
+#include <access/parallel.h>
 #include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <port/atomics.h>
+#include <storage/latch.h>
+#include <storage/proc.h>
+#include <storage/shm_mq.h>
+#include <storage/shm_toc.h>
+#include <storage/spin.h>
 #include <utils/memutils.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -12,6 +22,8 @@
 #include "isomorphism.h"
 #include "molecule.h"
 #include "molindex.h"
+#include "fpindex.h"
+#include "postindex.h"
 #include "sachem.h"
 #include "subsearch.h"
 #include "lucy.h"
@@ -20,8 +32,13 @@
 #include "fingerprints/fingerprint.h"
 
 
-#define SHOW_STATS              0
 #define FETCH_SIZE              10000
+#define PARALLEL_SEARCH         (USE_FINGERPRINT_INDEX == 0 && USE_MOLECULE_INDEX == 0)
+#define HEADER_KEY              0
+#define QUERY_KEY               1
+#define QUEUE_KEY               2
+#define QUEUE_SIZE              (64 * 1024)
+#define RESULT_BUFFER_SIZE      1024
 
 
 typedef struct
@@ -41,7 +58,17 @@ typedef struct
     int queryDataCount;
     int queryDataPosition;
 
-    LucyResultSet resultSet;
+    BitSet candidates;
+    int candidatePosition;
+#if USE_FINGERPRINT_INDEX == 0
+    bool usePostings;
+    PostingResultSet postingResultSet;
+#endif
+
+#if PARALLEL_SEARCH
+    bool parallel;
+    int resultPosition;
+#endif
 
 #if USE_MOLECULE_INDEX == 0
     SPITupleTable *table;
@@ -64,6 +91,7 @@ typedef struct
     int candidateCount;
     struct timeval begin;
     int64_t prepareTime;
+    int64_t queryTime;
     int64_t indexTime;
     int64_t matchTime;
 #endif
@@ -71,6 +99,27 @@ typedef struct
 } SubstructureSearchData;
 
 
+#if PARALLEL_SEARCH
+typedef struct
+{
+    slock_t mutex;
+    int worker;
+    int nextPart;
+    int parts;
+    int32_t indexNumber;
+    int32_t moleculeCount;
+    int32_t topN;
+    GraphMode graphMode;
+    ChargeMode chargeMode;
+    IsotopeMode isotopeMode;
+    StereoMode stereoMode;
+    int32_t vf2_timeout;
+    int queryDataCount;
+    pg_atomic_uint32 foundResults;
+} SearchWorkerHeader;
+#endif
+
+
 static bool initialized = false;
 static bool javaInitialized = false;
 static bool lucyInitialised = false;
@@ -80,6 +129,13 @@ static SPIPlanPtr snapshotQueryPlan;
 static Lucy lucy;
 static int moleculeCount;
 
+#if USE_FINGERPRINT_INDEX
+static FingerprintIndex fingerprintIndex;
+#else
+static PostingIndex postingIndex;
+static bool usePostings = false;
+#endif
+
 #if USE_MOLECULE_INDEX
 static void *molIndexAddress = MAP_FAILED;
 static size_t molIndexSize;
@@ -92,6 +148,56 @@ static int dbSize;
 #endif
 
 
+static bool match_molecule(SubstructureSearchData *info, uint8_t *molecule, int32_t id)
+{
+    bool match;
+
+    PG_MEMCONTEXT_BEGIN(info->targetContext);
+    if(!info->extended && (molecule_has_pseudo_atom(molecule) || molecule_has_multivalent_hydrogen(molecule)))
+    {
+        Molecule queryMolecule;
+        Molecule target;
+        VF2State vf2state;
+
+        SubstructureQueryData *data = &(info->queryData[info->queryDataPosition]);
+        molecule_init(&queryMolecule, data->molecule, data->restH, true,
+                info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE,
+                info->stereoMode != STEREO_IGNORE, false, false);
+        vf2state_init(&vf2state, &queryMolecule, info->graphMode, info->chargeMode, info->isotopeMode,
+                info->stereoMode);
+        molecule_init(&target, molecule, NULL, true, info->chargeMode != CHARGE_IGNORE,
+                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
+        match = vf2state_match(&vf2state, &target, id, info->vf2_timeout);
+    }
+    else
+    {
+        Molecule target;
+        molecule_init(&target, molecule, NULL, info->extended, info->chargeMode != CHARGE_IGNORE,
+                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE,
+                info->chargeMode == CHARGE_DEFAULT_AS_UNCHARGED, info->isotopeMode == ISOTOPE_DEFAULT_AS_STANDARD);
+        match = vf2state_match(&info->vf2state, &target, id, info->vf2_timeout);
+    }
+    PG_MEMCONTEXT_END();
+    MemoryContextReset(info->targetContext);
+
+    return match;
+}
+
+
+static void prepare_query(SubstructureSearchData *info)
+{
+    SubstructureQueryData *data = &(info->queryData[info->queryDataPosition]);
+
+    info->extended = molecule_is_extended_search_needed(data->molecule, info->chargeMode != CHARGE_IGNORE,
+            info->isotopeMode != ISOTOPE_IGNORE);
+    molecule_init(&info->queryMolecule, data->molecule, data->restH, info->extended,
+            info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE,
+            info->stereoMode != STEREO_IGNORE, false, false);
+    vf2state_init(&info->vf2state, &info->queryMolecule, info->graphMode, info->chargeMode, info->isotopeMode,
+            info->stereoMode);
+}
+
+
 void lucy_subsearch_init(void)
 {
     if(unlikely(SPI_connect() != SPI_OK_CONNECT))
@@ -114,6 +220,12 @@ void lucy_subsearch_init(void)
             lucyInitialised = true;
         }
 
+#if USE_FINGERPRINT_INDEX
+        fingerprint_index_init(&fingerprintIndex);
+#else
+        posting_index_init(&postingIndex);
+#endif
+
 
         /* prepare snapshot query plan */
         if(unlikely(snapshotQueryPlan == NULL))
@@ -228,8 +340,16 @@ void lucy_subsearch_init(void)
             SPI_freetuptable(SPI_tuptable);
 #endif
 
+#if USE_FINGERPRINT_INDEX
+            fingerprint_index_open(&fingerprintIndex, dbIndexNumber);
+#else
             char *path = get_index_path(LUCY_INDEX_PREFIX, LUCY_INDEX_SUFFIX, dbIndexNumber);
             lucy_set_folder(&lucy, path);
+            lucy_map_docids(&lucy, get_index_path(DOCID_TABLE_PREFIX, DOCID_TABLE_SUFFIX, dbIndexNumber));
+
+            /* the posting index is used instead of lucy if it was generated by the sync */
+            usePostings = posting_index_open(&postingIndex, dbIndexNumber);
+#endif
             indexId = dbIndexNumber;
         }
         PG_CATCH();
@@ -253,6 +373,377 @@ void lucy_subsearch_init(void)
 }
 
 
+#if PARALLEL_SEARCH
+static void send_results(shm_mq_handle *out, int32_t *results, int count)
+{
+    if(count == 0)
+        return;
+
+    shm_mq_result result = shm_mq_send(out, count * sizeof(int32_t), results, false);
+
+    if(result != SHM_MQ_SUCCESS)
+        elog(ERROR, "%s: shm_mq_send() failed", __func__);
+}
+
+
+/*
+ * Each worker opens the lucy index on its own, claims parts of its segments and runs the whole search including
+ * the isomorphism on them, so only the ids of the matching molecules are sent back to the leader.
+ */
+void lucy_subsearch_worker(dsm_segment *seg, shm_toc *toc)
+{
+    volatile SearchWorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
+    char *queryBase = shm_toc_lookup_key(toc, QUERY_KEY);
+
+    SpinLockAcquire(&header->mutex);
+    int worker = header->worker++;
+    SpinLockRelease(&header->mutex);
+
+    shm_mq *queue = (shm_mq *) ((char *) shm_toc_lookup_key(toc, QUEUE_KEY) + worker * QUEUE_SIZE);
+    shm_mq_set_sender(queue, MyProc);
+    shm_mq_handle *out = shm_mq_attach(queue, seg, NULL);
+
+
+    SubstructureSearchData *info = (SubstructureSearchData *) palloc0(sizeof(SubstructureSearchData));
+    info->topN = header->topN;
+    info->graphMode = header->graphMode;
+    info->chargeMode = header->chargeMode;
+    info->isotopeMode = header->isotopeMode;
+    info->stereoMode = header->stereoMode;
+    info->vf2_timeout = header->vf2_timeout;
+    info->queryDataCount = header->queryDataCount;
+    info->queryData = (SubstructureQueryData *) palloc(info->queryDataCount * sizeof(SubstructureQueryData));
+
+    for(int i = 0; i < info->queryDataCount; i++)
+    {
+        SubstructureQueryData *data = &(info->queryData[i]);
+
+        data->moleculeSize = ((int32_t *) queryBase)[0];
+        data->restHSize = ((int32_t *) queryBase)[1];
+        queryBase += 2 * sizeof(int32_t);
+
+        data->molecule = (uint8_t *) queryBase;
+        queryBase += data->moleculeSize;
+
+        data->restH = data->restHSize < 0 ? NULL : (bool *) queryBase;
+        queryBase = (char *) MAXALIGN(queryBase + Max(data->restHSize, 0));
+    }
+
+    bitset_init_empty(&info->resultMask, header->moleculeCount);
+    bitset_init_alloc(&info->candidates, header->moleculeCount);
+
+    info->isomorphismContext = AllocSetContextCreate(CurrentMemoryContext,
+            "subsearch-lucy isomorphism context", ALLOCSET_DEFAULT_SIZES);
+    info->targetContext = AllocSetContextCreate(CurrentMemoryContext,
+            "subsearch-lucy target context", ALLOCSET_DEFAULT_SIZES);
+
+    ArrayType *arrayBuffer = (ArrayType *) palloc(FETCH_SIZE * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
+    arrayBuffer->ndim = 1;
+    arrayBuffer->dataoffset = 0;
+    arrayBuffer->elemtype = INT4OID;
+    int32_t *arrayData = (int32_t *) ARR_DATA_PTR(arrayBuffer);
+
+    int32_t *results = (int32_t *) palloc(RESULT_BUFFER_SIZE * sizeof(int32_t));
+    int resultCount = 0;
+
+
+    if(unlikely(lucyInitialised == false))
+    {
+        lucy_init(&lucy);
+        lucyInitialised = true;
+    }
+
+    lucy_set_folder(&lucy, get_index_path(LUCY_INDEX_PREFIX, LUCY_INDEX_SUFFIX, header->indexNumber));
+    lucy_map_docids(&lucy, get_index_path(DOCID_TABLE_PREFIX, DOCID_TABLE_SUFFIX, header->indexNumber));
+
+
+    if(unlikely(SPI_connect() != SPI_OK_CONNECT))
+        elog(ERROR, "%s: SPI_connect() failed", __func__);
+
+    SPIPlanPtr queryPlan = SPI_prepare("select id, molecule from " MOLECULES_TABLE " where id = any($1)", 1,
+            (Oid[]) { INT4ARRAYOID });
+
+    if(unlikely(queryPlan == NULL))
+        elog(ERROR, "%s: SPI_prepare() failed", __func__);
+
+
+    bool finished = false;
+
+    while(!finished)
+    {
+        SpinLockAcquire(&header->mutex);
+        int part = header->nextPart;
+
+        if(part < header->parts)
+            header->nextPart++;
+        SpinLockRelease(&header->mutex);
+
+        if(part >= header->parts)
+            break;
+
+        lucy_set_segments(&lucy, part, header->parts);
+
+        for(info->queryDataPosition = 0; !finished && info->queryDataPosition < info->queryDataCount; info->queryDataPosition++)
+        {
+            MemoryContextReset(info->isomorphismContext);
+            PG_MEMCONTEXT_BEGIN(info->isomorphismContext);
+
+            prepare_query(info);
+
+            StringFingerprint fp = string_substructure_fingerprint_get_query(&info->queryMolecule);
+            lucy_search_bitset(&lucy, fp, &info->candidates);
+
+            if(fp.data != NULL)
+                pfree(fp.data);
+
+            PG_MEMCONTEXT_END();
+
+
+            int candidate = bitset_next_set_bit(&info->candidates, 0);
+
+            while(!finished && candidate >= 0)
+            {
+                int count = 0;
+
+                while(count < FETCH_SIZE && candidate >= 0)
+                {
+                    if(!bitset_get(&info->resultMask, candidate))
+                        arrayData[count++] = candidate;
+
+                    candidate = bitset_next_set_bit(&info->candidates, candidate + 1);
+                }
+
+                if(count == 0)
+                    continue;
+
+                *(ARR_DIMS(arrayBuffer)) = count;
+                SET_VARSIZE(arrayBuffer, count * sizeof(int32_t) + ARR_OVERHEAD_NONULLS(1));
+
+                Datum values[] = { PointerGetDatum(arrayBuffer)};
+
+                if(unlikely(SPI_execute_plan(queryPlan, values, NULL, true, 0) != SPI_OK_SELECT))
+                    elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+                if(unlikely(SPI_processed != count || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+                    elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+
+                SPITupleTable *table = SPI_tuptable;
+
+                for(int i = 0; i < count; i++)
+                {
+                    CHECK_FOR_INTERRUPTS();
+
+                    char isNullFlag;
+                    int32_t id = DatumGetInt32(SPI_getbinval(table->vals[i], table->tupdesc, 1, &isNullFlag));
+
+                    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                    Datum moleculeDatum = SPI_getbinval(table->vals[i], table->tupdesc, 2, &isNullFlag);
+
+                    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+                    bytea *moleculeData;
+
+                    PG_MEMCONTEXT_BEGIN(info->targetContext);
+                    moleculeData = DatumGetByteaP(moleculeDatum);
+                    PG_MEMCONTEXT_END();
+
+                    if(!match_molecule(info, (uint8_t *) VARDATA(moleculeData), id))
+                        continue;
+
+                    bitset_set(&info->resultMask, id);
+                    results[resultCount++] = id;
+
+                    if(resultCount == RESULT_BUFFER_SIZE)
+                    {
+                        send_results(out, results, resultCount);
+                        resultCount = 0;
+                    }
+
+                    /* the leader stops at topN anyway, the shared counter only stops the other workers early */
+                    if(info->topN > 0 && pg_atomic_add_fetch_u32((pg_atomic_uint32 *) &header->foundResults, 1) >= info->topN)
+                    {
+                        finished = true;
+                        break;
+                    }
+                }
+
+                SPI_freetuptable(table);
+
+                if(info->topN > 0 && pg_atomic_read_u32((pg_atomic_uint32 *) &header->foundResults) >= info->topN)
+                    finished = true;
+            }
+        }
+    }
+
+    send_results(out, results, resultCount);
+
+    SPI_finish();
+
+#if PG_VERSION_NUM < 100000
+    shm_mq_detach(queue);
+#else
+    shm_mq_detach(out);
+#endif
+}
+
+
+/*
+ * Runs the whole search in parallel workers and collects the matching molecules into the result mask. It returns
+ * false if no worker could be launched, in which case the search is done serially.
+ */
+static bool parallel_search(SubstructureSearchData *info, int workers)
+{
+    Size querySize = 0;
+
+    for(int i = 0; i < info->queryDataCount; i++)
+        querySize += MAXALIGN(2 * sizeof(int32_t) + info->queryData[i].moleculeSize +
+                Max(info->queryData[i].restHSize, 0));
+
+
+    EnterParallelMode();
+
+    ParallelContext *pcxt = CreateParallelContextForExternalFunction("libsachem", "lucy_subsearch_worker", workers);
+
+    shm_toc_estimate_keys(&pcxt->estimator, 3);
+    shm_toc_estimate_chunk(&pcxt->estimator, sizeof(SearchWorkerHeader));
+    shm_toc_estimate_chunk(&pcxt->estimator, Max(querySize, 1));
+    shm_toc_estimate_chunk(&pcxt->estimator, workers * QUEUE_SIZE);
+
+    InitializeParallelDSM(pcxt);
+
+    SearchWorkerHeader *header = shm_toc_allocate(pcxt->toc, sizeof(SearchWorkerHeader));
+    SpinLockInit(&header->mutex);
+    header->worker = 0;
+    header->nextPart = 0;
+    header->parts = workers;
+    header->indexNumber = indexId;
+    header->moleculeCount = moleculeCount;
+    header->topN = info->topN;
+    header->graphMode = info->graphMode;
+    header->chargeMode = info->chargeMode;
+    header->isotopeMode = info->isotopeMode;
+    header->stereoMode = info->stereoMode;
+    header->vf2_timeout = info->vf2_timeout;
+    header->queryDataCount = info->queryDataCount;
+    pg_atomic_init_u32(&header->foundResults, 0);
+    shm_toc_insert(pcxt->toc, HEADER_KEY, header);
+
+    char *queryBase = shm_toc_allocate(pcxt->toc, Max(querySize, 1));
+    shm_toc_insert(pcxt->toc, QUERY_KEY, queryBase);
+
+    for(int i = 0; i < info->queryDataCount; i++)
+    {
+        SubstructureQueryData *data = &(info->queryData[i]);
+
+        ((int32_t *) queryBase)[0] = data->moleculeSize;
+        ((int32_t *) queryBase)[1] = data->restHSize;
+        queryBase += 2 * sizeof(int32_t);
+
+        memcpy(queryBase, data->molecule, data->moleculeSize);
+        queryBase += data->moleculeSize;
+
+        if(data->restHSize > 0)
+            memcpy(queryBase, data->restH, data->restHSize);
+
+        queryBase = (char *) MAXALIGN(queryBase + Max(data->restHSize, 0));
+    }
+
+    char *queueBase = shm_toc_allocate(pcxt->toc, workers * QUEUE_SIZE);
+    shm_toc_insert(pcxt->toc, QUEUE_KEY, queueBase);
+
+    for(int w = 0; w < workers; w++)
+    {
+        shm_mq *queue = shm_mq_create(queueBase + w * QUEUE_SIZE, QUEUE_SIZE);
+        shm_mq_set_receiver(queue, MyProc);
+    }
+
+
+    LaunchParallelWorkers(pcxt);
+
+    if(pcxt->nworkers_launched == 0)
+    {
+        DestroyParallelContext(pcxt);
+        ExitParallelMode();
+        return false;
+    }
+
+
+    int launched = pcxt->nworkers_launched;
+    shm_mq_handle **queues = (shm_mq_handle **) palloc(launched * sizeof(shm_mq_handle *));
+    int active = launched;
+
+    for(int w = 0; w < launched; w++)
+        queues[w] = shm_mq_attach((shm_mq *) (queueBase + w * QUEUE_SIZE), pcxt->seg, pcxt->worker[w].bgwhandle);
+
+    while(active > 0)
+    {
+        bool received = false;
+
+        for(int w = 0; w < launched; w++)
+        {
+            if(queues[w] == NULL)
+                continue;
+
+            Size bytes;
+            int32_t *ids;
+            shm_mq_result result = shm_mq_receive(queues[w], &bytes, (void *) &ids, true);
+
+            if(result == SHM_MQ_WOULD_BLOCK)
+                continue;
+
+            if(result == SHM_MQ_DETACHED)
+            {
+#if PG_VERSION_NUM < 100000
+                shm_mq_detach((shm_mq *) (queueBase + w * QUEUE_SIZE));
+#else
+                shm_mq_detach(queues[w]);
+#endif
+                queues[w] = NULL;
+                active--;
+                continue;
+            }
+
+            if(result != SHM_MQ_SUCCESS)
+                elog(ERROR, "%s: shm_mq_receive() failed", __func__);
+
+            received = true;
+
+            for(int i = 0; i < bytes / sizeof(int32_t); i++)
+            {
+                if(info->topN > 0 && info->foundResults == info->topN)
+                    break;
+
+                if(bitset_get(&info->resultMask, ids[i]))
+                    continue;
+
+                bitset_set(&info->resultMask, ids[i]);
+                info->foundResults++;
+            }
+        }
+
+        if(!received && active > 0)
+        {
+            WaitLatchForExtension(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0);
+            ResetLatch(MyLatch);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    pfree(queues);
+
+    WaitForParallelWorkersToFinish(pcxt);
+    DestroyParallelContext(pcxt);
+    ExitParallelMode();
+
+    return true;
+}
+#endif
+
+
 PG_FUNCTION_INFO_V1(lucy_substructure_search);
 Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 {
@@ -272,6 +763,7 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
         StereoMode stereoMode = PG_GETARG_INT32(6);
         TautomerMode tautomerMode = PG_GETARG_INT32(7);
         int32_t vf2_timeout = PG_GETARG_INT32(8);
+        int32_t workers = PG_GETARG_INT32(9);
 
         FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
 
@@ -299,7 +791,11 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
         PG_FREE_IF_COPY(query, 0);
 
         info->queryDataPosition = -1;
-        info->resultSet = NULL_RESULT_SET;
+        info->candidatePosition = -1;
+#if USE_FINGERPRINT_INDEX == 0
+        info->usePostings = usePostings;
+        info->postingResultSet = (PostingResultSet) { .ids = NULL, .count = 0, .position = 0 };
+#endif
         info->tableRowCount = -1;
         info->tableRowPosition = -1;
         info->foundResults = 0;
@@ -308,12 +804,22 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 #endif
 
         bitset_init_empty(&info->resultMask, moleculeCount);
+#if USE_FINGERPRINT_INDEX
+        bitset_init_alloc(&info->candidates, fingerprintIndex.moleculeCount);
+#else
+        bitset_init_alloc(&info->candidates, moleculeCount);
+#endif
 
         info->isomorphismContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
                 "subsearch-lucy isomorphism context", ALLOCSET_DEFAULT_SIZES);
         info->targetContext = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
                 "subsearch-lucy target context", ALLOCSET_DEFAULT_SIZES);
 
+#if PARALLEL_SEARCH
+        info->parallel = workers > 0 && !info->usePostings && parallel_search(info, workers);
+        info->resultPosition = info->parallel ? bitset_next_set_bit(&info->resultMask, 0) : -1;
+#endif
+
 #if USE_MOLECULE_INDEX
         info->arrayBuffer = (int32_t *) palloc(FETCH_SIZE * sizeof(int32_t));
 #else
@@ -327,6 +833,7 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
         info->begin = begin;
         info->candidateCount = 0;
         info->prepareTime = time_spent(java_begin, java_end);
+        info->queryTime = 0;
         info->indexTime = 0;
         info->matchTime = 0;
 #endif
@@ -345,6 +852,18 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 
     PG_TRY();
     {
+#if PARALLEL_SEARCH
+        if(info->parallel)
+        {
+            if(info->resultPosition >= 0)
+            {
+                result = Int32GetDatum(info->resultPosition);
+                isNull = false;
+                info->resultPosition = bitset_next_set_bit(&info->resultMask, info->resultPosition + 1);
+            }
+        }
+        else
+#endif
         if(likely(info->topN <= 0 || info->topN != info->foundResults))
         {
             while(true)
@@ -359,14 +878,25 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
                     }
 #endif
 
-                    if(!lucy_is_open(&info->resultSet))
+#if USE_FINGERPRINT_INDEX
+                    if(info->candidatePosition < 0)
+#else
+                    if(info->usePostings ? info->postingResultSet.position == info->postingResultSet.count :
+                            info->candidatePosition < 0)
+#endif
                     {
                         info->queryDataPosition++;
 
                         if(unlikely(info->queryDataPosition == info->queryDataCount))
                             break;
 
-                        SubstructureQueryData *data = &(info->queryData[info->queryDataPosition]);
+#if USE_FINGERPRINT_INDEX == 0
+                        if(info->postingResultSet.ids != NULL)
+                        {
+                            pfree(info->postingResultSet.ids);
+                            info->postingResultSet.ids = NULL;
+                        }
+#endif
 
                         MemoryContextReset(info->isomorphismContext);
                         PG_MEMCONTEXT_BEGIN(info->isomorphismContext);
@@ -374,15 +904,19 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 #if SHOW_STATS
                         struct timeval fingerprint_begin = time_get();
 #endif
-                        info->extended = molecule_is_extended_search_needed(data->molecule, info->chargeMode != CHARGE_IGNORE,
-                                info->isotopeMode != ISOTOPE_IGNORE);
-                        molecule_init(&info->queryMolecule, data->molecule, data->restH, info->extended,
-                                info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE,
-                                info->stereoMode != STEREO_IGNORE, false, false);
-                        vf2state_init(&info->vf2state, &info->queryMolecule, info->graphMode, info->chargeMode, info->isotopeMode,
-                                info->stereoMode);
+                        prepare_query(info);
+
+#if USE_FINGERPRINT_INDEX
+                        IntegerFingerprint fp = integer_folded_substructure_fingerprint_get_query(&info->queryMolecule);
+#else
+                        IntegerFingerprint postingFp = { .size = 0, .data = NULL };
+                        StringFingerprint fp = { .size = 0, .data = NULL };
 
-                        StringFingerprint fp = string_substructure_fingerprint_get_query(&info->queryMolecule);
+                        if(info->usePostings)
+                            postingFp = integer_substructure_fingerprint_get_query(&info->queryMolecule);
+                        else
+                            fp = string_substructure_fingerprint_get_query(&info->queryMolecule);
+#endif
 #if SHOW_STATS
                         struct timeval fingerprint_end = time_get();
                         info->prepareTime += time_spent(fingerprint_begin, fingerprint_end);
@@ -392,15 +926,35 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 #if SHOW_STATS
                         struct timeval search_begin = time_get();
 #endif
-                        info->resultSet = lucy_search(&lucy, fp);
+#if USE_FINGERPRINT_INDEX
+                        fingerprint_index_search(&fingerprintIndex, fp, &info->candidates);
+                        info->candidatePosition = bitset_next_set_bit(&info->candidates, 0);
+#else
+                        if(info->usePostings)
+                            info->postingResultSet = posting_index_search(&postingIndex, postingFp);
+                        else
+                        {
+                            lucy_search_bitset(&lucy, fp, &info->candidates);
+                            info->candidatePosition = bitset_next_set_bit(&info->candidates, 0);
+                        }
+#endif
 #if SHOW_STATS
                         struct timeval search_end = time_get();
                         info->indexTime += time_spent(search_begin, search_end);
+#if USE_FINGERPRINT_INDEX == 0
+                        if(!info->usePostings)
+                            info->queryTime += lucy.queryTime;
+#endif
 #endif
 
                         if(fp.data != NULL)
                             pfree(fp.data);
 
+#if USE_FINGERPRINT_INDEX == 0
+                        if(postingFp.data != NULL)
+                            pfree(postingFp.data);
+#endif
+
                         PG_MEMCONTEXT_END();
                     }
 
@@ -413,7 +967,18 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
 #if SHOW_STATS
                     struct timeval get_begin = time_get();
 #endif
-                    size_t count = lucy_get(&lucy, &info->resultSet, arrayData, FETCH_SIZE);
+                    size_t count = 0;
+
+#if USE_FINGERPRINT_INDEX == 0
+                    if(info->usePostings)
+                        count = posting_index_get(&info->postingResultSet, arrayData, FETCH_SIZE);
+                    else
+#endif
+                    while(count < FETCH_SIZE && info->candidatePosition >= 0)
+                    {
+                        arrayData[count++] = info->candidatePosition;
+                        info->candidatePosition = bitset_next_set_bit(&info->candidates, info->candidatePosition + 1);
+                    }
 #if SHOW_STATS
                     struct timeval get_end = time_get();
                     info->indexTime += time_spent(get_begin, get_end);
@@ -496,35 +1061,7 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
                     struct timeval match_begin = time_get();
 #endif
 
-                    bool match;
-
-                    PG_MEMCONTEXT_BEGIN(info->targetContext);
-                    if(!info->extended && (molecule_has_pseudo_atom(molecule) || molecule_has_multivalent_hydrogen(molecule)))
-                    {
-                        Molecule queryMolecule;
-                        Molecule target;
-                        VF2State vf2state;
-
-                        SubstructureQueryData *data = &(info->queryData[info->queryDataPosition]);
-                        molecule_init(&queryMolecule, data->molecule, data->restH, true,
-                                info->chargeMode != CHARGE_IGNORE, info->isotopeMode != ISOTOPE_IGNORE,
-                                info->stereoMode != STEREO_IGNORE, false, false);
-                        vf2state_init(&vf2state, &queryMolecule, info->graphMode, info->chargeMode, info->isotopeMode,
-                                info->stereoMode);
-                        molecule_init(&target, molecule, NULL, true, info->chargeMode != CHARGE_IGNORE,
-                                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE, false, false);
-                        match = vf2state_match(&vf2state, &target, id, info->vf2_timeout);
-                    }
-                    else
-                    {
-                        Molecule target;
-                        molecule_init(&target, molecule, NULL, info->extended, info->chargeMode != CHARGE_IGNORE,
-                                info->isotopeMode != ISOTOPE_IGNORE, info->stereoMode != STEREO_IGNORE,
-                                info->chargeMode == CHARGE_DEFAULT_AS_UNCHARGED, info->isotopeMode == ISOTOPE_DEFAULT_AS_STANDARD);
-                        match = vf2state_match(&info->vf2state, &target, id, info->vf2_timeout);
-                    }
-                    PG_MEMCONTEXT_END();
-                    MemoryContextReset(info->targetContext);
+                    bool match = match_molecule(info, molecule, id);
 
 #if SHOW_STATS
                     info->candidateCount++;
@@ -546,8 +1083,6 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
     }
     PG_CATCH();
     {
-        lucy_fail(&lucy, &info->resultSet);
-
         PG_RE_THROW();
     }
     PG_END_TRY();
@@ -576,6 +1111,15 @@ Datum lucy_substructure_search(PG_FUNCTION_ARGS)
                 time_to_ms(info->indexTime), time_to_ms(info->matchTime), time_to_ms(sumTime), time_to_ms(spentTime));
         elog(NOTICE, "time: %11.2f%% %11.2f%% %11.2f%% %11.2f%% ", info->prepareTime / scale,
                 info->indexTime / scale, info->matchTime / scale, sumTime / scale);
+        elog(NOTICE, "time: query preparation (part of index) %.3fms", time_to_ms(info->queryTime));
+#endif
+
+#if USE_FINGERPRINT_INDEX == 0
+        if(info->postingResultSet.ids != NULL)
+        {
+            pfree(info->postingResultSet.ids);
+            info->postingResultSet.ids = NULL;
+        }
 #endif
 
         SRF_RETURN_DONE(funcctx);
@@ -11,9 +11,12 @@
 #include "common.h"
 #include "molecule.h"
 #include "molindex.h"
+#include "fpindex.h"
+#include "postindex.h"
 #include "sachem.h"
 #include "lucy.h"
 #include "fporder.h"
+#include "syncpool.h"
 #include "java/parse.h"
 #include "fingerprints/fingerprint.h"
 
@@ -21,18 +24,7 @@
 #define SYNC_FETCH_SIZE         100000
 #define SUBOPTIMIZE_PROCESSES   4
 #define HEADER_KEY              0
-#define ID_TABLE_KEY            1
-#define IDEX_KEY_OFFSET         2
-#define MOLECULE_KEY_OFFSET     10000
-
-
-typedef struct
-{
-    slock_t mutex;
-    int attachedWorkers;
-    int moleculeCount;
-    int moleculePosition;
-} IndexWorkerHeader;
+#define IDEX_KEY_OFFSET         1
 
 
 typedef struct
@@ -46,53 +38,48 @@ typedef struct
 static bool javaInitialized = false;
 static bool lucyInitialised = false;
 static Lucy lucy;
+static bool subindexLucyInitialised = false;
+static Lucy subindexLucy;
 
 
-void lucy_index_worker(dsm_segment *seg, shm_toc *toc)
+static void lucy_index_molecules(SyncPoolWorker *worker, char *indexPath)
 {
-    volatile IndexWorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
-    SpinLockAcquire(&header->mutex);
-    int workerNumber = header->attachedWorkers++;
-    SpinLockRelease(&header->mutex);
-
-    int *ids = shm_toc_lookup_key(toc, ID_TABLE_KEY);
-    char *indexPath = shm_toc_lookup_key(toc, IDEX_KEY_OFFSET + workerNumber);
+    /* the leader indexes every batch by itself when no worker can be launched, so the instance is reused */
+    if(unlikely(subindexLucyInitialised == false))
+    {
+        lucy_init(&subindexLucy);
+        subindexLucyInitialised = true;
+    }
 
-    lucy_init(&lucy);
-    lucy_set_folder(&lucy, indexPath);
-    lucy_begin(&lucy);
+    lucy_set_folder(&subindexLucy, indexPath);
+    lucy_begin(&subindexLucy);
 
     PG_TRY();
     {
-        while(true)
+        int32_t id;
+        uint8_t *data;
+
+        while(sync_pool_next(worker, &id, &data))
         {
             CHECK_FOR_INTERRUPTS();
 
-            SpinLockAcquire(&header->mutex);
-            int position = header->moleculePosition++;
-            SpinLockRelease(&header->mutex);
-
-            if(position >= header->moleculeCount)
-                break;
-
-            uint8_t *data = shm_toc_lookup_key(toc, MOLECULE_KEY_OFFSET + position);
-
             Molecule molecule;
 
             molecule_simple_init(&molecule, data);
+            sync_pool_count(worker, &molecule);
 
             StringFingerprint result = string_substructure_fingerprint_get(&molecule);
-            lucy_add(&lucy, ids[position], result);
+            lucy_add(&subindexLucy, id, result);
 
             string_fingerprint_free(result);
             molecule_simple_free(&molecule);
         }
 
-        lucy_commit(&lucy);
+        lucy_commit(&subindexLucy);
     }
     PG_CATCH();
     {
-        lucy_rollback(&lucy);
+        lucy_rollback(&subindexLucy);
 
         PG_RE_THROW();
     }
@@ -100,6 +87,15 @@ void lucy_index_worker(dsm_segment *seg, shm_toc *toc)
 }
 
 
+void lucy_index_worker(dsm_segment *seg, shm_toc *toc)
+{
+    SyncPoolWorker worker;
+    char *indexPath = sync_pool_attach(&worker, seg, toc);
+
+    lucy_index_molecules(&worker, indexPath);
+}
+
+
 void lucy_optimize_worker(dsm_segment *seg, shm_toc *toc)
 {
     volatile OptimizeWorkerHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
@@ -150,6 +146,7 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
 
     bool verbose = PG_GETARG_BOOL(0);
     bool optimize = PG_GETARG_BOOL(1);
+    bool postings = PG_GETARG_BOOL(2);
 
     create_base_directory();
 
@@ -171,6 +168,9 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
     /* clone old index */
     int indexNumber = 0;
     char *oldIndexPath = NULL;
+    int previousNumber = -1;
+    Stats *counts = NULL;
+    size_t orderLimit = ORDER_DEFAULT_LIMIT;
 
     if(unlikely(SPI_exec("select id from " INDEX_TABLE, 0) != SPI_OK_SELECT))
         elog(ERROR, "%s: SPI_exec() failed", __func__);
@@ -186,6 +186,7 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
             elog(ERROR, "%s: SPI_getbinval() failed", __func__);
 
         indexNumber = number + 1;
+        previousNumber = number;
         oldIndexPath = get_index_path(LUCY_INDEX_PREFIX, LUCY_INDEX_SUFFIX, number);
     }
 
@@ -216,6 +217,12 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
 
     PG_TRY();
     {
+        if(oldIndexPath == NULL)
+            counts = stats_create(0);
+        else if((counts = fporder_counts_load(previousNumber, &orderLimit)) == NULL)
+            elog(NOTICE, "fingerprint counts are not available, run sachem_generate_fporder to enable their maintenance");
+
+
         /*
          * delete unnecessary data
          */
@@ -249,6 +256,11 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
         SPI_cursor_close(auditCursor);
 
 
+        /* the workers index the new molecules and maintain the fingerprint counts */
+        SyncPool pool;
+        sync_pool_begin(&pool, "lucy_index_worker", lucy_index_molecules, subindexPath, countOfProcessors, counts);
+        sync_pool_subtract_deleted(&pool);
+
         if(unlikely(SPI_exec("delete from " MOLECULES_TABLE " tbl using "
                 AUDIT_TABLE " aud where tbl.id = aud.id", 0) != SPI_OK_DELETE))
             elog(ERROR, "%s: SPI_exec() failed", __func__);
@@ -274,10 +286,6 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
             elog(ERROR, "%s: cannot determine bigint[] oid", __func__);
 
 
-        SPIPlanPtr moleculesPlan = SPI_prepare("insert into " MOLECULES_TABLE " (id, molecule) values ($1,$2)",
-                2, (Oid[]) { INT4OID, BYTEAOID });
-
-
         Portal compoundCursor = SPI_cursor_open_with_args(NULL, "select cmp.id, cmp.molfile from " COMPOUNDS_TABLE " cmp, "
                 AUDIT_TABLE " aud where cmp.id = aud.id and aud.stored",
                 0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
@@ -326,66 +334,6 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
             java_parse_data(processed, molfiles, data);
 
 
-            EnterParallelMode();
-
-            ParallelContext *pcxt = CreateParallelContextForExternalFunction("libsachem", "lucy_index_worker", countOfProcessors);
-
-            shm_toc_estimate_keys(&pcxt->estimator, 2 + countOfProcessors + processed);
-            shm_toc_estimate_chunk(&pcxt->estimator, sizeof(IndexWorkerHeader));
-            shm_toc_estimate_chunk(&pcxt->estimator, processed * sizeof(int));
-
-            for(int i = 0; i < countOfProcessors; i++)
-                shm_toc_estimate_chunk(&pcxt->estimator, strlen(subindexPath[i]) + 1);
-
-            for(int i = 0; i < processed; i++)
-                if(data[i].molecule != NULL)
-                    shm_toc_estimate_chunk(&pcxt->estimator, VARSIZE(data[i].molecule) - VARHDRSZ);
-
-            InitializeParallelDSM(pcxt);
-
-            int *idValues = shm_toc_allocate(pcxt->toc, processed * sizeof(int));
-            shm_toc_insert(pcxt->toc, ID_TABLE_KEY, idValues);
-
-            for(int i = 0; i < countOfProcessors; i++)
-            {
-                void *path = shm_toc_allocate(pcxt->toc, strlen(subindexPath[i]) + 1);
-                strcpy(path, subindexPath[i]);
-                shm_toc_insert(pcxt->toc, IDEX_KEY_OFFSET + i, path);
-            }
-
-
-            int valid = 0;
-
-            for(int i = 0; i < processed; i++)
-            {
-                if(likely(data[i].molecule != NULL))
-                {
-                    void *molecule = shm_toc_allocate(pcxt->toc, VARSIZE(data[i].molecule) - VARHDRSZ);
-                    memcpy(molecule, VARDATA(data[i].molecule), VARSIZE(data[i].molecule) - VARHDRSZ);
-                    shm_toc_insert(pcxt->toc, MOLECULE_KEY_OFFSET + valid, molecule);
-
-                    idValues[valid] = DatumGetInt32(ids[i]);
-                    valid++;
-                }
-            }
-
-            IndexWorkerHeader *header = shm_toc_allocate(pcxt->toc, sizeof(IndexWorkerHeader));
-            SpinLockInit(&header->mutex);
-            header->attachedWorkers = 0;
-            header->moleculePosition = 0;
-            header->moleculeCount = valid;
-            shm_toc_insert(pcxt->toc, HEADER_KEY, header);
-
-            LaunchParallelWorkers(pcxt);
-
-            if(subindexCount < pcxt->nworkers_launched)
-                subindexCount = pcxt->nworkers_launched;
-
-            WaitForParallelWorkersToFinish(pcxt);
-            DestroyParallelContext(pcxt);
-            ExitParallelMode();
-
-
             for(int i = 0; i < processed; i++)
             {
                 HeapTuple tuple = tuptable->vals[i];
@@ -393,37 +341,18 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
                 if((char *) molfiles[i] != DatumGetPointer(SPI_getbinval(tuple, tuptable->tupdesc, 2, &isNullFlag)))
                     pfree(molfiles[i]);
 
+                sync_pool_add(&pool, ids[i], &data[i]);
 
-                if(data[i].error)
-                {
-                    if(data[i].error == NULL)
-                        data[i].error = cstring_to_text("fingerprint cannot be generated");
-
-                    char *message = text_to_cstring(data[i].error);
-                    elog(NOTICE, "%i: %s", DatumGetInt32(ids[i]), message);
-                    pfree(message);
-
-                    Datum values[] = {ids[i], PointerGetDatum(data[i].error)};
-
-                    if(SPI_execute_with_args("insert into " MOLECULE_ERRORS_TABLE " (compound, message) values ($1,$2)",
-                            2, (Oid[]) { INT4OID, TEXTOID }, values, NULL, false, 0) != SPI_OK_INSERT)
-                        elog(ERROR, "%s: SPI_execute_with_args() failed", __func__);
-
+                if(data[i].error != NULL)
                     pfree(data[i].error);
-                }
-
-                if(data[i].molecule == NULL)
-                    continue;
-
 
-                Datum moleculesValues[] = {ids[i], PointerGetDatum(data[i].molecule)};
-
-                if(SPI_execute_plan(moleculesPlan, moleculesValues, NULL, false, 0) != SPI_OK_INSERT)
-                    elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
-
-                pfree(data[i].molecule);
+                if(data[i].molecule != NULL)
+                    pfree(data[i].molecule);
             }
 
+            /* the workers index this batch while the next one is being parsed */
+            sync_pool_flush(&pool);
+
 
             SPI_freetuptable(tuptable);
 
@@ -435,8 +364,7 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
 
         SPI_cursor_close(compoundCursor);
 
-        if(unlikely(SPI_exec("delete from " AUDIT_TABLE, 0) != SPI_OK_DELETE))
-            elog(ERROR, "%s: SPI_exec() failed", __func__);
+        subindexCount = sync_pool_end(&pool);
 
 
         if(optimize)
@@ -483,19 +411,40 @@ Datum lucy_sync_data(PG_FUNCTION_ARGS)
             lucy_optimize(&lucy);
 
         lucy_commit(&lucy);
+        lucy_write_docids(&lucy, get_index_path(DOCID_TABLE_PREFIX, DOCID_TABLE_SUFFIX, indexNumber));
 
 #if USE_MOLECULE_INDEX
         sachem_generate_molecule_index(indexNumber, false);
 #endif
+
+#if USE_FINGERPRINT_INDEX
+        sachem_generate_fingerprint_index(indexNumber);
+#endif
+
+        /* the posting index of the previous version is updated by the changes recorded in the audit table */
+        if(postings)
+            sachem_generate_posting_index(indexNumber, previousNumber, verbose);
+
+        if(unlikely(SPI_exec("delete from " AUDIT_TABLE, 0) != SPI_OK_DELETE))
+            elog(ERROR, "%s: SPI_exec() failed", __func__);
+
+        if(counts != NULL)
+            fporder_counts_publish(counts, indexNumber, orderLimit);
     }
     PG_CATCH();
     {
         lucy_rollback(&lucy);
 
+        if(counts != NULL)
+            stats_delete(counts);
+
         PG_RE_THROW();
     }
     PG_END_TRY();
 
+    if(counts != NULL)
+        stats_delete(counts);
+
 
     SPI_finish();
     PG_RETURN_VOID();
@@ -529,9 +478,15 @@ Datum lucy_cleanup(PG_FUNCTION_ARGS)
 
 
     char *lucyIndexName = get_index_name(LUCY_INDEX_PREFIX, LUCY_INDEX_SUFFIX, indexNumber);
+    char *countsFileName = get_index_name(COUNTS_INDEX_PREFIX, COUNTS_INDEX_SUFFIX, indexNumber);
+    char *postingIndexName = get_index_name(POSTING_INDEX_PREFIX, POSTING_INDEX_SUFFIX, indexNumber);
+    char *docIdTableName = get_index_name(DOCID_TABLE_PREFIX, DOCID_TABLE_SUFFIX, indexNumber);
 #if USE_MOLECULE_INDEX
     char *moleculeIndexName = get_index_name(MOLECULE_INDEX_PREFIX, MOLECULE_INDEX_SUFFIX, indexNumber);
 #endif
+#if USE_FINGERPRINT_INDEX
+    char *fingerprintIndexName = get_index_name(FINGERPRINT_INDEX_PREFIX, FINGERPRINT_INDEX_SUFFIX, indexNumber);
+#endif
 
 
     int dirfd = -1;
@@ -576,6 +531,48 @@ Datum lucy_cleanup(PG_FUNCTION_ARGS)
                     elog(ERROR, "%s: unlinkat() failed", __func__);
             }
 #endif
+#if USE_FINGERPRINT_INDEX
+            else if(!strncmp(ep->d_name, FINGERPRINT_INDEX_PREFIX, sizeof(FINGERPRINT_INDEX_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, fingerprintIndexName))
+                    continue;
+
+                elog(NOTICE, "delete fingerprint index '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
+#endif
+            else if(!strncmp(ep->d_name, POSTING_INDEX_PREFIX, sizeof(POSTING_INDEX_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, postingIndexName))
+                    continue;
+
+                elog(NOTICE, "delete posting index '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
+            else if(!strncmp(ep->d_name, DOCID_TABLE_PREFIX, sizeof(DOCID_TABLE_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, docIdTableName))
+                    continue;
+
+                elog(NOTICE, "delete docnum table '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
+            else if(!strncmp(ep->d_name, COUNTS_INDEX_PREFIX, sizeof(COUNTS_INDEX_PREFIX) - 1))
+            {
+                if(!strcmp(ep->d_name, countsFileName))
+                    continue;
+
+                elog(NOTICE, "delete fingerprint counts '%s'", ep->d_name);
+
+                if(unlinkat(dirfd, ep->d_name, 0) != 0)
+                    elog(ERROR, "%s: unlinkat() failed", __func__);
+            }
             else if(strcmp(ep->d_name, ".") && strcmp(ep->d_name, "..") && strcmp(ep->d_name, ORDER_FILE))
             {
                 elog(WARNING, "unknown content '%s'", ep->d_name);
@@ -0,0 +1,1025 @@
+#include <postgres.h>
+#include <executor/spi.h>
+#include <utils/hsearch.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bitset.h"
+#include "molecule.h"
+#include "postindex.h"
+#include "sachem.h"
+#include "fingerprints/fingerprint.h"
+
+
+#define FETCH_SIZE              100000
+#define MOLECULES_TABLE         "sachem_molecules"
+#define AUDIT_TABLE             "sachem_compound_audit"
+#define ALIGN8(x)               (((x) + 7) & ~((uint64_t) 7))
+
+
+typedef struct
+{
+    uint32_t fp;
+    uint32_t count;
+    int32_t lastId;
+    bool dense;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t cursor;
+} BuildEntry;
+
+
+typedef struct
+{
+    HTAB *terms;
+    uint64_t postingCount;
+    uint64_t words;
+    uint64_t *documents;
+    uint8_t *data;
+} BuildContext;
+
+
+typedef struct
+{
+    uint32_t fp;
+    uint32_t count;
+    uint32_t capacity;
+    int32_t *ids;
+} AddedPosting;
+
+
+typedef struct
+{
+    BuildEntry build;
+    const PostingIndexEntry *previous;
+    const AddedPosting *added;
+} MergeEntry;
+
+
+typedef struct
+{
+    const uint64_t *words;
+    uint64_t length;
+    uint64_t position;
+    uint64_t word;
+    const uint8_t *data;
+    uint32_t remaining;
+    int32_t id;
+} PostingIterator;
+
+
+typedef void (*FingerprintCallback)(BuildContext *context, int32_t id, IntegerFingerprint fp);
+typedef void (*PostingCallback)(BuildContext *context, BuildEntry *entry, int32_t id);
+
+
+static inline int varint_size(uint32_t value)
+{
+    int size = 1;
+
+    while(value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+
+static inline uint8_t *varint_write(uint8_t *data, uint32_t value)
+{
+    while(value >= 0x80)
+    {
+        *(data++) = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+
+    *(data++) = value;
+    return data;
+}
+
+
+static inline const uint8_t *varint_read(const uint8_t *data, uint32_t *value)
+{
+    uint32_t result = 0;
+    int shift = 0;
+
+    while(*data & 0x80)
+    {
+        result |= (uint32_t) (*(data++) & 0x7f) << shift;
+        shift += 7;
+    }
+
+    *value = result | (uint32_t) *(data++) << shift;
+    return data;
+}
+
+
+static inline void entry_count(BuildContext *context, BuildEntry *entry, int32_t id)
+{
+    entry->count++;
+    entry->size += varint_size(id - entry->lastId);
+    entry->lastId = id;
+}
+
+
+static inline void entry_fill(BuildContext *context, BuildEntry *entry, int32_t id)
+{
+    if(entry->dense)
+    {
+        uint64_t *words = (uint64_t *) (context->data + entry->offset);
+        words[id >> 6] |= UINT64_C(1) << (id & 0x3f);
+    }
+    else
+    {
+        uint8_t *data = context->data + entry->offset + entry->cursor;
+        entry->cursor = varint_write(data, id - entry->lastId) - (context->data + entry->offset);
+        entry->lastId = id;
+    }
+}
+
+
+static void count_callback(BuildContext *context, int32_t id, IntegerFingerprint fp)
+{
+    for(size_t i = 0; i < fp.size; i++)
+    {
+        uint32_t term = fp.data[i];
+        bool found;
+
+        BuildEntry *entry = hash_search(context->terms, &term, HASH_ENTER, &found);
+
+        if(!found)
+        {
+            entry->count = 0;
+            entry->lastId = -1;
+            entry->size = 0;
+        }
+
+        entry_count(context, entry, id);
+    }
+
+    context->postingCount += fp.size;
+}
+
+
+static void fill_callback(BuildContext *context, int32_t id, IntegerFingerprint fp)
+{
+    context->documents[id >> 6] |= UINT64_C(1) << (id & 0x3f);
+
+    for(size_t i = 0; i < fp.size; i++)
+    {
+        uint32_t term = fp.data[i];
+
+        BuildEntry *entry = hash_search(context->terms, &term, HASH_FIND, NULL);
+
+        if(unlikely(entry == NULL))
+            elog(ERROR, "%s: unexpected fingerprint", __func__);
+
+        entry_fill(context, entry, id);
+    }
+}
+
+
+static void for_each_fingerprint(const char *query, BuildContext *context, FingerprintCallback callback)
+{
+    char isNullFlag;
+
+    Portal moleculeCursor = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, false,
+            CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+    while(true)
+    {
+        SPI_cursor_fetch(moleculeCursor, true, FETCH_SIZE);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+            elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+        if(SPI_processed == 0)
+            break;
+
+
+        for(size_t i = 0; i < SPI_processed; i++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            HeapTuple tuple = SPI_tuptable->vals[i];
+
+            int32_t id = DatumGetInt32(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            Datum moleculeDatum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *moleculeData = DatumGetByteaP(moleculeDatum);
+
+            Molecule molecule;
+            molecule_simple_init(&molecule, (uint8_t *) VARDATA(moleculeData));
+
+            IntegerFingerprint fp = integer_substructure_fingerprint_get(&molecule);
+            callback(context, id, fp);
+
+            integer_fingerprint_free(fp);
+            molecule_simple_free(&molecule);
+
+            if((void *) moleculeData != DatumGetPointer(moleculeDatum))
+                pfree(moleculeData);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(moleculeCursor);
+}
+
+
+static void added_callback(BuildContext *context, int32_t id, IntegerFingerprint fp)
+{
+    context->documents[id >> 6] |= UINT64_C(1) << (id & 0x3f);
+
+    for(size_t i = 0; i < fp.size; i++)
+    {
+        uint32_t term = fp.data[i];
+        bool found;
+
+        AddedPosting *entry = hash_search(context->terms, &term, HASH_ENTER, &found);
+
+        if(!found)
+        {
+            entry->count = 0;
+            entry->capacity = 16;
+            entry->ids = palloc(entry->capacity * sizeof(int32_t));
+        }
+        else if(entry->count == entry->capacity)
+        {
+            entry->capacity *= 2;
+            entry->ids = repalloc_huge(entry->ids, entry->capacity * sizeof(int32_t));
+        }
+
+        entry->ids[entry->count++] = id;
+    }
+}
+
+
+static int entry_cmp(const void *a, const void *b)
+{
+    uint32_t x = (*(BuildEntry * const *) a)->fp;
+    uint32_t y = (*(BuildEntry * const *) b)->fp;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static int added_cmp(const void *a, const void *b)
+{
+    uint32_t x = (*(AddedPosting * const *) a)->fp;
+    uint32_t y = (*(AddedPosting * const *) b)->fp;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static int64_t get_molecule_count(void)
+{
+    if(unlikely(SPI_execute("select coalesce(max(id) + 1, 0) from " MOLECULES_TABLE, false, FETCH_ALL) != SPI_OK_SELECT))
+        elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+    if(SPI_processed != 1 || SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1)
+        elog(ERROR, "%s: SPI_execute() failed", __func__);
+
+    char isNullFlag;
+    Datum moleculeCountDatum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNullFlag);
+
+    if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+        elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+    int64_t moleculeCount = DatumGetInt32(moleculeCountDatum);
+
+    SPI_freetuptable(SPI_tuptable);
+
+    return moleculeCount;
+}
+
+
+/*
+ * Assigns the data offsets to the counted entries (sorted by terms), maps the index file of the resulting size
+ * and writes everything except the documents and the posting data, which are filled through the context.
+ */
+static void *posting_index_allocate(int indexFd, BuildContext *context, BuildEntry **entries, uint64_t termCount,
+        uint64_t moleculeCount, uint64_t *size, uint64_t *denseCount)
+{
+    uint64_t termsOffset = sizeof(PostingIndexHeader);
+    uint64_t entriesOffset = ALIGN8(termsOffset + termCount * sizeof(uint32_t));
+    uint64_t documentsOffset = entriesOffset + termCount * sizeof(PostingIndexEntry);
+    uint64_t dataOffset = documentsOffset + context->words * sizeof(uint64_t);
+    uint64_t dataSize = 0;
+
+    *denseCount = 0;
+
+    for(uint64_t i = 0; i < termCount; i++)
+    {
+        BuildEntry *entry = entries[i];
+
+        entry->dense = entry->size >= context->words * sizeof(uint64_t);
+        entry->lastId = -1;
+        entry->cursor = 0;
+
+        if(entry->dense)
+        {
+            entry->size = context->words * sizeof(uint64_t);
+            dataSize = ALIGN8(dataSize);
+            (*denseCount)++;
+        }
+
+        entry->offset = dataSize;
+        dataSize += entry->size;
+    }
+
+    *size = dataOffset + dataSize;
+
+    if(ftruncate(indexFd, *size) != 0)
+        elog(ERROR, "%s: ftruncate() failed", __func__);
+
+    void *address = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+
+    if(unlikely(address == MAP_FAILED))
+        elog(ERROR, "%s: mmap() failed", __func__);
+
+
+    PostingIndexHeader *header = (PostingIndexHeader *) address;
+    header->magic = POSTING_INDEX_MAGIC;
+    header->reserved = 0;
+    header->termCount = termCount;
+    header->moleculeCount = moleculeCount;
+    header->postingCount = context->postingCount;
+
+    uint32_t *terms = (uint32_t *) ((uint8_t *) address + termsOffset);
+    PostingIndexEntry *items = (PostingIndexEntry *) ((uint8_t *) address + entriesOffset);
+
+    for(uint64_t i = 0; i < termCount; i++)
+    {
+        terms[i] = entries[i]->fp;
+        items[i].offset = entries[i]->offset;
+        items[i].size = entries[i]->size;
+        items[i].count = entries[i]->count;
+        items[i].dense = entries[i]->dense;
+    }
+
+    context->documents = (uint64_t *) ((uint8_t *) address + documentsOffset);
+    context->data = (uint8_t *) address + dataOffset;
+
+    return address;
+}
+
+
+static void *posting_index_build_full(int indexFd, int64_t moleculeCount, uint64_t *size, uint64_t *termCount,
+        uint64_t *denseCount, uint64_t *postingCount)
+{
+    HASHCTL ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(uint32_t);
+    ctl.entrysize = sizeof(BuildEntry);
+    ctl.hcxt = CurrentMemoryContext;
+
+    BuildContext context;
+    context.terms = hash_create("sachem posting index terms", 1 << 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    context.postingCount = 0;
+    context.words = (moleculeCount + 63) / 64;
+
+
+    /* first pass: count the postings and their encoded sizes */
+    for_each_fingerprint("select id, molecule from " MOLECULES_TABLE " order by id", &context, count_callback);
+
+    *termCount = hash_get_num_entries(context.terms);
+    BuildEntry **entries = palloc_extended(*termCount * sizeof(BuildEntry *) + 1, MCXT_ALLOC_HUGE);
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, context.terms);
+
+    BuildEntry *entry;
+    uint64_t position = 0;
+
+    while((entry = hash_seq_search(&status)) != NULL)
+        entries[position++] = entry;
+
+    qsort(entries, *termCount, sizeof(BuildEntry *), entry_cmp);
+
+    void *address = posting_index_allocate(indexFd, &context, entries, *termCount, moleculeCount, size, denseCount);
+
+    pfree(entries);
+
+
+    /* second pass: fill the postings */
+    PG_TRY();
+    {
+        for_each_fingerprint("select id, molecule from " MOLECULES_TABLE " order by id", &context, fill_callback);
+    }
+    PG_CATCH();
+    {
+        munmap(address, *size);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    hash_destroy(context.terms);
+
+    *postingCount = context.postingCount;
+    return address;
+}
+
+
+static inline void posting_iterator_init(PostingIterator *iterator, const PostingIndex *index,
+        const PostingIndexEntry *entry)
+{
+    iterator->words = NULL;
+    iterator->data = NULL;
+    iterator->remaining = 0;
+    iterator->id = -1;
+
+    if(entry == NULL)
+        return;
+
+    if(entry->dense)
+    {
+        iterator->words = (const uint64_t *) (index->data + entry->offset);
+        iterator->length = (index->moleculeCount + 63) / 64;
+        iterator->position = 0;
+        iterator->word = iterator->length > 0 ? iterator->words[0] : 0;
+    }
+    else
+    {
+        iterator->data = index->data + entry->offset;
+        iterator->remaining = entry->count;
+    }
+}
+
+
+static inline bool posting_iterator_next(PostingIterator *iterator, int32_t *id)
+{
+    if(iterator->words != NULL)
+    {
+        while(iterator->word == 0)
+        {
+            if(++iterator->position >= iterator->length)
+                return false;
+
+            iterator->word = iterator->words[iterator->position];
+        }
+
+        *id = (iterator->position << 6) + __builtin_ctzll(iterator->word);
+        iterator->word &= iterator->word - 1;
+        return true;
+    }
+
+    if(iterator->remaining == 0)
+        return false;
+
+    uint32_t delta;
+    iterator->data = varint_read(iterator->data, &delta);
+    iterator->id += delta;
+    iterator->remaining--;
+
+    *id = iterator->id;
+    return true;
+}
+
+
+/*
+ * Passes the ids of the merged posting list to the callback in ascending order: the ids of the previous list
+ * that were not changed by the sync together with the ids of the added molecules.
+ */
+static void merge_posting(BuildContext *context, const PostingIndex *previous, BitSet *changed, MergeEntry *entry,
+        PostingCallback callback)
+{
+    const AddedPosting *added = entry->added;
+    uint32_t addedCount = added != NULL ? added->count : 0;
+    uint32_t position = 0;
+
+    PostingIterator iterator;
+    posting_iterator_init(&iterator, previous, entry->previous);
+
+    int32_t id;
+    bool hasPrevious = posting_iterator_next(&iterator, &id);
+
+    while(hasPrevious || position < addedCount)
+    {
+        if(hasPrevious && (position == addedCount || id < added->ids[position]))
+        {
+            if(!bitset_get(changed, id))
+                callback(context, &entry->build, id);
+
+            hasPrevious = posting_iterator_next(&iterator, &id);
+        }
+        else
+        {
+            callback(context, &entry->build, added->ids[position++]);
+        }
+    }
+}
+
+
+/*
+ * The index of the previous version is merged with the molecules changed by the sync, so only the added
+ * molecules have to be loaded and fingerprinted. The changed ids are taken from the audit table, hence the
+ * index has to be updated before the audit table is cleared.
+ */
+static void *posting_index_build_update(int indexFd, const PostingIndex *previous, int64_t moleculeCount,
+        uint64_t *size, uint64_t *termCount, uint64_t *denseCount, uint64_t *postingCount)
+{
+    char isNullFlag;
+    int64_t changedSize = Max(moleculeCount, (int64_t) previous->moleculeCount);
+    uint64_t previousWords = (previous->moleculeCount + 63) / 64;
+
+    BitSet changed;
+    bitset_init_empty(&changed, changedSize);
+
+    Portal auditCursor = SPI_cursor_open_with_args(NULL, "select id from " AUDIT_TABLE, 0, NULL, NULL, NULL, false,
+            CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+    while(true)
+    {
+        SPI_cursor_fetch(auditCursor, true, FETCH_SIZE);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 1))
+            elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+        if(SPI_processed == 0)
+            break;
+
+        for(size_t i = 0; i < SPI_processed; i++)
+        {
+            int32_t id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isNullFlag));
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            if(id >= 0 && id < changedSize)
+                bitset_set(&changed, id);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(auditCursor);
+
+
+    /* collect the postings of the added molecules */
+    HASHCTL ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(uint32_t);
+    ctl.entrysize = sizeof(AddedPosting);
+    ctl.hcxt = CurrentMemoryContext;
+
+    BuildContext context;
+    context.terms = hash_create("sachem posting index added terms", 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    context.postingCount = 0;
+    context.words = (moleculeCount + 63) / 64;
+    context.documents = palloc_extended(context.words * sizeof(uint64_t) + 1, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+
+    for_each_fingerprint("select mol.id, mol.molecule from " MOLECULES_TABLE " mol, " AUDIT_TABLE " aud "
+            "where mol.id = aud.id order by mol.id", &context, added_callback);
+
+    uint64_t addedCount = hash_get_num_entries(context.terms);
+    AddedPosting **added = palloc_extended(addedCount * sizeof(AddedPosting *) + 1, MCXT_ALLOC_HUGE);
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, context.terms);
+
+    AddedPosting *posting;
+    uint64_t position = 0;
+
+    while((posting = hash_seq_search(&status)) != NULL)
+        added[position++] = posting;
+
+    qsort(added, addedCount, sizeof(AddedPosting *), added_cmp);
+
+
+    /* merge the sorted terms of both sources and count the merged postings */
+    MergeEntry *merged = palloc_extended((previous->termCount + addedCount) * sizeof(MergeEntry) + 1, MCXT_ALLOC_HUGE);
+    uint64_t mergedCount = 0;
+    uint64_t p = 0;
+    uint64_t a = 0;
+
+    while(p < previous->termCount || a < addedCount)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        MergeEntry *entry = merged + mergedCount;
+        entry->previous = NULL;
+        entry->added = NULL;
+
+        if(a == addedCount || (p < previous->termCount && previous->terms[p] < added[a]->fp))
+        {
+            entry->build.fp = previous->terms[p];
+            entry->previous = previous->entries + p++;
+        }
+        else if(p == previous->termCount || added[a]->fp < previous->terms[p])
+        {
+            entry->build.fp = added[a]->fp;
+            entry->added = added[a++];
+        }
+        else
+        {
+            entry->build.fp = previous->terms[p];
+            entry->previous = previous->entries + p++;
+            entry->added = added[a++];
+        }
+
+        entry->build.count = 0;
+        entry->build.lastId = -1;
+        entry->build.size = 0;
+
+        merge_posting(&context, previous, &changed, entry, entry_count);
+
+        if(entry->build.count > 0)
+        {
+            context.postingCount += entry->build.count;
+            mergedCount++;
+        }
+    }
+
+    *termCount = mergedCount;
+    BuildEntry **entries = palloc_extended(mergedCount * sizeof(BuildEntry *) + 1, MCXT_ALLOC_HUGE);
+
+    for(uint64_t i = 0; i < mergedCount; i++)
+        entries[i] = &merged[i].build;
+
+    uint64_t *addedDocuments = context.documents;
+    void *address = posting_index_allocate(indexFd, &context, entries, mergedCount, moleculeCount, size, denseCount);
+
+    pfree(entries);
+
+
+    /* fill the merged postings and the bitmap of indexed molecules */
+    for(uint64_t i = 0; i < context.words; i++)
+    {
+        uint64_t word = i < previousWords ? previous->documents[i] & ~changed.words[i] : 0;
+        context.documents[i] = word | addedDocuments[i];
+    }
+
+    for(uint64_t i = 0; i < mergedCount; i++)
+        merge_posting(&context, previous, &changed, merged + i, entry_fill);
+
+
+    for(uint64_t i = 0; i < addedCount; i++)
+        pfree(added[i]->ids);
+
+    hash_destroy(context.terms);
+    pfree(addedDocuments);
+    pfree(merged);
+    pfree(added);
+    pfree(changed.words);
+
+    *postingCount = context.postingCount;
+    return address;
+}
+
+
+/*
+ * The index stores doc-only postings of the unfolded substructure fingerprint over molecule ids. The file
+ * consists of the header, the sorted array of 32-bit terms, the array of PostingIndexEntry items, the bitmap
+ * of all indexed molecules and the posting data. A posting list is stored either as a bitmap over molecule ids
+ * or as delta encoded varints, whichever is smaller. If the index of the previous version is given, it is
+ * updated by the changes recorded in the audit table instead of being built from all molecules.
+ */
+static void posting_index_write(const char *indexFilePath, const PostingIndex *previous, bool verbose)
+{
+    int indexFd = open(indexFilePath, O_EXCL | O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    if(indexFd == -1)
+        elog(ERROR, "%s: open() failed", __func__);
+
+    void *address = MAP_FAILED;
+    uint64_t size = 0;
+
+    PG_TRY();
+    {
+        int64_t moleculeCount = get_molecule_count();
+        uint64_t termCount;
+        uint64_t denseCount;
+        uint64_t postingCount;
+
+        if(previous != NULL)
+            address = posting_index_build_update(indexFd, previous, moleculeCount, &size, &termCount, &denseCount,
+                    &postingCount);
+        else
+            address = posting_index_build_full(indexFd, moleculeCount, &size, &termCount, &denseCount, &postingCount);
+
+
+        if(unlikely(munmap(address, size) < 0))
+            elog(ERROR, "%s: munmap() failed", __func__);
+
+        address = MAP_FAILED;
+
+        int fd = indexFd;
+        indexFd = -1;
+
+        if(close(fd) != 0)
+            elog(ERROR, "%s: close() failed", __func__);
+
+        if(verbose)
+            elog(NOTICE, "posting index: %lu terms (%lu dense), %lu postings, %lu bytes%s", termCount, denseCount,
+                    postingCount, size, previous != NULL ? " (updated)" : "");
+    }
+    PG_CATCH();
+    {
+        if(address != MAP_FAILED)
+            munmap(address, size);
+
+        if(indexFd != -1)
+            close(indexFd);
+
+        unlink(indexFilePath);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+}
+
+
+void posting_index_build(const char *indexFilePath, bool verbose)
+{
+    posting_index_write(indexFilePath, NULL, verbose);
+}
+
+
+void sachem_generate_posting_index(int indexNumber, int previousNumber, bool verbose)
+{
+    char *indexFilePath = get_index_path(POSTING_INDEX_PREFIX, POSTING_INDEX_SUFFIX, indexNumber);
+
+    PostingIndex previous;
+    posting_index_init(&previous);
+
+    if(previousNumber < 0 || !posting_index_open(&previous, previousNumber))
+    {
+        posting_index_write(indexFilePath, NULL, verbose);
+        return;
+    }
+
+    PG_TRY();
+    {
+        posting_index_write(indexFilePath, &previous, verbose);
+    }
+    PG_CATCH();
+    {
+        posting_index_close(&previous);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    posting_index_close(&previous);
+}
+
+
+void posting_index_init(PostingIndex *index)
+{
+    index->address = MAP_FAILED;
+    index->size = 0;
+    index->termCount = 0;
+    index->moleculeCount = 0;
+}
+
+
+bool posting_index_open(PostingIndex *index, int indexNumber)
+{
+    return posting_index_map(index, get_index_path(POSTING_INDEX_PREFIX, POSTING_INDEX_SUFFIX, indexNumber));
+}
+
+
+bool posting_index_map(PostingIndex *index, const char *indexFilePath)
+{
+    posting_index_close(index);
+
+    int fd = -1;
+
+    PG_TRY();
+    {
+        if((fd = open(indexFilePath, O_RDONLY, 0)) < 0 && errno != ENOENT)
+            elog(ERROR, "%s: open() failed", __func__);
+
+        if(fd >= 0)
+        {
+            struct stat st;
+
+            if(fstat(fd, &st) < 0)
+                elog(ERROR, "%s: fstat() failed", __func__);
+
+            index->size = st.st_size;
+
+            if(unlikely((index->address = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+                elog(ERROR, "%s: mmap() failed", __func__);
+
+            if(unlikely(close(fd) < 0))
+                elog(ERROR, "%s: close() failed", __func__);
+
+            if(unlikely(((PostingIndexHeader *) index->address)->magic != POSTING_INDEX_MAGIC))
+                elog(ERROR, "%s: unsupported posting index format", __func__);
+        }
+    }
+    PG_CATCH();
+    {
+        if(index->address != MAP_FAILED)
+            munmap(index->address, index->size);
+
+        index->address = MAP_FAILED;
+
+        if(fd != -1)
+            close(fd);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    if(fd < 0)
+        return false;
+
+
+    const PostingIndexHeader *header = (const PostingIndexHeader *) index->address;
+    index->termCount = header->termCount;
+    index->moleculeCount = header->moleculeCount;
+
+    uint64_t entriesOffset = ALIGN8(sizeof(PostingIndexHeader) + index->termCount * sizeof(uint32_t));
+    uint64_t documentsOffset = entriesOffset + index->termCount * sizeof(PostingIndexEntry);
+    uint64_t dataOffset = documentsOffset + (index->moleculeCount + 63) / 64 * sizeof(uint64_t);
+
+    index->terms = (const uint32_t *) (header + 1);
+    index->entries = (const PostingIndexEntry *) ((uint8_t *) index->address + entriesOffset);
+    index->documents = (const uint64_t *) ((uint8_t *) index->address + documentsOffset);
+    index->data = (const uint8_t *) index->address + dataOffset;
+
+    return true;
+}
+
+
+void posting_index_close(PostingIndex *index)
+{
+    if(likely(index->address != MAP_FAILED))
+    {
+        if(unlikely(munmap(index->address, index->size) < 0))
+            elog(ERROR, "%s: munmap() failed", __func__);
+
+        index->address = MAP_FAILED;
+    }
+}
+
+
+static const PostingIndexEntry *posting_index_find(const PostingIndex *index, uint32_t term)
+{
+    uint64_t low = 0;
+    uint64_t high = index->termCount;
+
+    while(low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if(index->terms[middle] < term)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if(low < index->termCount && index->terms[low] == term)
+        return index->entries + low;
+
+    return NULL;
+}
+
+
+static int posting_cmp(const void *a, const void *b)
+{
+    uint32_t x = (*(const PostingIndexEntry * const *) a)->count;
+    uint32_t y = (*(const PostingIndexEntry * const *) b)->count;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static inline size_t posting_decode_bitmap(const uint64_t *words, uint64_t length, int32_t *ids)
+{
+    size_t count = 0;
+
+    for(uint64_t i = 0; i < length; i++)
+    {
+        uint64_t word = words[i];
+
+        while(word)
+        {
+            ids[count++] = (i << 6) + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+    }
+
+    return count;
+}
+
+
+/*
+ * The postings are intersected from the shortest one. Dense postings are applied by bit tests, the others
+ * by merging the sorted candidates with the decoded list.
+ */
+PostingResultSet posting_index_search(const PostingIndex *index, IntegerFingerprint fp)
+{
+    PostingResultSet resultSet = { .ids = NULL, .count = 0, .position = 0 };
+    uint64_t words = (index->moleculeCount + 63) / 64;
+
+    if(fp.size == 0)
+    {
+        resultSet.ids = palloc_extended(index->moleculeCount * sizeof(int32_t) + 1, MCXT_ALLOC_HUGE);
+        resultSet.count = posting_decode_bitmap(index->documents, words, resultSet.ids);
+        return resultSet;
+    }
+
+
+    const PostingIndexEntry **postings = palloc(fp.size * sizeof(PostingIndexEntry *));
+
+    for(size_t i = 0; i < fp.size; i++)
+    {
+        postings[i] = posting_index_find(index, fp.data[i]);
+
+        if(postings[i] == NULL)
+        {
+            pfree(postings);
+            return resultSet;
+        }
+    }
+
+    qsort(postings, fp.size, sizeof(PostingIndexEntry *), posting_cmp);
+
+
+    const PostingIndexEntry *first = postings[0];
+    int32_t *ids = palloc_extended(first->count * sizeof(int32_t) + 1, MCXT_ALLOC_HUGE);
+    size_t count = 0;
+
+    if(first->dense)
+    {
+        count = posting_decode_bitmap((const uint64_t *) (index->data + first->offset), words, ids);
+    }
+    else
+    {
+        const uint8_t *data = index->data + first->offset;
+        int32_t id = -1;
+
+        for(uint32_t i = 0; i < first->count; i++)
+        {
+            uint32_t delta;
+            data = varint_read(data, &delta);
+            id += delta;
+            ids[count++] = id;
+        }
+    }
+
+
+    for(size_t p = 1; p < fp.size && count > 0; p++)
+    {
+        const PostingIndexEntry *posting = postings[p];
+        size_t found = 0;
+
+        if(posting->dense)
+        {
+            const uint64_t *bitmap = (const uint64_t *) (index->data + posting->offset);
+
+            for(size_t i = 0; i < count; i++)
+                if(bitmap[ids[i] >> 6] & (UINT64_C(1) << (ids[i] & 0x3f)))
+                    ids[found++] = ids[i];
+        }
+        else
+        {
+            const uint8_t *data = index->data + posting->offset;
+            uint32_t remaining = posting->count;
+            int32_t id = -1;
+
+            for(size_t i = 0; i < count; i++)
+            {
+                while(id < ids[i] && remaining > 0)
+                {
+                    uint32_t delta;
+                    data = varint_read(data, &delta);
+                    id += delta;
+                    remaining--;
+                }
+
+                if(id < ids[i])
+                    break;
+
+                if(id == ids[i])
+                    ids[found++] = ids[i];
+            }
+        }
+
+        count = found;
+    }
+
+    pfree(postings);
+
+    resultSet.ids = ids;
+    resultSet.count = count;
+    return resultSet;
+}
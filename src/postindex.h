@@ -0,0 +1,82 @@
+#ifndef POSTINDEX_H_
+#define POSTINDEX_H_
+
+#include <postgres.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "fingerprints/fingerprint.h"
+
+
+#define POSTING_INDEX_PREFIX          "sachem_postings"
+#define POSTING_INDEX_SUFFIX          ".idx"
+#define POSTING_INDEX_MAGIC           0x58495053
+
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t termCount;
+    uint64_t moleculeCount;
+    uint64_t postingCount;
+} PostingIndexHeader;
+
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t count;
+    uint32_t dense;
+} PostingIndexEntry;
+
+
+typedef struct
+{
+    uint64_t *address;
+    size_t size;
+    uint64_t termCount;
+    uint64_t moleculeCount;
+    const uint32_t *terms;
+    const PostingIndexEntry *entries;
+    const uint64_t *documents;
+    const uint8_t *data;
+} PostingIndex;
+
+
+typedef struct
+{
+    int32_t *ids;
+    size_t count;
+    size_t position;
+} PostingResultSet;
+
+
+void sachem_generate_posting_index(int indexNumber, int previousNumber, bool verbose);
+void posting_index_build(const char *indexFilePath, bool verbose);
+
+void posting_index_init(PostingIndex *index);
+bool posting_index_open(PostingIndex *index, int indexNumber);
+bool posting_index_map(PostingIndex *index, const char *indexFilePath);
+void posting_index_close(PostingIndex *index);
+PostingResultSet posting_index_search(const PostingIndex *index, IntegerFingerprint fp);
+
+
+static inline bool posting_index_is_open(const PostingIndex *index)
+{
+    return index->address != MAP_FAILED;
+}
+
+
+static inline size_t posting_index_get(PostingResultSet *resultSet, int32_t *buffer, size_t size)
+{
+    size_t count = 0;
+
+    while(count < size && resultSet->position < resultSet->count)
+        buffer[count++] = resultSet->ids[resultSet->position++];
+
+    return count;
+}
+
+#endif /* POSTINDEX_H_ */
@@ -0,0 +1,677 @@
+#include <postgres.h>
+#include <access/hash.h>
+#include <lib/stringinfo.h>
+#include <miscadmin.h>
+#include <port/atomics.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/hsearch.h>
+#include <ctype.h>
+#include "sachem.h"
+#include "resultcache.h"
+
+
+#define RESULT_CACHE_NAME             "sachem result cache"
+#define RESULT_CACHE_LOOKUP_NAME      "sachem result cache lookup"
+#define RESULT_CACHE_DATABASE_NAME    "sachem result cache databases"
+#define RESULT_CACHE_TRANCHE          "sachem"
+#define RESULT_CACHE_MAX_ENTRY_PART   4
+#define RESULT_CACHE_MAX_DATABASES    64
+#define NO_CHUNK                      -1
+
+
+/*
+ * Identifies the entries of a key: the cache is shared by all databases of the cluster and each database has its
+ * own index numbers. Different keys of the same hash share the tag, so only the first of them is cached.
+ */
+typedef struct
+{
+    Oid databaseId;
+    int32_t indexId;
+    uint32_t hash;
+} ResultCacheTag;
+
+
+typedef struct
+{
+    ResultCacheTag tag;
+    int32_t slot;
+} ResultCacheLookup;
+
+
+typedef struct
+{
+    Oid databaseId;
+    int32_t indexId;
+} ResultCacheDatabase;
+
+
+typedef struct
+{
+    ResultCacheTag tag;
+    pg_atomic_uint64 lastUsed;
+    uint64_t serial;
+    uint64_t family;
+    uint32_t keySize;
+    uint32_t querySize;
+    uint32_t dataSize;
+    int32_t firstChunk;
+} ResultCacheEntry;
+
+
+/*
+ * The cache is a fixed area of the main shared memory, so it is available only when the library is loaded by
+ * shared_preload_libraries. The data of the entries are stored in chains of fixed size chunks, the least recently
+ * used entries are evicted when there are not enough free chunks. Each entry belongs to the database and the index
+ * number it has been computed from; the entries of a database are dropped as soon as a search sees a newer index
+ * number of that database. The entries are found through a shared hash table of their tags, so the searches hold
+ * the lock in the shared mode and only refresh the atomic use stamp of the entry they read.
+ */
+typedef struct
+{
+    LWLock *lock;
+    int32_t chunkCount;
+    int32_t freeChunks;
+    int32_t freeList;
+    pg_atomic_uint64 clock;
+    uint64_t serial;
+} ResultCacheHeader;
+
+
+static shmem_startup_hook_type prevShmemStartupHook = NULL;
+static ResultCacheHeader *cache = NULL;
+static ResultCacheEntry *entries;
+static int32_t *nextChunk;
+static char *chunks;
+static HTAB *lookups;
+static HTAB *databases;
+
+
+static int32_t result_cache_chunk_count(void)
+{
+    return (int32_t) ((int64_t) resultCacheSize * 1024 / RESULT_CACHE_CHUNK_SIZE);
+}
+
+
+static Size result_cache_shmem_size(int32_t chunkCount)
+{
+    Size size = MAXALIGN(sizeof(ResultCacheHeader));
+    size = add_size(size, MAXALIGN(mul_size(chunkCount, sizeof(ResultCacheEntry))));
+    size = add_size(size, MAXALIGN(mul_size(chunkCount, sizeof(int32_t))));
+    size = add_size(size, mul_size(chunkCount, RESULT_CACHE_CHUNK_SIZE));
+
+    return size;
+}
+
+
+static void result_cache_shmem_startup(void)
+{
+    if(prevShmemStartupHook)
+        prevShmemStartupHook();
+
+    int32_t chunkCount = result_cache_chunk_count();
+    bool found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    ResultCacheHeader *header = ShmemInitStruct(RESULT_CACHE_NAME, result_cache_shmem_size(chunkCount), &found);
+
+    char *address = (char *) header + MAXALIGN(sizeof(ResultCacheHeader));
+    entries = (ResultCacheEntry *) address;
+    address += MAXALIGN(chunkCount * sizeof(ResultCacheEntry));
+    nextChunk = (int32_t *) address;
+    address += MAXALIGN(chunkCount * sizeof(int32_t));
+    chunks = address;
+
+    if(!found)
+    {
+        header->lock = &(GetNamedLWLockTranche(RESULT_CACHE_TRANCHE))->lock;
+        header->chunkCount = chunkCount;
+        header->freeChunks = chunkCount;
+        header->freeList = chunkCount > 0 ? 0 : NO_CHUNK;
+        pg_atomic_init_u64(&header->clock, 0);
+        header->serial = 0;
+
+        for(int32_t i = 0; i < chunkCount; i++)
+        {
+            entries[i].firstChunk = NO_CHUNK;
+            pg_atomic_init_u64(&entries[i].lastUsed, 0);
+            nextChunk[i] = i + 1 < chunkCount ? i + 1 : NO_CHUNK;
+        }
+    }
+
+    HASHCTL info;
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(ResultCacheTag);
+    info.entrysize = sizeof(ResultCacheLookup);
+    lookups = ShmemInitHash(RESULT_CACHE_LOOKUP_NAME, chunkCount, chunkCount, &info, HASH_ELEM | HASH_BLOBS);
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(Oid);
+    info.entrysize = sizeof(ResultCacheDatabase);
+    databases = ShmemInitHash(RESULT_CACHE_DATABASE_NAME, RESULT_CACHE_MAX_DATABASES, RESULT_CACHE_MAX_DATABASES,
+            &info, HASH_ELEM | HASH_BLOBS);
+
+    cache = header;
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+void result_cache_request(void)
+{
+    int32_t chunkCount = result_cache_chunk_count();
+
+    if(chunkCount == 0)
+        return;
+
+    RequestAddinShmemSpace(result_cache_shmem_size(chunkCount));
+    RequestAddinShmemSpace(hash_estimate_size(chunkCount, sizeof(ResultCacheLookup)));
+    RequestAddinShmemSpace(hash_estimate_size(RESULT_CACHE_MAX_DATABASES, sizeof(ResultCacheDatabase)));
+    RequestNamedLWLockTranche(RESULT_CACHE_TRANCHE, 1);
+
+    prevShmemStartupHook = shmem_startup_hook;
+    shmem_startup_hook = result_cache_shmem_startup;
+}
+
+
+bool result_cache_enabled(void)
+{
+    return cache != NULL;
+}
+
+
+static void result_cache_entry_free(ResultCacheEntry *entry)
+{
+    int32_t chunk = entry->firstChunk;
+
+    while(chunk != NO_CHUNK)
+    {
+        int32_t next = nextChunk[chunk];
+
+        nextChunk[chunk] = cache->freeList;
+        cache->freeList = chunk;
+        cache->freeChunks++;
+
+        chunk = next;
+    }
+
+    hash_search(lookups, &entry->tag, HASH_REMOVE, NULL);
+    entry->firstChunk = NO_CHUNK;
+}
+
+
+static void result_cache_clear(Oid databaseId)
+{
+    for(int32_t i = 0; i < cache->chunkCount; i++)
+        if(entries[i].firstChunk != NO_CHUNK && entries[i].tag.databaseId == databaseId)
+            result_cache_entry_free(&entries[i]);
+}
+
+
+static inline void result_cache_touch(ResultCacheEntry *entry)
+{
+    pg_atomic_write_u64(&entry->lastUsed, pg_atomic_add_fetch_u64(&cache->clock, 1));
+}
+
+
+static void result_cache_chunks_read(int32_t chunk, char *buffer, size_t size)
+{
+    while(size > 0)
+    {
+        size_t length = Min(size, RESULT_CACHE_CHUNK_SIZE);
+        memcpy(buffer, chunks + (size_t) chunk * RESULT_CACHE_CHUNK_SIZE, length);
+
+        buffer += length;
+        size -= length;
+        chunk = nextChunk[chunk];
+    }
+}
+
+
+static void result_cache_chunks_write(int32_t *chunk, size_t *offset, const char *buffer, size_t size)
+{
+    while(size > 0)
+    {
+        if(*offset == RESULT_CACHE_CHUNK_SIZE)
+        {
+            *chunk = nextChunk[*chunk];
+            *offset = 0;
+        }
+
+        size_t length = Min(size, RESULT_CACHE_CHUNK_SIZE - *offset);
+        memcpy(chunks + (size_t) *chunk * RESULT_CACHE_CHUNK_SIZE + *offset, buffer, length);
+
+        buffer += length;
+        size -= length;
+        *offset += length;
+    }
+}
+
+
+static inline ResultCacheTag result_cache_tag(uint32_t hash, int32_t indexId)
+{
+    ResultCacheTag tag;
+
+    memset(&tag, 0, sizeof(tag));
+    tag.databaseId = MyDatabaseId;
+    tag.indexId = indexId;
+    tag.hash = hash;
+
+    return tag;
+}
+
+
+/*
+ * Returns the entry of the key and the index number in the current database, or NULL; the content of the entry is
+ * returned in the buffer if it is not NULL. The lock must be held.
+ */
+static ResultCacheEntry *result_cache_find(const ResultCacheKey *key, int32_t indexId, char **buffer)
+{
+    ResultCacheTag tag = result_cache_tag(key->hash, indexId);
+    ResultCacheLookup *lookup = hash_search(lookups, &tag, HASH_FIND, NULL);
+
+    if(lookup == NULL)
+        return NULL;
+
+    ResultCacheEntry *entry = &entries[lookup->slot];
+
+    if(entry->keySize != key->size)
+        return NULL;
+
+    size_t size = buffer != NULL ? entry->keySize + entry->querySize + entry->dataSize : entry->keySize;
+    char *data = palloc(size);
+
+    result_cache_chunks_read(entry->firstChunk, data, size);
+
+    if(memcmp(data, key->data, key->size) != 0)
+    {
+        pfree(data);
+        return NULL;
+    }
+
+    if(buffer != NULL)
+        *buffer = data;
+    else
+        pfree(data);
+
+    return entry;
+}
+
+
+/*
+ * Acquires the lock and returns whether the entries of the index number can be used in the current database. When
+ * the search sees a newer index number, the entries of the database are dropped and the lock is left exclusive.
+ */
+static bool result_cache_acquire(int32_t indexId, LWLockMode mode)
+{
+    LWLockAcquire(cache->lock, mode);
+
+    ResultCacheDatabase *database = hash_search(databases, &MyDatabaseId, HASH_FIND, NULL);
+
+    if(database != NULL && database->indexId >= indexId)
+        return database->indexId == indexId;
+
+    if(mode != LW_EXCLUSIVE)
+    {
+        LWLockRelease(cache->lock);
+        LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+    }
+
+    bool found;
+    database = hash_search(databases, &MyDatabaseId, HASH_ENTER_NULL, &found);
+
+    /* the cache is not used by more databases than it can track */
+    if(database == NULL)
+        return false;
+
+    if(!found || database->indexId < indexId)
+    {
+        result_cache_clear(MyDatabaseId);
+        database->indexId = indexId;
+    }
+
+    return database->indexId == indexId;
+}
+
+
+void result_cache_reset(void)
+{
+    if(cache == NULL)
+        return;
+
+    LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+    result_cache_clear(MyDatabaseId);
+    LWLockRelease(cache->lock);
+}
+
+
+ResultCacheKey result_cache_key(const char *function, const int32_t *options, int optionCount, const char *query,
+        size_t length)
+{
+    while(length > 0 && isspace((unsigned char) query[length - 1]))
+        length--;
+
+    size_t functionLength = strlen(function) + 1;
+    size_t optionsLength = optionCount * sizeof(int32_t);
+
+    ResultCacheKey key;
+    key.size = functionLength + optionsLength + length;
+    key.data = palloc(key.size);
+
+    memcpy(key.data, function, functionLength);
+    memcpy(key.data + functionLength, options, optionsLength);
+    memcpy(key.data + functionLength + optionsLength, query, length);
+
+    key.hash = DatumGetUInt32(hash_any((unsigned char *) key.data, key.size));
+
+    return key;
+}
+
+
+bool result_cache_lookup(const ResultCacheKey *key, int32_t indexId, ResultCacheReader *reader)
+{
+    if(cache == NULL)
+        return false;
+
+    ResultCacheEntry *entry = NULL;
+    char *buffer = NULL;
+
+    if(result_cache_acquire(indexId, LW_SHARED) && (entry = result_cache_find(key, indexId, &buffer)) != NULL)
+    {
+        result_cache_touch(entry);
+
+        reader->data = buffer + entry->keySize + entry->querySize;
+        reader->size = entry->dataSize;
+        reader->position = 0;
+        reader->lastId = 0;
+    }
+
+    LWLockRelease(cache->lock);
+
+    return entry != NULL;
+}
+
+
+void result_cache_store(const ResultCacheKey *key, int32_t indexId, ResultCacheWriter *writer)
+{
+    if(cache == NULL || !writer->valid)
+        return;
+
+    size_t size = key->size + writer->querySize + writer->data.len;
+    int32_t chunkCount = (size + RESULT_CACHE_CHUNK_SIZE - 1) / RESULT_CACHE_CHUNK_SIZE;
+
+    if(chunkCount > cache->chunkCount / RESULT_CACHE_MAX_ENTRY_PART)
+        return;
+
+    ResultCacheTag tag = result_cache_tag(key->hash, indexId);
+
+    /* the key is already stored, or another key of the same hash is */
+    if(result_cache_acquire(indexId, LW_EXCLUSIVE) && hash_search(lookups, &tag, HASH_FIND, NULL) == NULL)
+    {
+        ResultCacheEntry *entry = NULL;
+
+        while(true)
+        {
+            ResultCacheEntry *victim = NULL;
+            entry = NULL;
+
+            for(int32_t i = 0; i < cache->chunkCount; i++)
+            {
+                if(entries[i].firstChunk == NO_CHUNK)
+                    entry = &entries[i];
+                else if(victim == NULL ||
+                        pg_atomic_read_u64(&entries[i].lastUsed) < pg_atomic_read_u64(&victim->lastUsed))
+                    victim = &entries[i];
+            }
+
+            if(entry != NULL && cache->freeChunks >= chunkCount)
+                break;
+
+            result_cache_entry_free(victim);
+        }
+
+
+        entry->firstChunk = cache->freeList;
+
+        for(int32_t i = 0; i < chunkCount; i++)
+        {
+            int32_t chunk = cache->freeList;
+            cache->freeList = nextChunk[chunk];
+
+            if(i + 1 == chunkCount)
+                nextChunk[chunk] = NO_CHUNK;
+        }
+
+        cache->freeChunks -= chunkCount;
+
+        int32_t chunk = entry->firstChunk;
+        size_t offset = 0;
+
+        result_cache_chunks_write(&chunk, &offset, key->data, key->size);
+        result_cache_chunks_write(&chunk, &offset, (const char *) writer->query, writer->querySize);
+        result_cache_chunks_write(&chunk, &offset, writer->data.data, writer->data.len);
+
+        entry->tag = tag;
+        entry->serial = ++cache->serial;
+        entry->family = writer->family;
+        entry->keySize = key->size;
+        entry->querySize = writer->querySize;
+        entry->dataSize = writer->data.len;
+        result_cache_touch(entry);
+
+        ResultCacheLookup *lookup = hash_search(lookups, &tag, HASH_ENTER, NULL);
+        lookup->slot = entry - entries;
+    }
+
+    LWLockRelease(cache->lock);
+}
+
+
+int result_cache_find_queries(const char *function, uint64_t family, int32_t indexId, ResultCacheQuery *queries,
+        int limit)
+{
+    if(cache == NULL)
+        return 0;
+
+    size_t functionLength = strlen(function) + 1;
+    int count = 0;
+
+    bool current = result_cache_acquire(indexId, LW_SHARED);
+
+    /* the most recently used queries are collected, ordered from the smallest result */
+    ResultCacheEntry *candidates[limit];
+    uint64_t lastUsed[limit];
+
+    for(int32_t i = 0; i < cache->chunkCount && current; i++)
+    {
+        ResultCacheEntry *entry = &entries[i];
+
+        if(entry->firstChunk == NO_CHUNK || entry->querySize == 0 || entry->family != family ||
+                entry->tag.databaseId != MyDatabaseId || entry->tag.indexId != indexId ||
+                entry->keySize < functionLength)
+            continue;
+
+        uint64_t used = pg_atomic_read_u64(&entry->lastUsed);
+
+        if(count == limit)
+        {
+            int oldest = 0;
+
+            for(int c = 1; c < count; c++)
+                if(lastUsed[c] < lastUsed[oldest])
+                    oldest = c;
+
+            if(lastUsed[oldest] > used)
+                continue;
+
+            count--;
+            candidates[oldest] = candidates[count];
+            lastUsed[oldest] = lastUsed[count];
+        }
+
+        candidates[count] = entry;
+        lastUsed[count] = used;
+        count++;
+    }
+
+    for(int c = 1; c < count; c++)
+    {
+        ResultCacheEntry *entry = candidates[c];
+        int position = c;
+
+        for(; position > 0 && candidates[position - 1]->dataSize > entry->dataSize; position--)
+            candidates[position] = candidates[position - 1];
+
+        candidates[position] = entry;
+    }
+
+    int found = 0;
+
+    for(int c = 0; c < count; c++)
+    {
+        ResultCacheEntry *entry = candidates[c];
+        char *data = palloc(entry->keySize + entry->querySize);
+
+        result_cache_chunks_read(entry->firstChunk, data, entry->keySize + entry->querySize);
+
+        if(memcmp(data, function, functionLength) != 0)
+        {
+            pfree(data);
+            continue;
+        }
+
+        queries[found].slot = entry - entries;
+        queries[found].serial = entry->serial;
+        queries[found].molecule = (uint8_t *) data + entry->keySize;
+        queries[found].size = entry->querySize;
+        queries[found].dataSize = entry->dataSize;
+        found++;
+    }
+
+    LWLockRelease(cache->lock);
+
+    return found;
+}
+
+
+bool result_cache_fetch_query(const ResultCacheQuery *query, int32_t indexId, ResultCacheReader *reader)
+{
+    if(cache == NULL)
+        return false;
+
+    bool found = false;
+
+    LWLockAcquire(cache->lock, LW_SHARED);
+
+    ResultCacheEntry *entry = &entries[query->slot];
+
+    /* the entry may have been evicted and reused meanwhile */
+    if(entry->firstChunk != NO_CHUNK && entry->serial == query->serial && entry->tag.databaseId == MyDatabaseId &&
+            entry->tag.indexId == indexId)
+    {
+        size_t size = entry->keySize + entry->querySize + entry->dataSize;
+        char *buffer = palloc(size);
+
+        result_cache_chunks_read(entry->firstChunk, buffer, size);
+        result_cache_touch(entry);
+
+        reader->data = buffer + entry->keySize + entry->querySize;
+        reader->size = entry->dataSize;
+        reader->position = 0;
+        reader->lastId = 0;
+
+        found = true;
+    }
+
+    LWLockRelease(cache->lock);
+
+    return found;
+}
+
+
+void result_cache_writer_init(ResultCacheWriter *writer)
+{
+    initStringInfo(&writer->data);
+    writer->lastId = 0;
+    writer->valid = cache != NULL;
+    writer->family = 0;
+    writer->query = NULL;
+    writer->querySize = 0;
+}
+
+
+void result_cache_write_query(ResultCacheWriter *writer, uint64_t family, const uint8_t *molecule, size_t size)
+{
+    writer->family = family;
+    writer->query = molecule;
+    writer->querySize = size;
+}
+
+
+void result_cache_write_id(ResultCacheWriter *writer, int32_t id)
+{
+    if(!writer->valid)
+        return;
+
+    int64_t delta = (int64_t) id - writer->lastId;
+    uint64_t value = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+
+    while(value >= 0x80)
+    {
+        appendStringInfoChar(&writer->data, (char) (value | 0x80));
+        value >>= 7;
+    }
+
+    appendStringInfoChar(&writer->data, (char) value);
+
+    writer->lastId = id;
+}
+
+
+void result_cache_write_score(ResultCacheWriter *writer, float score)
+{
+    if(!writer->valid)
+        return;
+
+    appendBinaryStringInfo(&writer->data, (char *) &score, sizeof(float));
+}
+
+
+bool result_cache_read_id(ResultCacheReader *reader, int32_t *id)
+{
+    if(reader->position == reader->size)
+        return false;
+
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do
+    {
+        byte = (uint8_t) reader->data[reader->position++];
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while(byte & 0x80);
+
+    int64_t delta = (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+
+    *id = reader->lastId + delta;
+    reader->lastId = *id;
+
+    return true;
+}
+
+
+float result_cache_read_score(ResultCacheReader *reader)
+{
+    float score;
+
+    memcpy(&score, reader->data + reader->position, sizeof(float));
+    reader->position += sizeof(float);
+
+    return score;
+}
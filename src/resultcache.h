@@ -0,0 +1,89 @@
+#ifndef RESULTCACHE_H_
+#define RESULTCACHE_H_
+
+#include <postgres.h>
+#include <lib/stringinfo.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define RESULT_CACHE_CHUNK_SIZE       4096
+
+
+/*
+ * The key of a cached result: the name of the search function, its options and the query with the trailing white
+ * spaces removed. The key is compared byte by byte, the hash is used only to skip the entries quickly.
+ */
+typedef struct
+{
+    char *data;
+    size_t size;
+    uint32_t hash;
+} ResultCacheKey;
+
+
+/*
+ * The results are stored compressed: the ids as zig-zag varints of the differences to the previous id, so sorted
+ * or nearly sorted id lists take about one or two bytes per hit, and the optional scores as plain floats.
+ */
+typedef struct
+{
+    StringInfoData data;
+    int32_t lastId;
+    bool valid;
+    uint64_t family;
+    const uint8_t *query;
+    size_t querySize;
+} ResultCacheWriter;
+
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t position;
+    int32_t lastId;
+} ResultCacheReader;
+
+
+/*
+ * A complete result stored together with its parsed query molecule. The results of queries of the same family (the
+ * same function and the same matching modes) are supersets of the results of the queries that contain them, so they
+ * can be used as the candidates of refined queries.
+ */
+typedef struct
+{
+    int32_t slot;
+    uint64_t serial;
+    uint8_t *molecule;
+    size_t size;
+    size_t dataSize;
+} ResultCacheQuery;
+
+
+void result_cache_request(void);
+bool result_cache_enabled(void);
+void result_cache_reset(void);
+
+ResultCacheKey result_cache_key(const char *function, const int32_t *options, int optionCount, const char *query,
+        size_t length);
+bool result_cache_lookup(const ResultCacheKey *key, int32_t indexId, ResultCacheReader *reader);
+void result_cache_store(const ResultCacheKey *key, int32_t indexId, ResultCacheWriter *writer);
+int result_cache_find_queries(const char *function, uint64_t family, int32_t indexId, ResultCacheQuery *queries,
+        int limit);
+bool result_cache_fetch_query(const ResultCacheQuery *query, int32_t indexId, ResultCacheReader *reader);
+
+void result_cache_writer_init(ResultCacheWriter *writer);
+void result_cache_write_id(ResultCacheWriter *writer, int32_t id);
+void result_cache_write_score(ResultCacheWriter *writer, float score);
+void result_cache_write_query(ResultCacheWriter *writer, uint64_t family, const uint8_t *molecule, size_t size);
+bool result_cache_read_id(ResultCacheReader *reader, int32_t *id);
+float result_cache_read_score(ResultCacheReader *reader);
+
+
+static inline void result_cache_writer_invalidate(ResultCacheWriter *writer)
+{
+    writer->valid = false;
+}
+
+#endif /* RESULTCACHE_H_ */
@@ -1,5 +1,32 @@
 #include <postgres.h>
 #include <fmgr.h>
+#include <miscadmin.h>
+#include <utils/guc.h>
+#include "resultcache.h"
 
 
 PG_MODULE_MAGIC;
+
+
+int luceneSearchThreads = 0;
+int resultCacheSize = 16384;
+
+
+void _PG_init(void);
+
+
+void _PG_init(void)
+{
+    DefineCustomIntVariable("sachem.lucene_search_threads",
+            "Number of threads used to search the segments of the Lucene index concurrently.",
+            "The value is limited by the number of processors; 0 or 1 searches the segments by the backend itself.",
+            &luceneSearchThreads, 0, 0, 1024, PGC_USERSET, 0, NULL, NULL, NULL);
+
+    DefineCustomIntVariable("sachem.result_cache_size",
+            "Size of the shared memory cache of search results.",
+            "The cache is available only if the library is loaded by shared_preload_libraries; 0 disables it.",
+            &resultCacheSize, 16384, 0, MAX_KILOBYTES, PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+    if(process_shared_preload_libraries_in_progress)
+        result_cache_request();
+}
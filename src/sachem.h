@@ -25,6 +25,12 @@
 #define shm_toc_lookup_key(toc,key) shm_toc_lookup((toc),(key),false)
 #endif
 
+#if PG_VERSION_NUM < 100000
+#define WaitLatchForExtension(latch,events,timeout) WaitLatch((latch),(events),(timeout))
+#else
+#define WaitLatchForExtension(latch,events,timeout) WaitLatch((latch),(events),(timeout),PG_WAIT_EXTENSION)
+#endif
+
 #define PG_MEMCONTEXT_BEGIN(context)    do { MemoryContext old = MemoryContextSwitchTo(context)
 #define PG_MEMCONTEXT_END()             MemoryContextSwitchTo(old);} while(0)
 
@@ -50,6 +56,10 @@
         elog(ERROR, "%s: unexpected exception", __func__);
 
 
+extern int luceneSearchThreads;
+extern int resultCacheSize;
+
+
 static inline void create_base_directory(void)
 {
     Name database = DatumGetName(DirectFunctionCall1(current_database, 0));
@@ -1,20 +1,100 @@
-#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <string>
 #include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
 #include "fingerprints/IOCBFingerprint.hpp"
 
 extern "C"
 {
+#include "fporder.h"
 #include "sachem.h"
 #include "stats.h"
 #include "fingerprints/fingerprint.h"
 }
 
 
-Stats *stats_create()
+/*
+ * Fingerprint counts are aggregated in a hash table. If a capacity is given, the table is kept bounded as a
+ * Misra-Gries (frequent items) summary: whenever it grows over the capacity, the median count is subtracted
+ * from all entries and the entries that drop to zero are removed. Every fingerprint whose count exceeds
+ * total / (capacity / 2) is retained and counts are underestimated by at most the same amount, which is
+ * sufficient for ranking the frequent fingerprints.
+ */
+struct StatsData
+{
+    std::unordered_map<uint32_t,uint32_t> map;
+    size_t capacity;
+};
+
+
+static inline void stats_prune(StatsData &data)
+{
+    if(data.capacity == 0 || data.map.size() <= data.capacity)
+        return;
+
+    std::vector<uint32_t> counts;
+    counts.reserve(data.map.size());
+
+    for(auto &i : data.map)
+        counts.push_back(i.second);
+
+    auto median = counts.begin() + counts.size() / 2;
+    std::nth_element(counts.begin(), median, counts.end());
+    uint32_t decrement = *median;
+
+    for(auto it = data.map.begin(); it != data.map.end();)
+    {
+        if(it->second <= decrement)
+        {
+            it = data.map.erase(it);
+        }
+        else
+        {
+            it->second -= decrement;
+            ++it;
+        }
+    }
+}
+
+
+/*
+ * Writes a new file aside and renames it, so that readers never see a partially written file.
+ */
+static void stats_write_file(const char *name, const void *header, size_t headerSize, const void *data, size_t dataSize)
+{
+    std::string tmpName = std::string(name) + ".tmp";
+    std::ofstream stream(tmpName, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if(!stream.is_open())
+        throw std::runtime_error("cannot create the file");
+
+    stream.write((const char *) header, headerSize);
+    stream.write((const char *) data, dataSize);
+    stream.close();
+
+    if(stream.fail() || rename(tmpName.c_str(), name) != 0)
+    {
+        unlink(tmpName.c_str());
+        throw std::runtime_error("cannot write the file");
+    }
+}
+
+
+Stats *stats_create(size_t capacity)
 {
     SAFE_CPP_BEGIN;
 
-    return (Stats *) new std::map<uint32_t,uint32_t, std::less<uint32_t>>();
+    StatsData *data = new StatsData();
+    data->capacity = capacity;
+
+    if(capacity > 0)
+        data->map.reserve(capacity + capacity / 2);
+
+    return (Stats *) data;
 
     SAFE_CPP_END;
 }
@@ -24,7 +104,7 @@ void stats_delete(Stats *stats)
 {
     SAFE_CPP_BEGIN;
 
-    delete stats;
+    delete (StatsData *) stats;
     return;
 
     SAFE_CPP_END;
@@ -35,18 +115,39 @@ void stats_add(Stats *stats, const Molecule *molecule)
 {
     SAFE_CPP_BEGIN;
 
-    std::map<uint32_t,uint32_t> &map = *((std::map<uint32_t,uint32_t> *) stats);
+    StatsData &data = *((StatsData *) stats);
+
+    std::set<uint32_t> fp = iocb_substructure_fingerprint_get(molecule, GRAPH_SIZE, MAX_FEAT_LOGCOUNT);
+
+    for(uint32_t i : fp)
+        data.map[i]++;
+
+    stats_prune(data);
+    return;
+
+    SAFE_CPP_END;
+}
+
+
+void stats_subtract(Stats *stats, const Molecule *molecule)
+{
+    SAFE_CPP_BEGIN;
+
+    StatsData &data = *((StatsData *) stats);
 
     std::set<uint32_t> fp = iocb_substructure_fingerprint_get(molecule, GRAPH_SIZE, MAX_FEAT_LOGCOUNT);
 
     for(uint32_t i : fp)
     {
-        auto it = map.find(i);
+        auto it = data.map.find(i);
+
+        if(it == data.map.end())
+            continue;
 
-        if(it == map.end())
-            map[i] = 1;
+        if(it->second <= 1)
+            data.map.erase(it);
         else
-            map[i] = map[i] + 1;
+            it->second--;
     }
 
     return;
@@ -59,16 +160,38 @@ void stats_merge(Stats *stats, StatItem *items, size_t size)
 {
     SAFE_CPP_BEGIN;
 
-    std::map<uint32_t,uint32_t> &map = *((std::map<uint32_t,uint32_t> *) stats);
+    StatsData &data = *((StatsData *) stats);
+
+    for(size_t i = 0; i < size; i++)
+        data.map[items[i].fp] += items[i].count;
+
+    stats_prune(data);
+    return;
+
+    SAFE_CPP_END;
+}
+
+
+/*
+ * Subtracts counts merged before; the counts which drop to zero are removed.
+ */
+void stats_unmerge(Stats *stats, StatItem *items, size_t size)
+{
+    SAFE_CPP_BEGIN;
+
+    StatsData &data = *((StatsData *) stats);
 
     for(size_t i = 0; i < size; i++)
     {
-        auto it = map.find(items[i].fp);
+        auto it = data.map.find(items[i].fp);
 
-        if(it == map.end())
-            map[items[i].fp] = items[i].count;
+        if(it == data.map.end())
+            continue;
+
+        if(it->second <= items[i].count)
+            data.map.erase(it);
         else
-            map[items[i].fp] = map[items[i].fp] + items[i].count;
+            it->second -= items[i].count;
     }
 
     return;
@@ -81,12 +204,16 @@ size_t stats_get_items(Stats *stats, StatItem **items)
 {
     SAFE_CPP_BEGIN;
 
-    std::map<uint32_t,uint32_t> &map = *((std::map<uint32_t,uint32_t> *) stats);
+    std::unordered_map<uint32_t,uint32_t> &map = ((StatsData *) stats)->map;
+
+    *items = (StatItem *) palloc_extended(map.size() * sizeof(StatItem), MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+
+    if(*items == NULL)
+        throw std::bad_alloc();
 
-    *items = (StatItem *) palloc(map.size() * sizeof(StatItem));
     StatItem *item = *items;
 
-    for(auto i : map)
+    for(auto &i : map)
     {
         item->fp = i.first;
         item->count = i.second;
@@ -103,30 +230,103 @@ void stats_write(Stats *stats, const char *name, size_t limit)
 {
     SAFE_CPP_BEGIN;
 
-    std::map<uint32_t,uint32_t> &map = *((std::map<uint32_t,uint32_t> *) stats);
+    std::unordered_map<uint32_t,uint32_t> &map = ((StatsData *) stats)->map;
 
-    std::multimap<uint32_t,uint32_t> reverse;
+    std::vector<std::pair<uint32_t,uint32_t>> reverse;
 
-    for(auto i : map)
+    for(auto &i : map)
     {
         if(i.second <= limit)
             continue;
 
-        reverse.insert(std::make_pair(i.second, i.first));
+        reverse.push_back(std::make_pair(i.second, i.first));
     }
 
-    std::ofstream stream(name, std::ios::out | std::ios::binary);
+    std::sort(reverse.begin(), reverse.end());
+
+    uint32_t mask = 1;
+
+    while(mask + 1 < 2 * reverse.size())
+        mask = 2 * mask + 1;
+
+    std::vector<FporderSlot> slots(mask + 1, FporderSlot{0, ORDER_UNKNOWN_RANK});
+    int32_t rank = 0;
 
-    if(stream.is_open())
+    for(auto i : reverse)
     {
-        for(auto i : reverse)
-        {
-            uint32_t value = i.second;
-            stream.write((char *) &value, sizeof(uint32_t));
-        }
+        uint32_t index = fporder_hash(i.second, mask);
+
+        while(slots[index].rank != ORDER_UNKNOWN_RANK)
+            index = (index + 1) & mask;
+
+        slots[index].fp = i.second;
+        slots[index].rank = rank++;
     }
 
+    FporderHeader header = { ORDER_FILE_MAGIC, (uint32_t) reverse.size(), mask, 0 };
+
+
+    stats_write_file(name, &header, sizeof(FporderHeader), slots.data(), slots.size() * sizeof(FporderSlot));
+    return;
+
+    SAFE_CPP_END;
+}
+
+
+void stats_save(Stats *stats, const char *name, size_t limit)
+{
+    SAFE_CPP_BEGIN;
+
+    std::unordered_map<uint32_t,uint32_t> &map = ((StatsData *) stats)->map;
+
+    std::vector<StatItem> items;
+    items.reserve(map.size());
+
+    for(auto &i : map)
+        items.push_back(StatItem{i.first, i.second});
+
+    std::sort(items.begin(), items.end(), [](const StatItem &a, const StatItem &b) { return a.fp < b.fp; });
+
+    StatsHeader header = { COUNTS_FILE_MAGIC, 0, limit, items.size() };
+
+    stats_write_file(name, &header, sizeof(StatsHeader), items.data(), items.size() * sizeof(StatItem));
     return;
 
     SAFE_CPP_END;
 }
+
+
+bool stats_load(Stats *stats, const char *name, size_t *limit)
+{
+    SAFE_CPP_BEGIN;
+
+    StatsData &data = *((StatsData *) stats);
+
+    std::ifstream stream(name, std::ios::in | std::ios::binary);
+
+    if(!stream.is_open())
+        return false;
+
+    StatsHeader header;
+    stream.read((char *) &header, sizeof(StatsHeader));
+
+    if(stream.fail() || header.magic != COUNTS_FILE_MAGIC)
+        return false;
+
+    std::vector<StatItem> items(header.count);
+    stream.read((char *) items.data(), items.size() * sizeof(StatItem));
+
+    if(stream.fail())
+        return false;
+
+    data.map.clear();
+    data.map.reserve(items.size());
+
+    for(auto &i : items)
+        data.map[i.fp] = i.count;
+
+    *limit = header.limit;
+    return true;
+
+    SAFE_CPP_END;
+}
@@ -14,11 +14,27 @@ typedef struct
 } StatItem;
 
 
-Stats *stats_create();
+#define COUNTS_FILE_MAGIC       0x43505346
+
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t limit;
+    uint64_t count;
+} StatsHeader;
+
+
+Stats *stats_create(size_t capacity);
 void stats_delete(Stats *stats);
 void stats_add(Stats *stats, const Molecule *molecule);
+void stats_subtract(Stats *stats, const Molecule *molecule);
 void stats_merge(Stats *stats, StatItem *items, size_t size);
+void stats_unmerge(Stats *stats, StatItem *items, size_t size);
 size_t stats_get_items(Stats *stats, StatItem **items);
 void stats_write(Stats *stats, const char *name, size_t limit);
+void stats_save(Stats *stats, const char *name, size_t limit);
+bool stats_load(Stats *stats, const char *name, size_t *limit);
 
 #endif /* STATS_H__ */
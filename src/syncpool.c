@@ -0,0 +1,860 @@
+#include <postgres.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <libpq/pqsignal.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <port/atomics.h>
+#include <postmaster/bgworker.h>
+#include <storage/dsm.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/proc.h>
+#include <storage/shm_toc.h>
+#include <storage/spin.h>
+#include <tcop/tcopprot.h>
+#include <utils/memutils.h>
+#include <utils/resowner.h>
+#include "sachem.h"
+#include "syncpool.h"
+
+
+#define SYNC_POOL_MAGIC         0x53594e43
+#define HEADER_KEY              0
+#define SLOT_KEY                1
+#define DATA_KEY                2
+#define QUEUE_KEY               3
+#define IDEX_KEY_OFFSET         4
+#define WAIT_TIMEOUT            100L
+#define FETCH_SIZE              100000
+#define QUEUE_SIZE              1000
+#define MOLECULES_TABLE         "sachem_molecules"
+#define MOLECULE_ERRORS_TABLE   "sachem_molecule_errors"
+#define AUDIT_TABLE             "sachem_compound_audit"
+
+#define CLAIM_SIZE              32
+#define ERROR_MESSAGE_SIZE      1024
+
+
+typedef void (*SyncPoolWorkerFunction)(dsm_segment *seg, shm_toc *toc);
+
+
+typedef struct SyncPoolHeader
+{
+    slock_t mutex;
+    int attachedWorkers;
+    int completedWorkers;
+    bool counting;
+    bool finished;
+    bool failing;
+    bool failed;
+    bool cancelled;
+    char message[ERROR_MESSAGE_SIZE];
+    PGPROC *leader;
+    PGPROC *workers[FLEXIBLE_ARRAY_MEMBER];
+} SyncPoolHeader;
+
+
+/*
+ * A slot holds one batch: the molecule data are stored contiguously from the beginning of the slot and the
+ * table of entries grows downwards from its end. The claim word packs the entry count (high half) with the
+ * next unclaimed position (low half), so a single fetch-add both claims a range and tells whether it is valid;
+ * the leader reuses the slot once the done counter reaches the count.
+ */
+typedef struct SyncPoolSlot
+{
+    pg_atomic_uint64 claim;
+    pg_atomic_uint32 done;
+    uint32_t count;
+} SyncPoolSlot;
+
+
+/*
+ * A deleted entry carries a molecule removed from the index, whose fingerprints are only subtracted from the
+ * counts.
+ */
+typedef struct
+{
+    int32_t id;
+    uint32_t offset;
+    bool deleted;
+} SyncPoolEntry;
+
+
+/*
+ * The launch number of a worker selects its pair of count queues, so that the leader can receive from a queue
+ * whose worker has not attached yet and learns from the worker handle when it never will.
+ */
+typedef struct
+{
+    int number;
+    char function[BGW_EXTRALEN - sizeof(int)];
+} SyncPoolWorkerExtra;
+
+
+PGDLLEXPORT void sync_pool_worker_main(Datum arg);
+
+
+static inline SyncPoolEntry *get_entry(char *data, int slot, uint32_t position)
+{
+    return (SyncPoolEntry *) (data + (slot + 1) * (Size) SYNC_POOL_SLOT_SIZE) - (position + 1);
+}
+
+
+/* the queue of the removed counts of a worker is followed by the queue of its added counts */
+static inline shm_mq *get_queue(shm_mq *queues, int number, bool added)
+{
+    return (shm_mq *) ((char *) queues + (2 * number + added) * QUEUE_SIZE * sizeof(StatItem));
+}
+
+
+void sync_pool_begin(SyncPool *pool, char *function, SyncPoolIndexFunction serial, char **subindexPath, int workers,
+        Stats *counts)
+{
+    pool->function = function;
+    pool->counts = counts;
+    pool->serial = serial;
+    pool->subindexPath = subindexPath;
+    pool->workers = workers;
+    pool->started = false;
+    pool->launched = 0;
+
+    pool->slot = 0;
+    pool->count = 0;
+    pool->size = 0;
+    pool->acquired = false;
+
+    pool->moleculesPlan = SPI_prepare("insert into " MOLECULES_TABLE " (id, molecule) values ($1,$2)",
+            2, (Oid[]) { INT4OID, BYTEAOID });
+
+    pool->errorsPlan = SPI_prepare("insert into " MOLECULE_ERRORS_TABLE " (compound, message) values ($1,$2)",
+            2, (Oid[]) { INT4OID, TEXTOID });
+
+    if(unlikely(pool->moleculesPlan == NULL || pool->errorsPlan == NULL))
+        elog(ERROR, "%s: SPI_prepare() failed", __func__);
+}
+
+
+/*
+ * Workers which are still waiting for molecules when the leader detaches from the segment (typically because
+ * its transaction has been aborted) must not commit their subindexes.
+ */
+static void cancel_workers(dsm_segment *seg, Datum arg)
+{
+    volatile SyncPoolHeader *header = (SyncPoolHeader *) DatumGetPointer(arg);
+
+    SpinLockAcquire(&header->mutex);
+    header->cancelled = true;
+    int attachedWorkers = header->attachedWorkers;
+    SpinLockRelease(&header->mutex);
+
+    for(int i = 0; i < attachedWorkers; i++)
+        SetLatch(&header->workers[i]->procLatch);
+}
+
+
+static void start_pool(SyncPool *pool)
+{
+    int workers = pool->workers;
+    size_t headerSize = offsetof(SyncPoolHeader, workers) + workers * sizeof(PGPROC *);
+
+    shm_toc_estimator estimator;
+    shm_toc_initialize_estimator(&estimator);
+
+    shm_toc_estimate_keys(&estimator, 4 + workers);
+    shm_toc_estimate_chunk(&estimator, headerSize);
+    shm_toc_estimate_chunk(&estimator, SYNC_POOL_SLOT_COUNT * sizeof(SyncPoolSlot));
+    shm_toc_estimate_chunk(&estimator, SYNC_POOL_SLOT_COUNT * (Size) SYNC_POOL_SLOT_SIZE);
+    shm_toc_estimate_chunk(&estimator, 2 * workers * QUEUE_SIZE * sizeof(StatItem));
+
+    for(int i = 0; i < workers; i++)
+        shm_toc_estimate_chunk(&estimator, strlen(pool->subindexPath[i]) + 1);
+
+    Size segmentSize = shm_toc_estimate(&estimator);
+
+    pool->seg = dsm_create(segmentSize, 0);
+    shm_toc *toc = shm_toc_create(SYNC_POOL_MAGIC, dsm_segment_address(pool->seg), segmentSize);
+
+    for(int i = 0; i < workers; i++)
+    {
+        void *path = shm_toc_allocate(toc, strlen(pool->subindexPath[i]) + 1);
+        strcpy(path, pool->subindexPath[i]);
+        shm_toc_insert(toc, IDEX_KEY_OFFSET + i, path);
+    }
+
+    pool->data = shm_toc_allocate(toc, SYNC_POOL_SLOT_COUNT * (Size) SYNC_POOL_SLOT_SIZE);
+    shm_toc_insert(toc, DATA_KEY, pool->data);
+
+    pool->slots = shm_toc_allocate(toc, SYNC_POOL_SLOT_COUNT * sizeof(SyncPoolSlot));
+    shm_toc_insert(toc, SLOT_KEY, pool->slots);
+
+    for(int i = 0; i < SYNC_POOL_SLOT_COUNT; i++)
+    {
+        pg_atomic_init_u64(&pool->slots[i].claim, 0);
+        pg_atomic_init_u32(&pool->slots[i].done, 0);
+        pool->slots[i].count = 0;
+    }
+
+    shm_mq *queues = shm_toc_allocate(toc, 2 * workers * QUEUE_SIZE * sizeof(StatItem));
+    shm_toc_insert(toc, QUEUE_KEY, queues);
+
+    for(int i = 0; i < workers; i++)
+    {
+        for(int q = 0; q < 2; q++)
+        {
+            shm_mq *queue = shm_mq_create(get_queue(queues, i, q), QUEUE_SIZE * sizeof(StatItem));
+            shm_mq_set_receiver(queue, MyProc);
+        }
+    }
+
+    pool->header = shm_toc_allocate(toc, headerSize);
+    SpinLockInit(&pool->header->mutex);
+    pool->header->attachedWorkers = 0;
+    pool->header->completedWorkers = 0;
+    pool->header->counting = pool->counts != NULL;
+    pool->header->finished = false;
+    pool->header->failing = false;
+    pool->header->failed = false;
+    pool->header->message[0] = '\0';
+    pool->header->cancelled = false;
+    pool->header->leader = MyProc;
+    shm_toc_insert(toc, HEADER_KEY, pool->header);
+
+    on_dsm_detach(pool->seg, cancel_workers, PointerGetDatum(pool->header));
+
+
+    BackgroundWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "libsachem");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "sync_pool_worker_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "sachem index worker for PID %d", MyProcPid);
+#if PG_VERSION_NUM >= 110000
+    snprintf(worker.bgw_type, BGW_MAXLEN, "sachem index worker");
+#endif
+    worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(pool->seg));
+    worker.bgw_notify_pid = MyProcPid;
+
+    SyncPoolWorkerExtra extra;
+    memset(&extra, 0, sizeof(extra));
+    strlcpy(extra.function, pool->function, sizeof(extra.function));
+
+    pool->handles = palloc(workers * sizeof(BackgroundWorkerHandle *));
+    pool->queues = palloc(2 * workers * sizeof(shm_mq_handle *));
+
+    for(int i = 0; i < workers; i++)
+    {
+        extra.number = pool->launched;
+        memcpy(worker.bgw_extra, &extra, sizeof(extra));
+
+        if(!RegisterDynamicBackgroundWorker(&worker, &pool->handles[pool->launched]))
+            break;
+
+        for(int q = 0; q < 2; q++)
+            pool->queues[2 * pool->launched + q] = shm_mq_attach(get_queue(queues, pool->launched, q), pool->seg,
+                    pool->handles[pool->launched]);
+
+        pool->launched++;
+    }
+
+    if(pool->launched == 0)
+        elog(NOTICE, "no index worker can be launched, the molecules are indexed by the leader");
+
+    pool->started = true;
+}
+
+
+static void wake_workers(SyncPool *pool)
+{
+    volatile SyncPoolHeader *header = pool->header;
+
+    SpinLockAcquire(&header->mutex);
+    int attachedWorkers = header->attachedWorkers;
+    SpinLockRelease(&header->mutex);
+
+    for(int i = 0; i < attachedWorkers; i++)
+        SetLatch(&header->workers[i]->procLatch);
+}
+
+
+static void report_failure(SyncPool *pool)
+{
+    volatile SyncPoolHeader *header = pool->header;
+
+    SpinLockAcquire(&header->mutex);
+    bool failed = header->failed;
+    SpinLockRelease(&header->mutex);
+
+    /* the message is written before the flag is set and it is not changed afterwards */
+    if(failed)
+        elog(ERROR, "%s: an index worker has failed: %s", __func__, pool->header->message);
+}
+
+
+/*
+ * The workers do not stop before the pool is finished, so a stopped worker has failed; a worker terminated by
+ * a FATAL error or a signal leaves its claimed molecules unprocessed and does not get to record the failure.
+ */
+static void check_workers(SyncPool *pool)
+{
+    report_failure(pool);
+
+    for(int i = 0; i < pool->launched; i++)
+    {
+        pid_t pid;
+
+        if(GetBackgroundWorkerPid(pool->handles[i], &pid) == BGWH_STOPPED)
+        {
+            /* the worker may have recorded its failure just before it has stopped */
+            report_failure(pool);
+
+            elog(ERROR, "%s: an index worker has exited prematurely", __func__);
+        }
+    }
+}
+
+
+static void acquire_slot(SyncPool *pool)
+{
+    if(!pool->started)
+        start_pool(pool);
+
+    SyncPoolSlot *slot = &pool->slots[pool->slot];
+
+    while(true)
+    {
+        ResetLatch(MyLatch);
+
+        if(pg_atomic_read_u32(&slot->done) == slot->count)
+            break;
+
+        int rc = WaitLatchForExtension(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, WAIT_TIMEOUT);
+
+        if(rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+
+        CHECK_FOR_INTERRUPTS();
+
+        check_workers(pool);
+    }
+
+    /* the workers have stopped reading the slot */
+    pg_memory_barrier();
+
+    pool->count = 0;
+    pool->size = 0;
+    pool->acquired = true;
+}
+
+
+static void publish_slot(SyncPool *pool)
+{
+    SyncPoolSlot *slot = &pool->slots[pool->slot];
+
+    slot->count = pool->count;
+    pg_atomic_write_u32(&slot->done, 0);
+
+    pg_write_barrier();
+    pg_atomic_write_u64(&slot->claim, (uint64) pool->count << 32);
+
+    if(pool->launched > 0)
+    {
+        wake_workers(pool);
+    }
+    else
+    {
+        /* without workers, the leader indexes the batch into the first subindex itself */
+        SyncPoolWorker worker;
+
+        worker.header = pool->header;
+        worker.slots = pool->slots;
+        worker.data = pool->data;
+        worker.seg = pool->seg;
+        worker.queues = NULL;
+        worker.slot = pool->slot;
+        worker.claimed = -1;
+        worker.begin = 0;
+        worker.position = 0;
+        worker.end = 0;
+        worker.serial = true;
+
+        /* the batches are indexed in order, so the leader updates the counts of the sync directly */
+        worker.added = pool->counts;
+        worker.removed = NULL;
+
+        pool->serial(&worker, pool->subindexPath[0]);
+    }
+
+    pool->slot = (pool->slot + 1) % SYNC_POOL_SLOT_COUNT;
+    pool->acquired = false;
+}
+
+
+static void put_molecule(SyncPool *pool, int32_t id, bytea *molecule, bool deleted)
+{
+    size_t size = VARSIZE(molecule) - VARHDRSZ;
+
+    if(MAXALIGN(size) + sizeof(SyncPoolEntry) > SYNC_POOL_SLOT_SIZE)
+        elog(ERROR, "%s: molecule %i is too large", __func__, id);
+
+    if(pool->acquired && pool->size + MAXALIGN(size) + (pool->count + 1) * sizeof(SyncPoolEntry) > SYNC_POOL_SLOT_SIZE)
+        publish_slot(pool);
+
+    if(!pool->acquired)
+        acquire_slot(pool);
+
+    SyncPoolEntry *entry = get_entry(pool->data, pool->slot, pool->count);
+    entry->id = id;
+    entry->offset = pool->size;
+    entry->deleted = deleted;
+    memcpy(pool->data + pool->slot * (Size) SYNC_POOL_SLOT_SIZE + pool->size, VARDATA(molecule), size);
+
+    pool->size += MAXALIGN(size);
+    pool->count++;
+}
+
+
+/*
+ * Queues the stored molecules of the compounds recorded in the audit table, so that the workers subtract their
+ * fingerprints from the counts; it has to be called before the molecules are deleted from the table.
+ */
+void sync_pool_subtract_deleted(SyncPool *pool)
+{
+    if(pool->counts == NULL)
+        return;
+
+    char isNullFlag;
+
+    Portal moleculeCursor = SPI_cursor_open_with_args(NULL, "select tbl.id, tbl.molecule from " MOLECULES_TABLE " tbl, "
+            AUDIT_TABLE " aud where tbl.id = aud.id", 0, NULL, NULL, NULL, false, CURSOR_OPT_BINARY | CURSOR_OPT_NO_SCROLL);
+
+    while(true)
+    {
+        SPI_cursor_fetch(moleculeCursor, true, FETCH_SIZE);
+
+        if(unlikely(SPI_tuptable == NULL || SPI_tuptable->tupdesc->natts != 2))
+            elog(ERROR, "%s: SPI_cursor_fetch() failed", __func__);
+
+        if(SPI_processed == 0)
+            break;
+
+        for(size_t i = 0; i < SPI_processed; i++)
+        {
+            CHECK_FOR_INTERRUPTS();
+
+            Datum id = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            Datum mol = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2, &isNullFlag);
+
+            if(unlikely(SPI_result == SPI_ERROR_NOATTRIBUTE || isNullFlag))
+                elog(ERROR, "%s: SPI_getbinval() failed", __func__);
+
+            bytea *data = DatumGetByteaP(mol);
+
+            put_molecule(pool, DatumGetInt32(id), data, true);
+
+            if((char *) data != DatumGetPointer(mol))
+                pfree(data);
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(moleculeCursor);
+
+    sync_pool_flush(pool);
+}
+
+
+void sync_pool_add(SyncPool *pool, Datum id, LoaderData *data)
+{
+    if(data->error != NULL)
+    {
+        char *message = text_to_cstring(data->error);
+        elog(NOTICE, "%i: %s", DatumGetInt32(id), message);
+        pfree(message);
+
+        Datum values[] = { id, PointerGetDatum(data->error) };
+
+        if(SPI_execute_plan(pool->errorsPlan, values, NULL, false, 0) != SPI_OK_INSERT)
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+    }
+
+    if(data->molecule != NULL)
+    {
+        put_molecule(pool, DatumGetInt32(id), data->molecule, false);
+
+        Datum values[] = { id, PointerGetDatum(data->molecule) };
+
+        if(SPI_execute_plan(pool->moleculesPlan, values, NULL, false, 0) != SPI_OK_INSERT)
+            elog(ERROR, "%s: SPI_execute_plan() failed", __func__);
+    }
+}
+
+
+void sync_pool_flush(SyncPool *pool)
+{
+    if(pool->acquired && pool->count > 0)
+        publish_slot(pool);
+}
+
+
+/*
+ * Receives the counts of one worker until the worker detaches from the queue; a worker which fails or never
+ * starts detaches as well, and its failure is reported afterwards.
+ */
+static void receive_counts(SyncPool *pool, shm_mq_handle *in, bool added)
+{
+    while(true)
+    {
+        Size bytes;
+        StatItem *items;
+        shm_mq_result result = shm_mq_receive(in, &bytes, (void *) &items, false);
+
+        if(result == SHM_MQ_DETACHED)
+            break;
+        else if(result != SHM_MQ_SUCCESS)
+            elog(ERROR, "%s: shm_mq_receive() failed", __func__);
+
+        if(added)
+            stats_merge(pool->counts, items, bytes / sizeof(StatItem));
+        else
+            stats_unmerge(pool->counts, items, bytes / sizeof(StatItem));
+    }
+}
+
+
+int sync_pool_end(SyncPool *pool)
+{
+    int subindexCount = 0;
+
+    sync_pool_flush(pool);
+
+    SPI_freeplan(pool->moleculesPlan);
+    SPI_freeplan(pool->errorsPlan);
+
+    if(!pool->started)
+        return subindexCount;
+
+
+    volatile SyncPoolHeader *header = pool->header;
+
+    SpinLockAcquire(&header->mutex);
+    header->finished = true;
+    SpinLockRelease(&header->mutex);
+
+    wake_workers(pool);
+
+    /* the workers send their counts once all molecules are handed out, before they commit their subindexes */
+    if(pool->counts != NULL)
+    {
+        for(int i = 0; i < pool->launched; i++)
+        {
+            receive_counts(pool, pool->queues[2 * i], false);
+            receive_counts(pool, pool->queues[2 * i + 1], true);
+        }
+    }
+
+    for(int i = 0; i < pool->launched; i++)
+        if(WaitForBackgroundWorkerShutdown(pool->handles[i]) == BGWH_POSTMASTER_DIED)
+            proc_exit(1);
+
+    report_failure(pool);
+
+    SpinLockAcquire(&header->mutex);
+    int attachedWorkers = header->attachedWorkers;
+    int completedWorkers = header->completedWorkers;
+    SpinLockRelease(&header->mutex);
+
+    if(completedWorkers != attachedWorkers)
+        elog(ERROR, "%s: an index worker has exited prematurely", __func__);
+
+    for(int i = 0; i < SYNC_POOL_SLOT_COUNT; i++)
+        if(pg_atomic_read_u32(&pool->slots[i].done) != pool->slots[i].count)
+            elog(ERROR, "%s: index workers have exited prematurely", __func__);
+
+    subindexCount = pool->launched > 0 ? attachedWorkers : 1;
+
+    dsm_detach(pool->seg);
+    pfree(pool->handles);
+    pfree(pool->queues);
+
+    return subindexCount;
+}
+
+
+/*
+ * The entry point of the background workers: attaches to the segment of the pool and runs the index function
+ * of the backend. The message of a failure is recorded in the header, so that the leader does not wait for the
+ * worker and reports why it has failed.
+ */
+void sync_pool_worker_main(Datum arg)
+{
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "sachem index worker");
+
+    dsm_segment *seg = dsm_attach(DatumGetUInt32(arg));
+
+    if(unlikely(seg == NULL))
+        elog(ERROR, "%s: dsm_attach() failed", __func__);
+
+    shm_toc *toc = shm_toc_attach(SYNC_POOL_MAGIC, dsm_segment_address(seg));
+
+    if(unlikely(toc == NULL))
+        elog(ERROR, "%s: shm_toc_attach() failed", __func__);
+
+    volatile SyncPoolHeader *header = shm_toc_lookup_key(toc, HEADER_KEY);
+
+    PG_TRY();
+    {
+        SyncPoolWorkerExtra *extra = (SyncPoolWorkerExtra *) MyBgworkerEntry->bgw_extra;
+
+        SyncPoolWorkerFunction function = (SyncPoolWorkerFunction)
+                load_external_function("libsachem", extra->function, true, NULL);
+
+        function(seg, toc);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(TopMemoryContext);
+        ErrorData *edata = CopyErrorData();
+
+        /* the first failing worker writes its message outside of the spinlock and publishes it afterwards */
+        SpinLockAcquire(&header->mutex);
+        bool first = !header->failing;
+        header->failing = true;
+        SpinLockRelease(&header->mutex);
+
+        if(first)
+        {
+            strlcpy((char *) header->message, edata->message != NULL ? edata->message : "unknown error",
+                    ERROR_MESSAGE_SIZE);
+
+            SpinLockAcquire(&header->mutex);
+            header->failed = true;
+            SpinLockRelease(&header->mutex);
+        }
+
+        SetLatch(&header->leader->procLatch);
+
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    SpinLockAcquire(&header->mutex);
+    header->completedWorkers++;
+    SpinLockRelease(&header->mutex);
+
+    SetLatch(&header->leader->procLatch);
+
+    dsm_detach(seg);
+}
+
+
+char *sync_pool_attach(SyncPoolWorker *worker, dsm_segment *seg, shm_toc *toc)
+{
+    worker->header = shm_toc_lookup_key(toc, HEADER_KEY);
+    worker->slots = shm_toc_lookup_key(toc, SLOT_KEY);
+    worker->data = shm_toc_lookup_key(toc, DATA_KEY);
+    worker->seg = seg;
+    worker->queues = get_queue(shm_toc_lookup_key(toc, QUEUE_KEY),
+            ((SyncPoolWorkerExtra *) MyBgworkerEntry->bgw_extra)->number, false);
+    worker->claimed = -1;
+    worker->begin = 0;
+    worker->position = 0;
+    worker->end = 0;
+    worker->serial = false;
+    worker->added = NULL;
+    worker->removed = NULL;
+
+    if(worker->header->counting)
+    {
+        worker->added = stats_create(0);
+        worker->removed = stats_create(0);
+    }
+
+    volatile SyncPoolHeader *header = worker->header;
+
+    SpinLockAcquire(&header->mutex);
+    int workerNumber = header->attachedWorkers++;
+    header->workers[workerNumber] = MyProc;
+    SpinLockRelease(&header->mutex);
+
+    worker->slot = workerNumber % SYNC_POOL_SLOT_COUNT;
+
+    return shm_toc_lookup_key(toc, IDEX_KEY_OFFSET + workerNumber);
+}
+
+
+static bool claim_range(SyncPoolWorker *worker)
+{
+    for(int i = 0; i < SYNC_POOL_SLOT_COUNT; i++)
+    {
+        int s = (worker->slot + i) % SYNC_POOL_SLOT_COUNT;
+        SyncPoolSlot *slot = &worker->slots[s];
+
+        uint64 claim = pg_atomic_read_u64(&slot->claim);
+
+        if((uint32) claim >= (uint32) (claim >> 32))
+            continue;
+
+        claim = pg_atomic_fetch_add_u64(&slot->claim, CLAIM_SIZE);
+
+        uint32_t position = (uint32) claim;
+        uint32_t count = (uint32) (claim >> 32);
+
+        if(position >= count)
+            continue;
+
+        worker->slot = s;
+        worker->claimed = s;
+        worker->begin = position;
+        worker->position = position;
+        worker->end = position + CLAIM_SIZE < count ? position + CLAIM_SIZE : count;
+        return true;
+    }
+
+    return false;
+}
+
+
+static void send_counts(SyncPoolWorker *worker, shm_mq *queue, Stats *stats)
+{
+    shm_mq_set_sender(queue, MyProc);
+    shm_mq_handle *out = shm_mq_attach(queue, worker->seg, NULL);
+
+    StatItem *items;
+    size_t count = stats_get_items(stats, &items);
+
+    for(size_t i = 0; i < count; i += QUEUE_SIZE)
+    {
+        size_t size = count - i;
+
+        if(size > QUEUE_SIZE)
+            size = QUEUE_SIZE;
+
+        shm_mq_result result = shm_mq_send(out, size * sizeof(StatItem), items + i, false);
+
+        if(result != SHM_MQ_SUCCESS)
+            elog(ERROR, "%s: shm_mq_send() failed", __func__);
+    }
+
+    pfree(items);
+
+#if PG_VERSION_NUM < 100000
+    shm_mq_detach(queue);
+#else
+    shm_mq_detach(out);
+#endif
+}
+
+
+/*
+ * Returns the next molecule to be indexed; the molecule data stay valid until the next call. Waits while the
+ * leader is parsing and returns false when all molecules have been handed out (for the serial worker of the
+ * leader, when the published slot has been handed out). The deleted molecules are counted here and not
+ * returned; a worker sends its counts to the leader before it returns false.
+ */
+bool sync_pool_next(SyncPoolWorker *worker, int32_t *id, uint8_t **molecule)
+{
+    volatile SyncPoolHeader *header = worker->header;
+
+    while(true)
+    {
+        if(worker->claimed >= 0 && worker->position == worker->end)
+        {
+            SyncPoolSlot *slot = &worker->slots[worker->claimed];
+            uint32_t processed = worker->end - worker->begin;
+
+            if(pg_atomic_fetch_add_u32(&slot->done, processed) + processed == slot->count)
+                SetLatch(&header->leader->procLatch);
+
+            worker->claimed = -1;
+        }
+
+
+        while(worker->claimed < 0)
+        {
+            ResetLatch(MyLatch);
+
+            /* read before the slots are inspected: all slots are published before the pool is finished */
+            SpinLockAcquire(&header->mutex);
+            bool finished = header->finished;
+            bool cancelled = header->cancelled;
+            SpinLockRelease(&header->mutex);
+
+            if(cancelled)
+                elog(ERROR, "%s: the sync has been cancelled", __func__);
+
+            if(claim_range(worker))
+                break;
+
+            /* the leader indexes one published batch at a time */
+            if(worker->serial)
+                return false;
+
+            if(finished)
+            {
+                if(worker->added != NULL)
+                {
+                    send_counts(worker, worker->queues, worker->removed);
+                    send_counts(worker, get_queue(worker->queues, 0, true), worker->added);
+
+                    stats_delete(worker->removed);
+                    stats_delete(worker->added);
+                    worker->removed = NULL;
+                    worker->added = NULL;
+                }
+
+                return false;
+            }
+
+            int rc = WaitLatchForExtension(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, WAIT_TIMEOUT);
+
+            if(rc & WL_POSTMASTER_DEATH)
+                proc_exit(1);
+
+            CHECK_FOR_INTERRUPTS();
+        }
+
+
+        SyncPoolEntry *entry = get_entry(worker->data, worker->claimed, worker->position++);
+        uint8_t *data = (uint8_t *) (worker->data + worker->claimed * (Size) SYNC_POOL_SLOT_SIZE + entry->offset);
+
+        if(!entry->deleted)
+        {
+            *id = entry->id;
+            *molecule = data;
+            return true;
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        Molecule deleted;
+        molecule_simple_init(&deleted, data);
+
+        if(worker->removed != NULL)
+            stats_add(worker->removed, &deleted);
+        else
+            stats_subtract(worker->added, &deleted);
+
+        molecule_simple_free(&deleted);
+    }
+}
+
+
+/*
+ * Counts the fingerprints of a molecule returned by sync_pool_next(), if the pool maintains the counts.
+ */
+void sync_pool_count(SyncPoolWorker *worker, Molecule *molecule)
+{
+    if(worker->added != NULL)
+        stats_add(worker->added, molecule);
+}
@@ -0,0 +1,97 @@
+#ifndef SYNCPOOL_H_
+#define SYNCPOOL_H_
+
+#include <postgres.h>
+#include <executor/spi.h>
+#include <postmaster/bgworker.h>
+#include <storage/dsm.h>
+#include <storage/shm_mq.h>
+#include <storage/shm_toc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "java/parse.h"
+#include "stats.h"
+
+
+#define SYNC_POOL_SLOT_COUNT          3
+#define SYNC_POOL_SLOT_SIZE           (16 * 1024 * 1024)
+
+
+struct SyncPoolHeader;
+struct SyncPoolSlot;
+
+
+typedef struct
+{
+    struct SyncPoolHeader *header;
+    struct SyncPoolSlot *slots;
+    char *data;
+    dsm_segment *seg;
+    shm_mq *queues;
+    int slot;
+    int claimed;
+    uint32_t begin;
+    uint32_t position;
+    uint32_t end;
+    bool serial;
+    Stats *added;
+    Stats *removed;
+} SyncPoolWorker;
+
+
+/*
+ * Indexes the molecules handed out by sync_pool_next() into the given subindex. The leader calls it directly
+ * when no worker can be launched; the serial worker returns false from sync_pool_next() once the published
+ * slot is drained instead of waiting for the next one.
+ */
+typedef void (*SyncPoolIndexFunction)(SyncPoolWorker *worker, char *indexPath);
+
+
+/*
+ * The leader side of a pool of index workers that lives for the whole sync. The leader parses the molecules
+ * batch by batch and serialises them into a ring of shared slots; the workers claim ranges of molecules with
+ * an atomic fetch-add and index them into their own subindexes meanwhile. The workers are dynamic background
+ * workers attached to a plain shared memory segment rather than a parallel context, so the leader does not
+ * enter the parallel mode and writes the rows of the molecule tables as the batches are added. The workers are
+ * started with the first queued molecule, so a sync without changes launches none.
+ *
+ * When the pool is given fingerprint counts, the workers maintain them as well: each worker counts the
+ * fingerprints of the molecules it indexes and of the deleted molecules queued by sync_pool_subtract_deleted(),
+ * and the leader merges the counts of the workers when the pool ends.
+ */
+typedef struct
+{
+    char *function;
+    SyncPoolIndexFunction serial;
+    char **subindexPath;
+    int workers;
+    bool started;
+    dsm_segment *seg;
+    BackgroundWorkerHandle **handles;
+    int launched;
+    struct SyncPoolHeader *header;
+    struct SyncPoolSlot *slots;
+    char *data;
+    shm_mq_handle **queues;
+    Stats *counts;
+    int slot;
+    uint32_t count;
+    size_t size;
+    bool acquired;
+    SPIPlanPtr moleculesPlan;
+    SPIPlanPtr errorsPlan;
+} SyncPool;
+
+
+void sync_pool_begin(SyncPool *pool, char *function, SyncPoolIndexFunction serial, char **subindexPath, int workers,
+        Stats *counts);
+void sync_pool_subtract_deleted(SyncPool *pool);
+void sync_pool_add(SyncPool *pool, Datum id, LoaderData *data);
+void sync_pool_flush(SyncPool *pool);
+int sync_pool_end(SyncPool *pool);
+
+char *sync_pool_attach(SyncPoolWorker *worker, dsm_segment *seg, shm_toc *toc);
+bool sync_pool_next(SyncPoolWorker *worker, int32_t *id, uint8_t **molecule);
+void sync_pool_count(SyncPoolWorker *worker, Molecule *molecule);
+
+#endif /* SYNCPOOL_H_ */